@@ -0,0 +1,401 @@
+// bench.cpp : throughput benchmarks run with "pkg-merge -bench"
+//
+
+#include "stdafx.h"
+#include "bench.h"
+#include "copyengine.h"
+#include "checksum.h"
+#include "pkgheader.h"
+#include "parallelcopy.h"
+#include "metrics.h"
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <fstream>
+#endif
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+
+const size_t BENCH_BUFFER_SIZE = 8 * 1024 * 1024;
+
+// Helper function to fill a buffer with incompressible data, so no layer below us can cheat
+static void fillPseudoRandom(char* buffer, size_t size, uint64_t& seed) {
+	for (size_t i = 0; i + 8 <= size; i += 8) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		memcpy(buffer + i, &seed, 8);
+	}
+}
+
+static double megabytesPerSecond(uint64_t bytes, double seconds) {
+	return seconds > 0 ? (double)bytes / (1024.0 * 1024.0) / seconds : 0;
+}
+
+// Helper function to time one buffered copy of `source` into `target`, optionally through the inline hasher
+static double timeCopy(const fs::path& source, const fs::path& target, uint64_t size, char* buffer, bool hash) {
+	FileHandle src = openForRead(source);
+	FileHandle dst = openForWrite(target, true);
+	if (src == INVALID_FILE || dst == INVALID_FILE) {
+		closeFile(src);
+		closeFile(dst);
+		return -1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::unique_ptr<InlineHasher> hasher;
+	CopyTap tap;
+	if (hash) {
+		hasher.reset(new InlineHasher(BENCH_BUFFER_SIZE));
+		hasher->beginPart(source.filename().string());
+		tap = [&](const char* data, size_t length) { hasher->feed(data, length); };
+	}
+	bool ok = copyRange(CopyEngine::Buffered, src, 0, dst, 0, size, buffer, BENCH_BUFFER_SIZE, [](uint64_t) {}, nullptr, tap);
+	if (hasher) {
+		hasher->finish();
+	}
+	double seconds = secondsSince(start);
+
+	closeFile(src);
+	closeFile(dst);
+	return ok ? seconds : -1;
+}
+
+int runHashBenchmark(const fs::path& scratch_dir, uint64_t size_mb) {
+	if (!fs::is_directory(scratch_dir)) {
+		printf("[error] scratch directory '%s' does not exist\n", scratch_dir.string().c_str());
+		return 1;
+	}
+
+	uint64_t size = size_mb * 1024 * 1024;
+	fs::path source = scratch_dir / "pkg-merge-bench-source.bin";
+	fs::path target = scratch_dir / "pkg-merge-bench-target.bin";
+	vector<char> buffer(BENCH_BUFFER_SIZE);
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+	printf("[bench] writing %llu MB synthetic source to %s...\n", (unsigned long long)size_mb, scratch_dir.string().c_str());
+	FileHandle out = openForWrite(source, true);
+	if (out == INVALID_FILE) {
+		printf("[error] could not create '%s': %s\n", source.string().c_str(), lastIoError().c_str());
+		return 1;
+	}
+	for (uint64_t written = 0; written < size; written += BENCH_BUFFER_SIZE) {
+		size_t chunk = (size_t)std::min<uint64_t>(BENCH_BUFFER_SIZE, size - written);
+		fillPseudoRandom(buffer.data(), chunk, seed);
+		writeAt(out, buffer.data(), chunk, written);
+	}
+	closeFile(out);
+
+	// Raw hash speed over one in-memory buffer
+	uint64_t hashed = 0;
+	const uint64_t hash_bytes = std::min<uint64_t>(size, 512ULL * 1024 * 1024);
+	auto hashRate = [&](auto& hasher) {
+		auto start = std::chrono::steady_clock::now();
+		for (hashed = 0; hashed < hash_bytes; hashed += BENCH_BUFFER_SIZE) {
+			hasher.update(buffer.data(), BENCH_BUFFER_SIZE);
+		}
+		return megabytesPerSecond(hashed, secondsSince(start));
+	};
+	Xxh64 xxh;
+	Sha256 sha;
+	printf("[bench] xxh64                : %8.0f MB/s\n", hashRate(xxh));
+	bool accelerated = sha256Accelerated();
+	sha256DisableAcceleration(true);
+	printf("[bench] sha256 (portable)    : %8.0f MB/s\n", hashRate(sha));
+	sha256DisableAcceleration(false);
+	if (accelerated) {
+		sha.reset();
+		printf("[bench] sha256 (SHA-NI)      : %8.0f MB/s\n", hashRate(sha));
+	}
+
+	// Best of three for each so a cold page cache on the first run doesn't decide the result
+	double plain = -1, inline_hash = -1;
+	for (int run = 0; run < 3; run++) {
+		double seconds = timeCopy(source, target, size, buffer.data(), false);
+		if (seconds >= 0 && (plain < 0 || seconds < plain)) plain = seconds;
+		seconds = timeCopy(source, target, size, buffer.data(), true);
+		if (seconds >= 0 && (inline_hash < 0 || seconds < inline_hash)) inline_hash = seconds;
+	}
+
+	fs::remove(source);
+	fs::remove(target);
+
+	if (plain < 0 || inline_hash < 0) {
+		printf("[error] benchmark copy failed: %s\n", lastIoError().c_str());
+		return 1;
+	}
+
+	printf("[bench] plain copy           : %8.0f MB/s\n", megabytesPerSecond(size, plain));
+	printf("[bench] copy + inline hashing: %8.0f MB/s\n", megabytesPerSecond(size, inline_hash));
+	printf("[bench] hashing overhead     : %+7.1f%%\n", (inline_hash - plain) / plain * 100);
+	return 0;
+}
+
+// Resource usage of the whole process, sampled before and after every benchmark run
+struct ProcessCounters {
+	double		cpu_seconds;	// User + kernel time of all threads
+	uint64_t	read_calls;		// Read-type syscalls (Linux: syscr, Windows: read operations)
+	uint64_t	write_calls;	// Write-type syscalls (Linux: syscw, Windows: write operations)
+	uint64_t	peak_rss;		// Peak resident set size in bytes
+	ProcessCounters() : cpu_seconds(0), read_calls(0), write_calls(0), peak_rss(0) {}
+};
+
+#ifdef _WIN32
+
+static ProcessCounters sampleCounters() {
+	ProcessCounters counters;
+	FILETIME created, exited, kernel, user;
+	if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+		auto seconds = [](const FILETIME& time) {
+			return (double)(((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime) / 1e7;
+		};
+		counters.cpu_seconds = seconds(kernel) + seconds(user);
+	}
+	IO_COUNTERS io;
+	if (GetProcessIoCounters(GetCurrentProcess(), &io)) {
+		counters.read_calls = io.ReadOperationCount;
+		counters.write_calls = io.WriteOperationCount;
+	}
+	PROCESS_MEMORY_COUNTERS memory;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) {
+		counters.peak_rss = memory.PeakWorkingSetSize;
+	}
+	return counters;
+}
+
+// Windows has no way to lower the recorded peak, so every run reports the peak of the process so far
+static void resetPeakRss() {
+}
+
+#else
+
+static ProcessCounters sampleCounters() {
+	ProcessCounters counters;
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		counters.cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+		counters.peak_rss = (uint64_t)usage.ru_maxrss * 1024;
+	}
+
+	string key;
+	unsigned long long value;
+	std::ifstream io("/proc/self/io");
+	while (io >> key >> value) {
+		if (key == "syscr:") counters.read_calls = value;
+		if (key == "syscw:") counters.write_calls = value;
+	}
+	// VmHWM can be reset between runs, unlike ru_maxrss
+	std::ifstream status("/proc/self/status");
+	string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0) {
+			counters.peak_rss = strtoull(line.c_str() + 6, NULL, 10) * 1024;
+		}
+	}
+	return counters;
+}
+
+static void resetPeakRss() {
+	FILE* refs = fopen("/proc/self/clear_refs", "w");
+	if (refs != NULL) {
+		fputs("5", refs);
+		fclose(refs);
+	}
+}
+
+#endif
+
+// Helper function to write a minimal PKG header declaring `package_size` bytes
+static void writeSyntheticHeader(char* buffer, uint64_t package_size) {
+	auto putBig = [&](size_t offset, uint64_t value, int bytes) {
+		for (int i = 0; i < bytes; i++) {
+			buffer[offset + i] = (char)(value >> (8 * (bytes - 1 - i)));
+		}
+	};
+	memset(buffer, 0, PKG_HEADER_SIZE);
+	memcpy(buffer, PKG_MAGIC, sizeof(PKG_MAGIC));
+	putBig(0x10, 1, 4);							// entry_count
+	putBig(0x18, PKG_HEADER_SIZE, 4);			// entry_table_offset
+	putBig(0x20, PKG_HEADER_SIZE, 8);			// body_offset
+	putBig(0x28, package_size - PKG_HEADER_SIZE, 8);	// body_size
+	strcpy(buffer + 0x40, "UP0000-TEST00000_00-PKGMERGEBENCH000");
+	putBig(0x430, package_size, 8);
+}
+
+bool generateSplitSet(const fs::path& dir, const string& name, uint64_t total_size, unsigned parts, bool with_sc) {
+	parts = std::max(1u, parts);
+	total_size = std::max<uint64_t>(total_size, parts * (uint64_t)PKG_HEADER_SIZE);
+	vector<char> buffer(BENCH_BUFFER_SIZE);
+	uint64_t seed = 0x2545F4914F6CDD1DULL;
+
+	uint64_t piece_size = total_size / parts;
+	for (unsigned part = 0; part < parts; part++) {
+		string suffix = (with_sc && parts > 1 && part == parts - 1) ? "sc" : std::to_string(part);
+		fs::path file = dir / (name + "_" + suffix + ".pkg");
+		uint64_t size = part == parts - 1 ? total_size - piece_size * part : piece_size;
+
+		FileHandle out = openForWrite(file, true);
+		if (out == INVALID_FILE) {
+			return false;
+		}
+		bool ok = true;
+		for (uint64_t written = 0; ok && written < size; written += BENCH_BUFFER_SIZE) {
+			size_t chunk = (size_t)std::min<uint64_t>(BENCH_BUFFER_SIZE, size - written);
+			fillPseudoRandom(buffer.data(), chunk, seed);
+			// The scan only accepts a root part that starts with the PKG magic, and the pre-flight check
+			// wants a header that declares the size of the whole set
+			if (part == 0 && written == 0) {
+				writeSyntheticHeader(buffer.data(), total_size);
+			}
+			ok = writeAt(out, buffer.data(), chunk, written) == (int64_t)chunk;
+		}
+		closeFile(out);
+		if (!ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Helper function to merge `segments` into `target` the way mergePackage does, including the final flush
+static bool benchMerge(const vector<MergeSegment>& segments, uint64_t merged_size, const fs::path& target, CopyEngine engine,
+	size_t buffer_size, unsigned threads, char* buffer) {
+	std::error_code error;
+	fs::remove(target, error);
+	FileHandle merged = openForWrite(target, true);
+	if (merged == INVALID_FILE) {
+		return false;
+	}
+
+	bool ok = true;
+	if (threads > 0) {
+		string error;
+		ok = preallocateFile(merged, merged_size) &&
+			copySegmentsParallel(segments, merged, engine, buffer_size, threads, [](uint64_t) {}, error);
+		if (!error.empty()) {
+			fprintf(stderr, "\n[error] %s\n", error.c_str());
+		}
+	} else {
+		for (auto & segment : segments) {
+			FileHandle source = openForRead(segment.file);
+			ok = source != INVALID_FILE &&
+				copyRange(engine, source, 0, merged, segment.offset, segment.size, buffer, buffer_size, [](uint64_t) {});
+			closeFile(source);
+			if (!ok) break;
+		}
+	}
+	ok = ok && syncFile(merged);
+	closeFile(merged);
+	return ok;
+}
+
+int runMergeBenchmark(const fs::path& scratch_dir, uint64_t size_mb, unsigned parts, bool with_sc) {
+	if (!fs::is_directory(scratch_dir)) {
+		fprintf(stderr, "[error] scratch directory '%s' does not exist\n", scratch_dir.string().c_str());
+		return 1;
+	}
+
+	// Keep the synthetic set in its own folder so the scan doesn't pick up anything else
+	fs::path set_dir = scratch_dir / "pkg-merge-bench-set";
+	fs::path target = scratch_dir / "pkg-merge-bench-merged.pkg";
+	std::error_code error;
+	fs::remove_all(set_dir, error);
+	fs::create_directory(set_dir, error);
+
+	uint64_t size = size_mb * 1024 * 1024;
+	fprintf(stderr, "[bench] writing %llu MB synthetic set in %u pieces%s to %s...\n", (unsigned long long)size_mb, parts,
+		with_sc ? " (last one _sc)" : "", set_dir.string().c_str());
+	if (!generateSplitSet(set_dir, "bench", size, parts, with_sc)) {
+		fprintf(stderr, "[error] could not write the synthetic set: %s\n", lastIoError().c_str());
+		return 1;
+	}
+
+	// Lay the set out directly rather than through the directory scan, so only copy speed is measured
+	Package package;
+	package.file = set_dir / "bench_0.pkg";
+	Package sc_part;
+	for (unsigned part = 1; part < parts; part++) {
+		Package piece;
+		piece.part = part;
+		piece.file = set_dir / ("bench_" + (with_sc && part == parts - 1 ? string("sc") : std::to_string(part)) + ".pkg");
+		if (with_sc && part == parts - 1) {
+			sc_part = piece;
+			package.sc_part = &sc_part;
+		} else {
+			package.parts.push_back(piece);
+		}
+	}
+	PkgPartSet part_set(package);
+	const vector<MergeSegment>& segments = part_set.segments();
+
+	uint64_t largest_piece = 0;
+	for (auto & segment : segments) {
+		largest_piece = std::max(largest_piece, segment.size);
+	}
+
+	const size_t buffer_sizes[] = { 256 * 1024, 512 * 1024, 1024 * 1024, 2 * 1024 * 1024, 4 * 1024 * 1024, 8 * 1024 * 1024, 16 * 1024 * 1024 };
+	const CopyEngine engines[] = { CopyEngine::Buffered, CopyEngine::CopyFileRange, CopyEngine::Splice, CopyEngine::IoUring, CopyEngine::Reflink };
+	vector<char> buffer(buffer_sizes[sizeof(buffer_sizes) / sizeof(buffer_sizes[0]) - 1]);
+	unsigned threads = defaultParallelThreads();
+
+	// One untimed pass so the first timed run doesn't pay for a cold page cache
+	benchMerge(segments, part_set.size(), target, CopyEngine::Buffered, BENCH_BUFFER_SIZE, 0, buffer.data());
+
+	printf("{\n");
+	printf("  \"size_bytes\": %llu,\n", (unsigned long long)part_set.size());
+	printf("  \"pieces\": %zu,\n", segments.size());
+	printf("  \"sc_piece\": %s,\n", with_sc && parts > 1 ? "true" : "false");
+	printf("  \"largest_piece_bytes\": %llu,\n", (unsigned long long)largest_piece);
+	printf("  \"tiered_buffer_bytes\": %zu,\n", mergeBufferSize(largest_piece));
+	printf("  \"parallel_streams\": %u,\n", threads);
+	printf("  \"runs\": [");
+
+	bool first = true;
+	int failures = 0;
+	for (int parallel = 0; parallel <= 1; parallel++) {
+		for (CopyEngine engine : engines) {
+			if (!isEngineAvailable(engine)) continue;
+			for (size_t buffer_size : buffer_sizes) {
+				fprintf(stderr, "[bench] %s %s, %zu KB buffer...\n", parallel ? "parallel" : "sequential", engineName(engine), buffer_size / 1024);
+
+				resetPeakRss();
+				ProcessCounters before = sampleCounters();
+				auto start = std::chrono::steady_clock::now();
+				bool ok = benchMerge(segments, part_set.size(), target, engine, buffer_size, parallel ? threads : 0, buffer.data());
+				double seconds = secondsSince(start);
+				ProcessCounters after = sampleCounters();
+				if (!ok) {
+					fprintf(stderr, "[warn] run failed: %s\n", lastIoError().c_str());
+					failures++;
+				}
+
+				printf("%s\n    {\"path\": \"%s\", \"engine\": \"%s\", \"buffer_bytes\": %zu, \"ok\": %s, \"seconds\": %.6f, "
+					"\"gb_per_second\": %.4f, \"cpu_seconds\": %.6f, \"read_syscalls\": %llu, \"write_syscalls\": %llu, \"peak_rss_bytes\": %llu}",
+					first ? "" : ",", parallel ? "parallel" : "sequential", engineName(engine), buffer_size, ok ? "true" : "false", seconds,
+					seconds > 0 ? (double)part_set.size() / 1e9 / seconds : 0, after.cpu_seconds - before.cpu_seconds,
+					(unsigned long long)(after.read_calls - before.read_calls), (unsigned long long)(after.write_calls - before.write_calls),
+					(unsigned long long)after.peak_rss);
+				fflush(stdout);
+				first = false;
+			}
+		}
+	}
+	printf("\n  ]\n}\n");
+
+	fs::remove(target, error);
+	fs::remove_all(set_dir, error);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+// bench.h : throughput benchmarks run with "pkg-merge -bench"
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <filesystem>
+#include <string>
+
+// Copies a synthetic file of `size_mb` MB inside `scratch_dir` with and without inline hashing and
+// reports the throughput of each, plus the raw speed of the hash functions. Returns the exit code.
+int runHashBenchmark(const std::filesystem::path& scratch_dir, uint64_t size_mb);
+
+// Writes a synthetic split PKG set to `dir`: `<name>_0.pkg` starting with PKG_MAGIC followed by pieces
+// `<name>_1.pkg`.. up to `parts` files and `total_size` bytes in all. With `with_sc` the last piece is
+// `<name>_sc.pkg` instead. Returns false if a file can't be written.
+bool generateSplitSet(const std::filesystem::path& dir, const std::string& name, uint64_t total_size, unsigned parts, bool with_sc);
+
+// Generates a split set of `size_mb` MB in `parts` pieces inside `scratch_dir` and merges it with every
+// available engine and a range of buffer sizes, sequentially and with --parallel. Prints one JSON report
+// to stdout (wall time, GB/s, CPU time, read/write syscalls and peak RSS per run); progress goes to stderr.
+int runMergeBenchmark(const std::filesystem::path& scratch_dir, uint64_t size_mb, unsigned parts, bool with_sc);
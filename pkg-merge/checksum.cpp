@@ -0,0 +1,428 @@
+// checksum.cpp : SHA-256 (portable and SHA-NI), XXH64 and the inline merge hasher
+//
+
+#include "stdafx.h"
+#include "checksum.h"
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define SHA256_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHA256_TARGET
+#else
+#include <cpuid.h>
+#define SHA256_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+#endif
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+
+static const uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+static inline uint64_t rotl64(uint64_t x, int n) { return (x << n) | (x >> (64 - n)); }
+
+static void sha256BlocksPortable(uint32_t state[8], const uint8_t* data, size_t blocks) {
+	for (; blocks > 0; blocks--, data += 64) {
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++) {
+			w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+		}
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; i++) {
+			uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+			uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#ifdef SHA256_X86
+
+// SHA-NI: two rounds per sha256rnds2, the message schedule done by sha256msg1/msg2
+SHA256_TARGET static void sha256BlocksShaNi(uint32_t state[8], const uint8_t* data, size_t blocks) {
+	const __m128i BYTE_SWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// The instructions want the state as ABEF / CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (; blocks > 0; blocks--, data += 64) {
+		__m128i abef = state0;
+		__m128i cdgh = state1;
+		__m128i w[4];
+
+		for (int group = 0; group < 16; group++) {
+			__m128i& current = w[group & 3];
+			if (group < 4) {
+				current = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + group * 16)), BYTE_SWAP);
+			} else {
+				// W[g] = msg2(msg1(W[g-4], W[g-3]) + alignr(W[g-1], W[g-2], 4), W[g-1])
+				__m128i previous = w[(group - 1) & 3];
+				__m128i schedule = _mm_sha256msg1_epu32(current, w[(group - 3) & 3]);
+				schedule = _mm_add_epi32(schedule, _mm_alignr_epi8(previous, w[(group - 2) & 3], 4));
+				current = _mm_sha256msg2_epu32(schedule, previous);
+			}
+			__m128i message = _mm_add_epi32(current, _mm_loadu_si128((const __m128i*)&SHA256_K[group * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(message, 0x0E));
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	_mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static bool cpuHasShaNi() {
+	unsigned int leaf1[4] = {}, leaf7[4] = {};
+#ifdef _MSC_VER
+	__cpuid((int*)leaf1, 1);
+	__cpuidex((int*)leaf7, 7, 0);
+#else
+	__get_cpuid(1, &leaf1[0], &leaf1[1], &leaf1[2], &leaf1[3]);
+	__get_cpuid_count(7, 0, &leaf7[0], &leaf7[1], &leaf7[2], &leaf7[3]);
+#endif
+	bool ssse3 = (leaf1[2] & (1u << 9)) != 0;
+	bool sse41 = (leaf1[2] & (1u << 19)) != 0;
+	bool sha = (leaf7[1] & (1u << 29)) != 0;
+	return ssse3 && sse41 && sha;
+}
+
+#endif
+
+static bool sha256_portable_only = false;
+
+bool sha256Accelerated() {
+#ifdef SHA256_X86
+	static const bool has_sha_ni = cpuHasShaNi();
+	return has_sha_ni && !sha256_portable_only;
+#else
+	return false;
+#endif
+}
+
+void sha256DisableAcceleration(bool disable) {
+	sha256_portable_only = disable;
+}
+
+static void sha256Blocks(uint32_t state[8], const uint8_t* data, size_t blocks) {
+#ifdef SHA256_X86
+	if (sha256Accelerated()) {
+		sha256BlocksShaNi(state, data, blocks);
+		return;
+	}
+#endif
+	sha256BlocksPortable(state, data, blocks);
+}
+
+void Sha256::reset() {
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(state, initial, sizeof(state));
+	length = 0;
+	used = 0;
+}
+
+void Sha256::update(const void* data, size_t size) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	length += size;
+	if (used > 0) {
+		size_t take = std::min(size, sizeof(block) - used);
+		memcpy(block + used, bytes, take);
+		used += take;
+		bytes += take;
+		size -= take;
+		if (used < sizeof(block)) return;
+		sha256Blocks(state, block, 1);
+		used = 0;
+	}
+	// Whole blocks straight from the caller's buffer
+	sha256Blocks(state, bytes, size / 64);
+	bytes += size & ~(size_t)63;
+	size &= 63;
+	memcpy(block, bytes, size);
+	used = size;
+}
+
+string Sha256::hex() {
+	uint64_t bits = length * 8;
+	uint8_t padding[72] = { 0x80 };
+	size_t pad = (used < 56 ? 56 : 120) - used;
+	for (int i = 0; i < 8; i++) {
+		padding[pad + i] = (uint8_t)(bits >> (56 - i * 8));
+	}
+	update(padding, pad + 8);
+
+	char text[65];
+	for (int i = 0; i < 8; i++) {
+		snprintf(text + i * 8, 9, "%08x", state[i]);
+	}
+	return string(text, 64);
+}
+
+static const uint64_t XXH_PRIME1 = 11400714785074694791ULL;
+static const uint64_t XXH_PRIME2 = 14029467366897019727ULL;
+static const uint64_t XXH_PRIME3 = 1609587929392839161ULL;
+static const uint64_t XXH_PRIME4 = 9650029242287828579ULL;
+static const uint64_t XXH_PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t read64(const uint8_t* p) { uint64_t v; memcpy(&v, p, 8); return v; }	// Little endian hosts only
+static inline uint32_t read32(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+	return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxhMerge(uint64_t hash, uint64_t acc) {
+	return (hash ^ xxhRound(0, acc)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+void Xxh64::reset() {
+	acc[0] = XXH_PRIME1 + XXH_PRIME2;
+	acc[1] = XXH_PRIME2;
+	acc[2] = 0;
+	acc[3] = 0 - XXH_PRIME1;
+	length = 0;
+	used = 0;
+}
+
+void Xxh64::update(const void* data, size_t size) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	length += size;
+	if (used + size < sizeof(block)) {
+		memcpy(block + used, bytes, size);
+		used += size;
+		return;
+	}
+	if (used > 0) {
+		size_t take = sizeof(block) - used;
+		memcpy(block + used, bytes, take);
+		for (int i = 0; i < 4; i++) acc[i] = xxhRound(acc[i], read64(block + i * 8));
+		bytes += take;
+		size -= take;
+		used = 0;
+	}
+	for (; size >= 32; bytes += 32, size -= 32) {
+		acc[0] = xxhRound(acc[0], read64(bytes));
+		acc[1] = xxhRound(acc[1], read64(bytes + 8));
+		acc[2] = xxhRound(acc[2], read64(bytes + 16));
+		acc[3] = xxhRound(acc[3], read64(bytes + 24));
+	}
+	memcpy(block, bytes, size);
+	used = size;
+}
+
+uint64_t Xxh64::digest() const {
+	uint64_t hash;
+	if (length >= 32) {
+		hash = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+		for (int i = 0; i < 4; i++) hash = xxhMerge(hash, acc[i]);
+	} else {
+		hash = acc[2] + XXH_PRIME5;
+	}
+	hash += length;
+
+	const uint8_t* p = block;
+	size_t left = used;
+	for (; left >= 8; p += 8, left -= 8) {
+		hash = rotl64(hash ^ xxhRound(0, read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if (left >= 4) {
+		hash = rotl64(hash ^ (uint64_t)read32(p) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+		left -= 4;
+	}
+	for (; left > 0; p++, left--) {
+		hash = rotl64(hash ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+string Xxh64::hex() const {
+	char text[17];
+	snprintf(text, sizeof(text), "%016llx", (unsigned long long)digest());
+	return text;
+}
+
+// Enough chunks in the pool that the copy loop can run a few buffers ahead of the slower hash thread
+const size_t HASH_POOL_CHUNKS = 8;
+
+InlineHasher::InlineHasher(size_t chunk_size) : pool(HASH_POOL_CHUNKS), done(false), current_part(-1) {
+	for (auto & chunk : pool) {
+		chunk.data.resize(chunk_size);
+		free_chunks.push_back(&chunk);
+	}
+	whole_thread = std::thread(&InlineHasher::hashWhole, this);
+	part_thread = std::thread(&InlineHasher::hashParts, this);
+}
+
+InlineHasher::~InlineHasher() {
+	if (whole_thread.joinable()) {
+		finish();
+	}
+}
+
+void InlineHasher::beginPart(const string& name) {
+	std::lock_guard<std::mutex> guard(lock);
+	parts.push_back({ name, 0, 0, "", "" });
+	current_part++;
+}
+
+void InlineHasher::feed(const char* data, size_t length) {
+	while (length > 0) {
+		Chunk* chunk;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			changed.wait(guard, [&] { return !free_chunks.empty(); });
+			chunk = free_chunks.back();
+			free_chunks.pop_back();
+		}
+
+		chunk->length = std::min(length, chunk->data.size());
+		memcpy(chunk->data.data(), data, chunk->length);
+		data += chunk->length;
+		length -= chunk->length;
+
+		std::lock_guard<std::mutex> guard(lock);
+		chunk->part = current_part;
+		chunk->pending = 2;
+		whole_queue.push_back(chunk);
+		part_queue.push_back(chunk);
+		changed.notify_all();
+	}
+}
+
+InlineHasher::Chunk* InlineHasher::take(std::deque<Chunk*>& queue) {
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [&] { return !queue.empty() || done; });
+	if (queue.empty()) return nullptr;
+	Chunk* chunk = queue.front();
+	queue.pop_front();
+	return chunk;
+}
+
+void InlineHasher::release(Chunk* chunk) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (--chunk->pending == 0) {
+		free_chunks.push_back(chunk);
+		changed.notify_all();
+	}
+}
+
+void InlineHasher::hashWhole() {
+	Sha256 sha;
+	Xxh64 xxh;
+	while (Chunk* chunk = take(whole_queue)) {
+		sha.update(chunk->data.data(), chunk->length);
+		xxh.update(chunk->data.data(), chunk->length);
+		release(chunk);
+	}
+	whole.offset = 0;
+	whole.size = sha.length;
+	whole.sha256 = sha.hex();
+	whole.xxh64 = xxh.hex();
+}
+
+void InlineHasher::hashParts() {
+	Sha256 sha;
+	Xxh64 xxh;
+	int part = -1;
+	uint64_t offset = 0;
+
+	// `parts` only grows under the lock, and only the entry being hashed is written here
+	auto close = [&]() {
+		if (part < 0) return;
+		uint64_t size = sha.length;
+		std::lock_guard<std::mutex> guard(lock);
+		parts[part].offset = offset;
+		parts[part].size = size;
+		parts[part].sha256 = sha.hex();
+		parts[part].xxh64 = xxh.hex();
+		offset += size;
+		sha.reset();
+		xxh.reset();
+	};
+
+	while (Chunk* chunk = take(part_queue)) {
+		while (part < chunk->part) {
+			close();
+			part++;
+		}
+		sha.update(chunk->data.data(), chunk->length);
+		xxh.update(chunk->data.data(), chunk->length);
+		release(chunk);
+	}
+	// Parts that never saw a byte still get their (empty) digest
+	while (part <= current_part) {
+		if (part >= 0) close();
+		part++;
+	}
+}
+
+void InlineHasher::finish() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+		changed.notify_all();
+	}
+	whole_thread.join();
+	part_thread.join();
+}
+
+bool writeManifest(const fs::path& merged_file, const PartDigest& whole, const vector<PartDigest>& parts) {
+	fs::path manifest_file = merged_file;
+	manifest_file += ".manifest";
+
+	FILE* manifest = fopen(manifest_file.string().c_str(), "wb");
+	if (manifest == NULL) {
+		return false;
+	}
+	fprintf(manifest, "# pkg-merge manifest v1\n");
+	fprintf(manifest, "# kind\toffset\tsize\tsha256\txxh64\tname\n");
+	fprintf(manifest, "output\t%llu\t%llu\t%s\t%s\t%s\n", (unsigned long long)whole.offset, (unsigned long long)whole.size,
+		whole.sha256.c_str(), whole.xxh64.c_str(), whole.name.c_str());
+	for (auto & part : parts) {
+		fprintf(manifest, "part\t%llu\t%llu\t%s\t%s\t%s\n", (unsigned long long)part.offset, (unsigned long long)part.size,
+			part.sha256.c_str(), part.xxh64.c_str(), part.name.c_str());
+	}
+	return fclose(manifest) == 0;
+}
@@ -0,0 +1,96 @@
+// checksum.h : SHA-256 / XXH64 hashing and the inline hasher that follows a merge
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+
+struct Sha256 {
+	uint32_t	state[8];
+	uint64_t	length;			// Bytes hashed so far
+	uint8_t		block[64];
+	size_t		used;			// Bytes waiting in `block`
+
+	Sha256() { reset(); }
+	void reset();
+	void update(const void* data, size_t size);
+	std::string hex();			// Finalizes; call reset() before reusing
+};
+
+struct Xxh64 {
+	uint64_t	acc[4];
+	uint64_t	length;
+	uint8_t		block[32];
+	size_t		used;
+
+	Xxh64() { reset(); }
+	void reset();
+	void update(const void* data, size_t size);
+	uint64_t digest() const;	// Does not change the state
+	std::string hex() const;
+};
+
+// True when SHA-256 runs on the SHA-NI instructions rather than the portable code
+bool sha256Accelerated();
+// Forces the portable SHA-256 code even where SHA-NI is present (benchmarks)
+void sha256DisableAcceleration(bool disable);
+
+struct PartDigest {
+	std::string		name;		// Source file name, or the merged file name for the whole output
+	uint64_t		offset;		// Position inside the merged output
+	uint64_t		size;
+	std::string		sha256;
+	std::string		xxh64;
+};
+
+// Hashes the bytes of a merge as they pass through the copy buffer. feed() only copies the chunk into a
+// small pool; one background thread hashes the whole output and another the current part, so the copy
+// loop never waits on SHA-256 unless the hashers fall a full pool behind. Chunks must arrive in output order.
+class InlineHasher {
+public:
+	explicit InlineHasher(size_t chunk_size);
+	~InlineHasher();
+
+	void beginPart(const std::string& name);
+	void feed(const char* data, size_t length);
+	// Waits for the hash threads and fills in parts/whole (whole.name is left to the caller)
+	void finish();
+
+	std::vector<PartDigest>	parts;
+	PartDigest				whole;
+
+private:
+	struct Chunk {
+		std::vector<char>	data;
+		size_t				length;
+		int					part;
+		int					pending;	// Hash threads still reading this chunk
+	};
+
+	void hashWhole();
+	void hashParts();
+	Chunk* take(std::deque<Chunk*>& queue);
+	void release(Chunk* chunk);
+
+	std::vector<Chunk>			pool;
+	std::vector<Chunk*>			free_chunks;
+	std::deque<Chunk*>			whole_queue;
+	std::deque<Chunk*>			part_queue;
+	std::mutex					lock;
+	std::condition_variable		changed;
+	bool						done;
+	int							current_part;
+	std::thread					whole_thread;
+	std::thread					part_thread;
+};
+
+// Writes the sidecar "<merged file>.manifest" next to the merged output
+bool writeManifest(const std::filesystem::path& merged_file, const PartDigest& whole, const std::vector<PartDigest>& parts);
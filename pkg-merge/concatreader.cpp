@@ -0,0 +1,96 @@
+// concatreader.cpp : random-access reads across the pieces of a split PKG, as if it were already merged
+//
+
+#include "stdafx.h"
+#include "concatreader.h"
+#include <algorithm>
+#include <string.h>
+
+using std::vector;
+
+ConcatReader::ConcatReader(const PkgPartSet& part_set) : segments(part_set.segments()), total_size(part_set.size()) {
+	for (auto & segment : segments) {
+		starts.push_back(segment.offset);
+	}
+}
+
+ConcatReader::~ConcatReader() {
+	close();
+}
+
+bool ConcatReader::open() {
+	close();
+	views.resize(segments.size());
+	handles.resize(segments.size(), INVALID_FILE);
+
+	for (size_t i = 0; i < segments.size(); i++) {
+		if (mapFileView(segments[i].file, views[i])) {
+			if (views[i].size != segments[i].size) {
+				close();
+				return false;
+			}
+			continue;
+		}
+		handles[i] = openForRead(segments[i].file);
+		if (handles[i] == INVALID_FILE) {
+			close();
+			return false;
+		}
+	}
+	return true;
+}
+
+void ConcatReader::close() {
+	for (auto & view : views) {
+		unmapFileView(view);
+	}
+	for (auto & handle : handles) {
+		closeFile(handle);
+	}
+	views.clear();
+	handles.clear();
+}
+
+int64_t ConcatReader::pread(void* buffer, size_t length, uint64_t offset) const {
+	if (offset >= total_size || views.empty()) {
+		return 0;
+	}
+	length = (size_t)std::min<uint64_t>(length, total_size - offset);
+
+	// Last piece starting at or before `offset`
+	size_t index = std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+
+	size_t done = 0;
+	while (done < length) {
+		const MergeSegment& segment = segments[index];
+		uint64_t inside = offset + done - segment.offset;
+		size_t chunk = (size_t)std::min<uint64_t>(length - done, segment.size - inside);
+
+		if (views[index].data != nullptr) {
+			memcpy((char*)buffer + done, views[index].data + inside, chunk);
+		} else if (readAt(handles[index], (char*)buffer + done, chunk, inside) != (int64_t)chunk) {
+			return -1;
+		}
+		done += chunk;
+		index++;
+	}
+	return (int64_t)done;
+}
+
+const char* ConcatReader::mapped(uint64_t offset, size_t length) const {
+	if (offset >= total_size || views.empty()) {
+		return nullptr;
+	}
+	size_t index = std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+	uint64_t inside = offset - segments[index].offset;
+	if (views[index].data == nullptr || inside + length > segments[index].size) {
+		return nullptr;
+	}
+	return views[index].data + inside;
+}
+
+void ConcatReader::adviseSequential() {
+	for (auto & view : views) {
+		::adviseSequential(view);
+	}
+}
@@ -0,0 +1,45 @@
+// concatreader.h : random-access reads across the pieces of a split PKG, as if it were already merged
+//
+
+#pragma once
+
+#include "pkgparts.h"
+#include "fileio.h"
+#include <vector>
+
+// Serves reads at any offset of the merged PKG straight from its pieces, without writing anything.
+// Pieces are memory mapped; one that can't be mapped is read through a plain file handle instead.
+// After open() succeeds, pread() is safe to call from several threads at once.
+class ConcatReader {
+public:
+	explicit ConcatReader(const PkgPartSet& part_set);
+	~ConcatReader();
+
+	ConcatReader(const ConcatReader&) = delete;
+	ConcatReader& operator=(const ConcatReader&) = delete;
+
+	// Opens every piece. Returns false if one of them can't be opened or no longer has its scanned size.
+	bool open();
+
+	uint64_t size() const { return total_size; }
+
+	// Copies up to `length` bytes at `offset` of the merged PKG into `buffer`. Returns the number of bytes
+	// read (short only at the end of the PKG), or -1 if a piece couldn't be read.
+	int64_t pread(void* buffer, size_t length, uint64_t offset) const;
+
+	// The `length` bytes at `offset` straight from a mapped piece, or nullptr if they aren't mapped or span
+	// two pieces (use pread then)
+	const char* mapped(uint64_t offset, size_t length) const;
+
+	// Hints that the mapped pieces will be read front to back
+	void adviseSequential();
+
+private:
+	void close();
+
+	std::vector<MergeSegment>	segments;
+	std::vector<uint64_t>		starts;			// Merged offset of every piece, ascending, for the binary search
+	std::vector<FileView>		views;
+	std::vector<FileHandle>		handles;		// Only for pieces that couldn't be mapped
+	uint64_t					total_size;
+};
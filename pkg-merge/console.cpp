@@ -0,0 +1,46 @@
+// console.cpp : messages of a merge, handed to its output sink or printed to stdout
+//
+
+#include "stdafx.h"
+#include "console.h"
+#include <mutex>
+
+using std::string;
+
+static std::mutex console_lock;
+
+void emit(const OutputSink& output, const string& text) {
+	if (output) {
+		output(text);
+		return;
+	}
+	// A progress reporter may be drawing from its own thread
+	std::lock_guard<std::mutex> guard(console_lock);
+	fputs(text.c_str(), stdout);
+	fflush(stdout);
+}
+
+string formatText(const char* format, va_list args) {
+	char line[1024];
+	va_list again;
+	va_copy(again, args);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	if (length < (int)sizeof(line)) {
+		va_end(again);
+		return length < 0 ? string() : string(line, (size_t)length);
+	}
+	// Long paths in a message
+	string text((size_t)length + 1, '\0');
+	vsnprintf(&text[0], text.size(), format, again);
+	va_end(again);
+	text.resize((size_t)length);
+	return text;
+}
+
+void printTo(const OutputSink& output, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	string text = formatText(format, args);
+	va_end(args);
+	emit(output, text);
+}
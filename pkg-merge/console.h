@@ -0,0 +1,20 @@
+// console.h : messages of a merge, handed to its output sink or printed to stdout
+//
+
+#pragma once
+
+#include <string>
+#include <functional>
+#include <stdarg.h>
+
+// Receives a merge's console output as finished text, progress lines start with "\r"
+typedef std::function<void(const std::string& text)> OutputSink;
+
+// Hands finished text to `output`, or prints it to stdout when there is no sink
+void emit(const OutputSink& output, const std::string& text);
+
+// Formats a message like vprintf, however long it gets
+std::string formatText(const char* format, va_list args);
+
+// Formats a message like printf and hands it to `output`
+void printTo(const OutputSink& output, const char* format, ...);
@@ -0,0 +1,422 @@
+// copyengine.cpp : copy_file_range, splice and buffered copy engines
+//
+
+#include "stdafx.h"
+#include "copyengine.h"
+#include "uringengine.h"
+#include "throttle.h"
+#include <algorithm>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+namespace fs = std::filesystem;
+using std::string;
+
+size_t mergeBufferSize(uint64_t largest_piece, const char** size_class) {
+	const char* name;
+	size_t size;
+	if (largest_piece < 200 * 1024 * 1024) {
+		size = 512 * 1024;
+		name = "small";
+	} else if (largest_piece < 1024 * 1024 * 1024) {
+		size = 2 * 1024 * 1024;
+		name = "medium";
+	} else if (largest_piece < 4ULL * 1024 * 1024 * 1024) {
+		size = 4 * 1024 * 1024;
+		name = "large";
+	} else {
+		size = 8 * 1024 * 1024;
+		name = "huge";
+	}
+	if (size_class != nullptr) {
+		*size_class = name;
+	}
+	return size;
+}
+
+const char* engineName(CopyEngine engine) {
+	switch (engine) {
+	case CopyEngine::Auto:			return "auto";
+	case CopyEngine::CopyFileRange:	return "copy_file_range";
+	case CopyEngine::Splice:		return "splice";
+	case CopyEngine::Buffered:		return "buffered";
+	case CopyEngine::IoUring:		return "io_uring";
+	case CopyEngine::Reflink:		return "reflink";
+	}
+	return "unknown";
+}
+
+bool parseEngineName(const string& name, CopyEngine& engine) {
+	for (CopyEngine candidate : { CopyEngine::Auto, CopyEngine::CopyFileRange, CopyEngine::Splice, CopyEngine::Buffered, CopyEngine::IoUring, CopyEngine::Reflink }) {
+		if (name == engineName(candidate)) {
+			engine = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool isEngineAvailable(CopyEngine engine) {
+#ifdef __linux__
+	// Kernels (and container seccomp profiles) without io_uring are common enough to check for
+	return engine != CopyEngine::IoUring || isIoUringSupported();
+#else
+	return engine == CopyEngine::Auto || engine == CopyEngine::Buffered;
+#endif
+}
+
+#ifdef __linux__
+
+// Extents handed over per FICLONERANGE call, so progress still moves on a huge piece
+const uint64_t REFLINK_CHUNK_SIZE = 1024ULL * 1024 * 1024;
+
+static bool cloneRange(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset, uint64_t length) {
+	file_clone_range range;
+	range.src_fd = src;
+	range.src_offset = src_offset;
+	range.src_length = length;		// Never 0 here, that would mean "up to the end of the source"
+	range.dest_offset = dst_offset;
+	return ioctl(dst, FICLONERANGE, &range) == 0;
+}
+
+bool isReflinkPossible(const fs::path& source_file, const fs::path& target_dir) {
+	FileHandle src = openForRead(source_file);
+	if (src == INVALID_FILE) {
+		return false;
+	}
+	fs::path probe_file = target_dir / ".pkg-merge-reflink-probe";
+	FileHandle probe = openForWrite(probe_file, true);
+
+	struct stat info;
+	bool cloned = false;
+	if (probe != INVALID_FILE && fstat(src, &info) == 0 && info.st_size > 0) {
+		// A short source can only be cloned whole, a longer one block by block
+		uint64_t length = std::min<uint64_t>((uint64_t)info.st_size, info.st_blksize > 0 ? info.st_blksize : 4096);
+		cloned = cloneRange(src, 0, probe, 0, length);
+	}
+
+	closeFile(src);
+	closeFile(probe);
+	std::error_code error;
+	fs::remove(probe_file, error);
+	return cloned;
+}
+
+#else
+
+bool isReflinkPossible(const fs::path&, const fs::path&) {
+	return false;
+}
+
+#endif
+
+#ifdef __linux__
+
+// Errors that mean "this engine can't handle this pair of files", as opposed to a real I/O failure
+static bool isUnsupportedError(int error) {
+	return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP || error == EBADF;
+}
+
+static EngineResult copyWithCopyFileRange(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset,
+	uint64_t length, size_t chunk_size, uint64_t& copied, const CopyProgress& progress) {
+	while (copied < length) {
+		loff_t in = (loff_t)(src_offset + copied);
+		loff_t out = (loff_t)(dst_offset + copied);
+		size_t chunk = (size_t)std::min<uint64_t>(length - copied, chunk_size);
+		ssize_t moved = copy_file_range(src, &in, dst, &out, chunk, 0);
+		if (moved < 0) {
+			if (errno == EINTR) continue;
+			return isUnsupportedError(errno) ? EngineResult::Unsupported : EngineResult::Failed;
+		}
+		if (moved == 0) {
+			// Source ended early (truncated while merging) or the filesystem quietly declined
+			return copied == 0 ? EngineResult::Unsupported : EngineResult::Failed;
+		}
+		copied += (uint64_t)moved;
+		progress(copied);
+	}
+	return EngineResult::Done;
+}
+
+static EngineResult copyWithSplice(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset,
+	uint64_t length, char* buffer, size_t buffer_size, uint64_t& copied, const CopyProgress& progress) {
+	int pipe_fds[2];
+	if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+		return EngineResult::Unsupported;
+	}
+	// A bigger pipe means fewer round trips; the kernel caps this at /proc/sys/fs/pipe-max-size
+	fcntl(pipe_fds[1], F_SETPIPE_SZ, (int)std::min<size_t>(buffer_size, 1024 * 1024));
+
+	EngineResult result = EngineResult::Done;
+	while (copied < length) {
+		loff_t in = (loff_t)(src_offset + copied);
+		size_t chunk = (size_t)std::min<uint64_t>(length - copied, buffer_size);
+		ssize_t filled = splice(src, &in, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE);
+		if (filled < 0) {
+			if (errno == EINTR) continue;
+			result = isUnsupportedError(errno) ? EngineResult::Unsupported : EngineResult::Failed;
+			break;
+		}
+		if (filled == 0) {
+			result = copied == 0 ? EngineResult::Unsupported : EngineResult::Failed;
+			break;
+		}
+
+		ssize_t drained = 0;
+		while (drained < filled) {
+			loff_t out = (loff_t)(dst_offset + copied + drained);
+			ssize_t moved = splice(pipe_fds[0], NULL, dst, &out, (size_t)(filled - drained), SPLICE_F_MOVE);
+			if (moved > 0) {
+				drained += moved;
+				continue;
+			}
+			if (moved < 0 && errno == EINTR) continue;
+			if (moved < 0 && isUnsupportedError(errno)) {
+				// Target refuses splice: the bytes already sit in the pipe, so write them out by hand
+				// and let the next engine carry on from there
+				while (drained < filled) {
+					ssize_t got = read(pipe_fds[0], buffer, std::min<size_t>((size_t)(filled - drained), buffer_size));
+					if (got <= 0 || writeAt(dst, buffer, (size_t)got, dst_offset + copied + drained) != got) {
+						result = EngineResult::Failed;
+						break;
+					}
+					drained += got;
+				}
+				if (result != EngineResult::Failed) {
+					copied += (uint64_t)drained;
+					progress(copied);
+					result = EngineResult::Unsupported;
+				}
+			} else {
+				result = EngineResult::Failed;
+			}
+			break;
+		}
+		if (drained < filled || result != EngineResult::Done) break;
+
+		copied += (uint64_t)filled;
+		progress(copied);
+	}
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	return result;
+}
+
+#endif
+
+static EngineResult copyWithBuffer(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset,
+	uint64_t length, char* buffer, size_t buffer_size, uint64_t& copied, const CopyProgress& progress, const CopyTap& tap) {
+	while (copied < length) {
+		size_t chunk = (size_t)std::min<uint64_t>(length - copied, buffer_size);
+		int64_t got = readAt(src, buffer, chunk, src_offset + copied);
+		if (got <= 0) {
+			return EngineResult::Failed;
+		}
+		if (writeAt(dst, buffer, (size_t)got, dst_offset + copied) != got) {
+			return EngineResult::Failed;
+		}
+		if (tap) {
+			tap(buffer, (size_t)got);
+		}
+		copied += (uint64_t)got;
+		progress(copied);
+	}
+	return EngineResult::Done;
+}
+
+#ifdef __linux__
+
+// Clones are only allowed between offsets on block boundaries, so a piece only shares its extents when it
+// sits at the same distance from a block boundary in the source as in the output. Split PKG pieces are
+// usually whole multiples of the block size, which lines every piece up. The bytes in front of the first
+// boundary are copied, the middle is cloned, and the tail is cloned too when the output ends there.
+// Anything the filesystem refuses to clone is copied with copy_file_range or the buffer.
+static EngineResult copyWithReflink(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset,
+	uint64_t length, char* buffer, size_t buffer_size, uint64_t& copied, const CopyProgress& progress) {
+	// Clones move no data, so only the bytes copied around them pay for --max-rate
+	uint64_t paid = 0;
+	CopyProgress paced = [&](uint64_t position) {
+		throttleIo(position - paid);
+		paid = position;
+		progress(position);
+	};
+	auto copyUpTo = [&](uint64_t end) {
+		paid = copied;
+		EngineResult result = copyWithCopyFileRange(src, src_offset, dst, dst_offset, end, buffer_size, copied, paced);
+		if (result == EngineResult::Unsupported) {
+			result = copyWithBuffer(src, src_offset, dst, dst_offset, end, buffer, buffer_size, copied, paced, nullptr);
+		}
+		return result;
+	};
+
+	struct stat info;
+	if (fstat(dst, &info) != 0) {
+		return EngineResult::Failed;
+	}
+	uint64_t block = info.st_blksize > 0 ? (uint64_t)info.st_blksize : 4096;
+	if ((src_offset + copied) % block != (dst_offset + copied) % block) {
+		return copyUpTo(length);
+	}
+
+	uint64_t head_end = std::min(length, copied + (block - (dst_offset + copied) % block) % block);
+	EngineResult result = copyUpTo(head_end);
+	if (result != EngineResult::Done) {
+		return result;
+	}
+
+	uint64_t middle_end = copied + (length - copied) / block * block;
+	while (copied < middle_end) {
+		uint64_t chunk = std::min(middle_end - copied, REFLINK_CHUNK_SIZE);
+		if (!cloneRange(src, src_offset + copied, dst, dst_offset + copied, chunk)) {
+			return isUnsupportedError(errno) || errno == ENOTTY ? copyUpTo(length) : EngineResult::Failed;
+		}
+		copied += chunk;
+		progress(copied);
+	}
+
+	// A partial last block clones only if it ends the source and nothing in the output follows it
+	if (copied < length && cloneRange(src, src_offset + copied, dst, dst_offset + copied, length - copied)) {
+		copied = length;
+		progress(copied);
+	}
+	return copyUpTo(length);
+}
+
+#endif
+
+static EngineResult runEngine(CopyEngine engine, FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset,
+	uint64_t length, char* buffer, size_t buffer_size, uint64_t& copied, const CopyProgress& progress, const CopyTap& tap) {
+	if (tap && engine != CopyEngine::Buffered) {
+		return EngineResult::Unsupported;
+	}
+	switch (engine) {
+#ifdef __linux__
+	case CopyEngine::CopyFileRange:
+		return copyWithCopyFileRange(src, src_offset, dst, dst_offset, length, buffer_size, copied, progress);
+	case CopyEngine::Splice:
+		return copyWithSplice(src, src_offset, dst, dst_offset, length, buffer, buffer_size, copied, progress);
+	case CopyEngine::IoUring:
+		return copyWithIoUring(src, src_offset, dst, dst_offset, length, buffer_size, copied, progress);
+	case CopyEngine::Reflink:
+		return copyWithReflink(src, src_offset, dst, dst_offset, length, buffer, buffer_size, copied, progress);
+#endif
+	case CopyEngine::Buffered:
+		return copyWithBuffer(src, src_offset, dst, dst_offset, length, buffer, buffer_size, copied, progress, tap);
+	default:
+		return EngineResult::Unsupported;
+	}
+}
+
+bool copyRange(CopyEngine engine, FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset,
+	uint64_t length, char* buffer, size_t buffer_size, const CopyProgress& unpaced, CopyEngine* used, const CopyTap& tap) {
+	uint64_t copied = 0;
+	// --max-rate pays for every chunk as it's reported. The reflink engine pays for what it copies itself,
+	// since its clones move no data.
+	CopyProgress progress = engine == CopyEngine::Reflink ? unpaced : throttledProgress(unpaced);
+
+	if (engine != CopyEngine::Auto) {
+		if (used != nullptr) *used = engine;
+		return runEngine(engine, src, src_offset, dst, dst_offset, length, buffer, buffer_size, copied, progress, tap) == EngineResult::Done;
+	}
+
+	// Fastest first; the buffered loop always works so it closes the chain
+	for (CopyEngine candidate : { CopyEngine::CopyFileRange, CopyEngine::Splice, CopyEngine::Buffered }) {
+		if (!isEngineAvailable(candidate)) continue;
+		if (used != nullptr) *used = candidate;
+		EngineResult result = runEngine(candidate, src, src_offset, dst, dst_offset, length, buffer, buffer_size, copied, progress, tap);
+		if (result != EngineResult::Unsupported) {
+			return result == EngineResult::Done;
+		}
+	}
+	return false;
+}
+
+#ifdef __linux__
+
+static EngineResult streamWithSplice(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t length, size_t chunk_size,
+	uint64_t& copied, const CopyProgress& progress) {
+	while (copied < length) {
+		loff_t in = (loff_t)(src_offset + copied);
+		size_t chunk = (size_t)std::min<uint64_t>(length - copied, chunk_size);
+		ssize_t moved = splice(src, &in, dst, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (moved < 0) {
+			if (errno == EINTR) continue;
+			return isUnsupportedError(errno) ? EngineResult::Unsupported : EngineResult::Failed;
+		}
+		if (moved == 0) {
+			return copied == 0 ? EngineResult::Unsupported : EngineResult::Failed;
+		}
+		copied += (uint64_t)moved;
+		progress(copied);
+	}
+	return EngineResult::Done;
+}
+
+static EngineResult streamWithSendfile(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t length, size_t chunk_size,
+	uint64_t& copied, const CopyProgress& progress) {
+	while (copied < length) {
+		off_t in = (off_t)(src_offset + copied);
+		size_t chunk = (size_t)std::min<uint64_t>(length - copied, chunk_size);
+		ssize_t moved = sendfile(dst, src, &in, chunk);
+		if (moved < 0) {
+			if (errno == EINTR) continue;
+			return isUnsupportedError(errno) ? EngineResult::Unsupported : EngineResult::Failed;
+		}
+		if (moved == 0) {
+			return copied == 0 ? EngineResult::Unsupported : EngineResult::Failed;
+		}
+		copied += (uint64_t)moved;
+		progress(copied);
+	}
+	return EngineResult::Done;
+}
+
+#endif
+
+static EngineResult streamWithBuffer(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t length, char* buffer,
+	size_t buffer_size, uint64_t& copied, const CopyProgress& progress) {
+	while (copied < length) {
+		size_t chunk = (size_t)std::min<uint64_t>(length - copied, buffer_size);
+		int64_t got = readAt(src, buffer, chunk, src_offset + copied);
+		if (got <= 0 || writeStream(dst, buffer, (size_t)got) != got) {
+			return EngineResult::Failed;
+		}
+		copied += (uint64_t)got;
+		progress(copied);
+	}
+	return EngineResult::Done;
+}
+
+bool streamRange(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t length, char* buffer, size_t buffer_size,
+	const CopyProgress& unpaced, const char** method) {
+	uint64_t copied = 0;
+	CopyProgress progress = throttledProgress(unpaced);
+	EngineResult result = EngineResult::Unsupported;
+#ifdef __linux__
+	// A pipe takes the page cache pages as they are; anything else gets them copied in the kernel
+	struct stat info;
+	bool pipe = fstat(dst, &info) == 0 && S_ISFIFO(info.st_mode);
+	if (pipe) {
+		if (method != nullptr) *method = "splice";
+		result = streamWithSplice(src, src_offset, dst, length, buffer_size, copied, progress);
+	}
+	if (result == EngineResult::Unsupported) {
+		if (method != nullptr) *method = "sendfile";
+		result = streamWithSendfile(src, src_offset, dst, length, buffer_size, copied, progress);
+	}
+#endif
+	if (result == EngineResult::Unsupported) {
+		if (method != nullptr) *method = "buffered";
+		result = streamWithBuffer(src, src_offset, dst, length, buffer, buffer_size, copied, progress);
+	}
+	return result == EngineResult::Done;
+}
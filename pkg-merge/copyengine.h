@@ -0,0 +1,64 @@
+// copyengine.h : pluggable engines that move a byte range from one file into another
+//
+
+#pragma once
+
+#include "fileio.h"
+#include <functional>
+
+enum class CopyEngine {
+	Auto,			// Try the in-kernel engines first, fall back per source/target pair
+	CopyFileRange,	// Linux copy_file_range(2), no user-space copies at all
+	Splice,			// Linux splice(2) through a pipe, no user-space copies
+	Buffered,		// Portable read/write loop through a user-space buffer
+	IoUring,		// Linux io_uring, several reads and writes in flight over registered buffers
+	Reflink			// Linux FICLONERANGE, shares the source extents on XFS/Btrfs instead of copying
+};
+
+// Result of a single engine run over (the rest of) a range
+enum class EngineResult { Done, Unsupported, Failed };
+
+// One source file and the place its bytes land in the merged output
+struct MergeSegment {
+	std::filesystem::path	file;
+	std::string				label;		// How progress output names it: "root", "part 3", "_sc part (final)"
+	uint64_t				size;
+	uint64_t				offset;		// Position of its first byte in the merged output
+};
+
+// Called after every chunk with the number of bytes of the range copied so far
+typedef std::function<void(uint64_t copied)> CopyProgress;
+// Sees every chunk in order as it passes through the copy buffer (inline hashing)
+typedef std::function<void(const char* data, size_t length)> CopyTap;
+
+// Copy buffer size for a merge whose largest piece is `largest_piece` bytes; `size_class` receives a
+// word for the tier ("small", "medium", ...). The tiers haven't been tuned yet; "pkg-merge -bench-merge"
+// reports the size they pick next to the measured ones, to check them against.
+size_t mergeBufferSize(uint64_t largest_piece, const char** size_class = nullptr);
+
+const char* engineName(CopyEngine engine);
+bool parseEngineName(const std::string& name, CopyEngine& engine);
+bool isEngineAvailable(CopyEngine engine);
+
+// Tries to clone the first block of `source_file` into a scratch file in `target_dir`. True when both are
+// on the same filesystem and it can share extents, so the reflink engine will clone rather than copy.
+bool isReflinkPossible(const std::filesystem::path& source_file, const std::filesystem::path& target_dir);
+
+// Copies `length` bytes from `src` at `src_offset` to `dst` at `dst_offset`, in chunks of `buffer_size`.
+// With CopyEngine::Auto the engines are tried fastest first, and whichever one the kernel rejects for
+// this pair hands over to the next one at the current position. `used` receives the engine that finished
+// the copy. `buffer` must always hold `buffer_size` bytes. The buffered engine copies through it, splice
+// drains its pipe through it when the target refuses splice, reflink copies the unaligned head and tail
+// through it, and Auto may end up in any of them. Only io_uring ignores it and brings its own buffer ring.
+// The reflink engine clones every block it can line up between source and target and copies the rest.
+// A `tap` needs the bytes in user space, so it restricts the copy to the buffered engine.
+// Returns false on I/O error.
+bool copyRange(CopyEngine engine, FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset,
+	uint64_t length, char* buffer, size_t buffer_size, const CopyProgress& progress, CopyEngine* used = nullptr,
+	const CopyTap& tap = nullptr);
+
+// Appends `length` bytes of `src` from `src_offset` on to a stream that can't be written at an offset
+// (pipe, socket, terminal, or a file at its current position): splice(2) into a pipe, sendfile(2) into
+// anything else, and a read/write loop where neither works. `method` receives what was used.
+bool streamRange(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t length, char* buffer, size_t buffer_size,
+	const CopyProgress& progress, const char** method = nullptr);
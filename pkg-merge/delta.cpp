@@ -0,0 +1,209 @@
+// delta.cpp : block comparison and the .blocks file behind --delta
+//
+
+#include "stdafx.h"
+#include "delta.h"
+#include "concatreader.h"
+#include "checksum.h"
+#include "throttle.h"
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <algorithm>
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+
+// Contents of a .blocks file
+struct BlockMap {
+	uint64_t					block_size;
+	uint64_t					output_size;
+	long long					output_mtime;
+	vector<MergeSegment>		segments;
+	vector<long long>			mtimes;
+	vector<uint64_t>			hashes;
+	BlockMap() : block_size(0), output_size(0), output_mtime(0) {}
+};
+
+// Helper function to read a file's mtime as a plain number, 0 if it can't be read
+static long long fileMtime(const fs::path& file) {
+	std::error_code error;
+	auto mtime = fs::last_write_time(file, error);
+	return error ? 0 : (long long)mtime.time_since_epoch().count();
+}
+
+static bool loadBlockMap(const fs::path& blocks_file, BlockMap& map) {
+	std::ifstream blocks(blocks_file, std::ios::binary);
+	if (!blocks) {
+		return false;
+	}
+	string line;
+	while (std::getline(blocks, line)) {
+		if (line.empty() || line[0] == '#') continue;
+		vector<string> fields;
+		std::istringstream columns(line);
+		string field;
+		while (std::getline(columns, field, '\t')) {
+			fields.push_back(field);
+		}
+		if (fields[0] == "block_size" && fields.size() == 2) {
+			map.block_size = strtoull(fields[1].c_str(), NULL, 10);
+		} else if (fields[0] == "output" && fields.size() == 3) {
+			map.output_size = strtoull(fields[1].c_str(), NULL, 10);
+			map.output_mtime = strtoll(fields[2].c_str(), NULL, 10);
+		} else if (fields[0] == "segment" && fields.size() == 5) {
+			map.segments.push_back({ fs::path(fields[4]), "", strtoull(fields[2].c_str(), NULL, 10), strtoull(fields[1].c_str(), NULL, 10) });
+			map.mtimes.push_back(strtoll(fields[3].c_str(), NULL, 10));
+		} else if (fields[0] == "hash" && fields.size() == 2) {
+			map.hashes.push_back(strtoull(fields[1].c_str(), NULL, 16));
+		}
+	}
+	uint64_t expected = map.block_size == 0 ? 0 : (map.output_size + map.block_size - 1) / map.block_size;
+	return map.block_size > 0 && map.hashes.size() == expected;
+}
+
+static bool saveBlockMap(const fs::path& blocks_file, const vector<MergeSegment>& segments, const fs::path& merged_file,
+	uint64_t merged_size, const vector<uint64_t>& hashes) {
+	std::ostringstream text;
+	text << "# pkg-merge blocks v1\n";
+	text << "block_size\t" << DELTA_BLOCK_SIZE << "\n";
+	text << "output\t" << merged_size << "\t" << fileMtime(merged_file) << "\n";
+	for (auto & segment : segments) {
+		text << "segment\t" << segment.offset << "\t" << segment.size << "\t" << fileMtime(segment.file) << "\t"
+			<< fs::absolute(segment.file).string() << "\n";
+	}
+	char hex[32];
+	for (auto hash : hashes) {
+		snprintf(hex, sizeof(hex), "hash\t%016llx\n", (unsigned long long)hash);
+		text << hex;
+	}
+
+	// Write aside and rename, a torn .blocks file must not be trusted
+	fs::path temp_file = blocks_file;
+	temp_file += ".tmp";
+	{
+		std::ofstream out(temp_file, std::ios::binary | std::ios::trunc);
+		out << text.str();
+		if (!out.flush()) {
+			return false;
+		}
+	}
+	std::error_code error;
+	fs::rename(temp_file, blocks_file, error);
+	return !error;
+}
+
+bool deltaMerge(const PkgPartSet& part_set, const fs::path& merged_file, const CopyProgress& progress, DeltaStats& stats) {
+	const vector<MergeSegment>& segments = part_set.segments();
+	uint64_t merged_size = part_set.size();
+	fs::path blocks_file = merged_file;
+	blocks_file += ".blocks";
+
+	std::error_code error;
+	bool existed = fs::exists(merged_file, error);
+	uint64_t old_size = existed ? fs::file_size(merged_file, error) : 0;
+	if (error) {
+		return false;
+	}
+
+	// Stored hashes only describe the output if nobody wrote to it since they were taken
+	BlockMap map;
+	bool trusted = existed && loadBlockMap(blocks_file, map) && map.block_size == DELTA_BLOCK_SIZE &&
+		map.output_size == old_size && map.output_mtime == fileMtime(merged_file);
+
+	// Pieces that are where they were, with the size and mtime they had, still hold the bytes the output got from them
+	vector<bool> unchanged(segments.size(), false);
+	for (size_t i = 0; trusted && i < segments.size(); i++) {
+		for (size_t j = 0; j < map.segments.size(); j++) {
+			if (map.segments[j].offset == segments[i].offset && map.segments[j].size == segments[i].size &&
+				map.mtimes[j] == fileMtime(segments[i].file) && map.segments[j].file == fs::absolute(segments[i].file)) {
+				unchanged[i] = true;
+				break;
+			}
+		}
+	}
+
+	ConcatReader reader{ part_set };
+	if (!reader.open()) {
+		return false;
+	}
+	FileHandle merged = openForWrite(merged_file, !existed);
+	if (merged == INVALID_FILE) {
+		return false;
+	}
+
+	vector<char> source((size_t)DELTA_BLOCK_SIZE);
+	vector<char> current((size_t)DELTA_BLOCK_SIZE);
+	vector<uint64_t> hashes;
+	stats = DeltaStats();
+	stats.blocks = (merged_size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+	hashes.reserve((size_t)stats.blocks);
+
+	bool ok = true;
+	size_t first_segment = 0;
+	for (uint64_t block = 0; ok && block < stats.blocks; block++) {
+		uint64_t offset = block * DELTA_BLOCK_SIZE;
+		size_t length = (size_t)std::min(DELTA_BLOCK_SIZE, merged_size - offset);
+		// The old block only compares if it had the same length (the last one may have grown or shrunk)
+		bool comparable = trusted && block < map.hashes.size() && offset < old_size &&
+			std::min(DELTA_BLOCK_SIZE, old_size - offset) == length;
+
+		// Blocks ascend, so the first segment overlapping this one only moves forward
+		while (segments[first_segment].offset + segments[first_segment].size <= offset) {
+			first_segment++;
+		}
+		bool covered = comparable;
+		for (size_t i = first_segment; covered && i < segments.size() && segments[i].offset < offset + length; i++) {
+			covered = unchanged[i];
+		}
+		if (covered) {
+			hashes.push_back(map.hashes[(size_t)block]);
+			stats.unchanged++;
+			progress(offset + length);
+			continue;
+		}
+
+		if (reader.pread(source.data(), length, offset) != (int64_t)length) {
+			ok = false;
+			break;
+		}
+		throttleIo(length);
+		Xxh64 xxh;
+		xxh.update(source.data(), length);
+		uint64_t hash = xxh.digest();
+
+		bool same;
+		if (comparable) {
+			same = map.hashes[(size_t)block] == hash;
+		} else if (offset + length <= old_size) {
+			same = readAt(merged, current.data(), length, offset) == (int64_t)length && memcmp(current.data(), source.data(), length) == 0;
+		} else {
+			same = false;
+		}
+
+		if (same) {
+			stats.verified++;
+		} else {
+			ok = writeAt(merged, source.data(), length, offset) == (int64_t)length;
+			stats.rewritten++;
+			stats.bytes_written += length;
+		}
+		hashes.push_back(hash);
+		progress(offset + length);
+	}
+
+	if (ok && old_size != merged_size) {
+		ok = resizeFile(merged, merged_size);
+	}
+	ok = ok && syncFile(merged);
+	closeFile(merged);
+
+	if (ok) {
+		// Recorded after the last write, so the next run sees the mtime the output really has now
+		saveBlockMap(blocks_file, segments, merged_file, merged_size, hashes);
+	} else {
+		fs::remove(blocks_file, error);
+	}
+	return ok;
+}
@@ -0,0 +1,29 @@
+// delta.h : --delta re-merges that only rewrite the blocks of an existing output that changed
+//
+
+#pragma once
+
+#include "pkgparts.h"
+#include "copyengine.h"
+#include <vector>
+
+// Outputs are compared and hashed in blocks of this size
+const uint64_t DELTA_BLOCK_SIZE = 1024 * 1024;
+
+struct DeltaStats {
+	uint64_t			blocks;			// Blocks in the new output
+	uint64_t			unchanged;		// Skipped without any I/O: only unchanged pieces behind them
+	uint64_t			verified;		// Read and found equal to the output
+	uint64_t			rewritten;		// Written because they differed or the output was shorter
+	uint64_t			bytes_written;
+	DeltaStats() : blocks(0), unchanged(0), verified(0), rewritten(0), bytes_written(0) {}
+};
+
+// Brings `merged_file` up to date with the pieces, writing only the blocks that differ, then cuts or
+// extends it to the merged size. "<merged file>.blocks" keeps an XXH64 of every block along with the
+// size and mtime of the output and of every piece: while the output still has the recorded size and
+// mtime, blocks covered only by pieces with unchanged size and mtime are skipped, and the others are
+// compared by hash instead of being read back. Without a usable .blocks file the output is read back
+// and compared. A missing output is written in full. Returns false on I/O errors.
+bool deltaMerge(const PkgPartSet& part_set, const std::filesystem::path& merged_file, const CopyProgress& progress,
+	DeltaStats& stats);
@@ -0,0 +1,182 @@
+// devices.cpp : mapping paths to their disks through sysfs (Linux) or storage IOCTLs (Windows)
+//
+
+#include "stdafx.h"
+#include "devices.h"
+#include <fstream>
+#include <sstream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
+
+namespace fs = std::filesystem;
+using std::string;
+
+// Disk of every path that couldn't be identified
+const uint64_t UNKNOWN_DEVICE = ~0ULL;
+
+#ifdef _WIN32
+
+static bool identifyDisk(const wchar_t* volume_path, BlockDevice& device) {
+	wchar_t volume_name[MAX_PATH];
+	if (!GetVolumeNameForVolumeMountPointW(volume_path, volume_name, MAX_PATH)) {
+		return false;
+	}
+	// "\\?\Volume{...}\" opens the volume itself once the trailing backslash is gone
+	std::wstring name = volume_name;
+	if (!name.empty() && name.back() == L'\\') {
+		name.pop_back();
+	}
+	HANDLE volume = CreateFileW(name.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (volume == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	// Fails for volumes spanning several disks, which then count as unknown
+	STORAGE_DEVICE_NUMBER number;
+	DWORD got = 0;
+	bool ok = DeviceIoControl(volume, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, &number, sizeof(number), &got, NULL) != 0;
+	if (ok) {
+		device.id = number.DeviceNumber;
+		device.name = "PhysicalDrive" + std::to_string(number.DeviceNumber);
+		STORAGE_PROPERTY_QUERY query = {};
+		query.PropertyId = StorageDeviceSeekPenaltyProperty;
+		query.QueryType = PropertyStandardQuery;
+		DEVICE_SEEK_PENALTY_DESCRIPTOR penalty = {};
+		device.rotational = DeviceIoControl(volume, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &penalty,
+			sizeof(penalty), &got, NULL) != 0 && penalty.IncursSeekPenalty;
+	}
+	CloseHandle(volume);
+	return ok;
+}
+
+// Helper function to find the volume `path` is on, as its serial number and root path
+static bool volumeOf(const fs::path& path, uint64_t& volume, std::wstring& volume_path) {
+	wchar_t root[MAX_PATH];
+	DWORD serial = 0;
+	if (!GetVolumePathNameW(path.c_str(), root, MAX_PATH) || !GetVolumeInformationW(root, NULL, 0, &serial, NULL, NULL, NULL, 0)) {
+		return false;
+	}
+	volume = serial;
+	volume_path = root;
+	return true;
+}
+
+#else
+
+static bool readLine(const fs::path& file, string& line) {
+	std::ifstream in(file);
+	return (bool)std::getline(in, line);
+}
+
+// Helper function to find the block device of a filesystem whose st_dev has none (Btrfs, major 0) from
+// the source of its mount
+static bool mountSource(dev_t dev, dev_t& source) {
+	std::ifstream mounts("/proc/self/mountinfo");
+	string wanted = std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+	string line;
+	while (std::getline(mounts, line)) {
+		// "36 35 0:45 / /mnt rw,relatime shared:1 - btrfs /dev/sdb1 rw"
+		std::istringstream fields(line);
+		string mount_id, parent_id, numbers;
+		fields >> mount_id >> parent_id >> numbers;
+		size_t separator = line.find(" - ");
+		if (numbers != wanted || separator == string::npos) continue;
+		std::istringstream tail(line.substr(separator + 3));
+		string type, device;
+		tail >> type >> device;
+		struct stat info;
+		if (device.compare(0, 5, "/dev/") == 0 && stat(device.c_str(), &info) == 0 && S_ISBLK(info.st_mode)) {
+			source = info.st_rdev;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool identifyDisk(dev_t dev, BlockDevice& device) {
+	std::error_code error;
+	fs::path node = fs::canonical("/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev)), error);
+	if (error) {
+		return false;
+	}
+	// A partition sits in the folder of its disk, and the disk is what seeks. Device mapper and md devices
+	// are taken as they are, with the rotational flag the kernel gives them.
+	if (fs::exists(node / "partition", error)) {
+		node = node.parent_path();
+	}
+	string numbers;
+	unsigned disk_major, disk_minor;
+	if (!readLine(node / "dev", numbers) || sscanf(numbers.c_str(), "%u:%u", &disk_major, &disk_minor) != 2) {
+		return false;
+	}
+	string rotational;
+	device.id = makedev(disk_major, disk_minor);
+	device.name = node.filename().string();
+	device.rotational = readLine(node / "queue" / "rotational", rotational) && rotational == "1";
+	return true;
+}
+
+#endif
+
+size_t DeviceMap::deviceOf(const fs::path& path) {
+	uint64_t volume = 0;
+	bool have_volume = false;
+	BlockDevice device;
+	bool found = false;
+
+#ifdef _WIN32
+	std::wstring volume_path;
+	if (volumeOf(path, volume, volume_path)) {
+		have_volume = true;
+		auto cached = by_volume.find(volume);
+		if (cached != by_volume.end()) {
+			return cached->second;
+		}
+		found = identifyDisk(volume_path.c_str(), device);
+	}
+#else
+	struct stat info;
+	if (stat(path.c_str(), &info) == 0) {
+		volume = info.st_dev;
+		have_volume = true;
+		auto cached = by_volume.find(volume);
+		if (cached != by_volume.end()) {
+			return cached->second;
+		}
+		dev_t dev = info.st_dev;
+		dev_t source;
+		if (major(dev) == 0 && mountSource(dev, source)) {
+			dev = source;
+		}
+		found = identifyDisk(dev, device);
+	}
+#endif
+
+	// tmpfs, network shares and the like: nothing to seek, so they are treated as one solid-state device
+	if (!found) {
+		device = BlockDevice();
+		device.id = UNKNOWN_DEVICE;
+		device.name = "unknown";
+	}
+
+	size_t index;
+	auto known = by_id.find(device.id);
+	if (known != by_id.end()) {
+		index = known->second;
+	} else {
+		index = list.size();
+		list.push_back(device);
+		by_id[device.id] = index;
+	}
+	if (have_volume) {
+		by_volume[volume] = index;
+	}
+	return index;
+}
@@ -0,0 +1,34 @@
+// devices.h : which disk a file lives on, so --jobs can spread merges over disks instead of piling onto one
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <filesystem>
+
+struct BlockDevice {
+	uint64_t		id;				// Whole-disk device number (partitions of one disk share it)
+	std::string		name;			// "sda", "nvme0n1", "PhysicalDrive1", or the volume if the disk is unknown
+	bool			rotational;		// Spinning disk: concurrent streams cost seeks
+	BlockDevice() : id(0), rotational(false) {}
+};
+
+// Numbers the disks behind a set of paths. On Linux a path's st_dev is followed through /sys/dev/block to
+// its whole disk and that disk's queue/rotational flag; filesystems without a block device of their own
+// (Btrfs subvolumes) are looked up in /proc/self/mountinfo. On Windows the volume is asked for its physical
+// disk number and seek penalty. Paths whose disk can't be found share one "unknown" solid-state device.
+class DeviceMap {
+public:
+	// Index into devices() of the disk `path` (a file or a folder) is on
+	size_t deviceOf(const std::filesystem::path& path);
+
+	const std::vector<BlockDevice>& devices() const { return list; }
+
+private:
+	std::vector<BlockDevice>		list;
+	std::map<uint64_t, size_t>		by_id;
+	std::map<uint64_t, size_t>		by_volume;		// st_dev / volume serial, so each filesystem is only looked up once
+};
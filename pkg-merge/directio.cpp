@@ -0,0 +1,305 @@
+// directio.cpp : merging around the page cache (--direct)
+//
+
+#include "stdafx.h"
+#include "directio.h"
+#include "throttle.h"
+#include <algorithm>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#endif
+
+namespace fs = std::filesystem;
+
+static uint64_t alignDown(uint64_t value) {
+	return value & ~(uint64_t)(DIRECT_ALIGNMENT - 1);
+}
+
+static uint64_t alignUp(uint64_t value) {
+	return alignDown(value + DIRECT_ALIGNMENT - 1);
+}
+
+#ifdef _WIN32
+
+char* allocateAligned(size_t size) {
+	return (char*)_aligned_malloc(size, DIRECT_ALIGNMENT);
+}
+
+void freeAligned(char* buffer) {
+	_aligned_free(buffer);
+}
+
+bool openDirect(const fs::path& path, bool write, DirectFile& file) {
+	// NTFS, ReFS and exFAT all take unbuffered handles, so there's no buffered fallback to pick here.
+	// The merge keeps its own handle on the output open (openForWrite shares write access for this),
+	// and this handle has to let it keep writing too.
+	HANDLE h = CreateFileW(path.c_str(), write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+		write ? FILE_SHARE_READ | FILE_SHARE_WRITE : FILE_SHARE_READ, NULL, write ? OPEN_ALWAYS : OPEN_EXISTING,
+		FILE_FLAG_NO_BUFFERING | (write ? FILE_FLAG_WRITE_THROUGH : FILE_FLAG_SEQUENTIAL_SCAN), NULL);
+	file.handle = h == INVALID_HANDLE_VALUE ? INVALID_FILE : (FileHandle)h;
+	file.direct = true;
+	file.write = write;
+	file.path = path;
+	return file.handle != INVALID_FILE;
+}
+
+// Helper function for a single transfer; unbuffered handles can't continue a short one at an unaligned offset
+static int64_t transferOnce(DirectFile& file, char* buffer, size_t length, uint64_t offset) {
+	OVERLAPPED ov = {};
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD moved = 0;
+	BOOL ok = file.write ? WriteFile((HANDLE)file.handle, buffer, (DWORD)length, &moved, &ov)
+		: ReadFile((HANDLE)file.handle, buffer, (DWORD)length, &moved, &ov);
+	if (!ok) {
+		return !file.write && GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+	}
+	return moved;
+}
+
+static bool isAlignmentError() {
+	return false;
+}
+
+static bool reopenBuffered(DirectFile&) {
+	return false;
+}
+
+static void adviseSequential(DirectFile&) {
+}
+
+static void dropCached(DirectFile&, uint64_t, uint64_t) {
+}
+
+static void startWriteback(DirectFile&, uint64_t, uint64_t) {
+}
+
+static bool resizeDirect(DirectFile& file, uint64_t size) {
+	FILE_END_OF_FILE_INFO end_of_file = {};
+	end_of_file.EndOfFile.QuadPart = (LONGLONG)size;
+	return SetFileInformationByHandle((HANDLE)file.handle, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file)) != 0;
+}
+
+#else
+
+char* allocateAligned(size_t size) {
+	void* buffer = nullptr;
+	return posix_memalign(&buffer, DIRECT_ALIGNMENT, size) == 0 ? (char*)buffer : nullptr;
+}
+
+void freeAligned(char* buffer) {
+	free(buffer);
+}
+
+static int openFlags(bool write) {
+	return (write ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC;
+}
+
+bool openDirect(const fs::path& path, bool write, DirectFile& file) {
+	file.write = write;
+	file.path = path;
+	file.handle = open(path.c_str(), openFlags(write) | O_DIRECT, 0644);
+	file.direct = file.handle != INVALID_FILE;
+	if (file.handle == INVALID_FILE && errno == EINVAL) {
+		// This filesystem has no O_DIRECT
+		file.handle = open(path.c_str(), openFlags(write), 0644);
+	}
+	return file.handle != INVALID_FILE;
+}
+
+static int64_t transferOnce(DirectFile& file, char* buffer, size_t length, uint64_t offset) {
+	for (;;) {
+		ssize_t moved = file.write ? pwrite(file.handle, buffer, length, (off_t)offset) : pread(file.handle, buffer, length, (off_t)offset);
+		if (moved < 0 && errno == EINTR) continue;
+		return moved;
+	}
+}
+
+// Some filesystems accept O_DIRECT at open time and only reject the transfers
+static bool isAlignmentError() {
+	return errno == EINVAL;
+}
+
+static bool reopenBuffered(DirectFile& file) {
+	int handle = open(file.path.c_str(), openFlags(file.write), 0644);
+	if (handle < 0) {
+		return false;
+	}
+	close(file.handle);
+	file.handle = handle;
+	file.direct = false;
+	return true;
+}
+
+static void adviseSequential(DirectFile& file) {
+	if (!file.direct) {
+		posix_fadvise(file.handle, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+}
+
+static void dropCached(DirectFile& file, uint64_t offset, uint64_t length) {
+	if (file.direct || length == 0) return;
+#ifdef __linux__
+	// Dirty pages can't be dropped, so wait for the writeback started earlier to finish first
+	if (file.write) {
+		sync_file_range(file.handle, (off_t)offset, (off_t)length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	}
+#endif
+	posix_fadvise(file.handle, (off_t)offset, (off_t)length, POSIX_FADV_DONTNEED);
+}
+
+static void startWriteback(DirectFile& file, uint64_t offset, uint64_t length) {
+#ifdef __linux__
+	if (!file.direct && length > 0) {
+		sync_file_range(file.handle, (off_t)offset, (off_t)length, SYNC_FILE_RANGE_WRITE);
+	}
+#else
+	(void)file; (void)offset; (void)length;
+#endif
+}
+
+static bool resizeDirect(DirectFile& file, uint64_t size) {
+	return ftruncate(file.handle, (off_t)size) == 0;
+}
+
+#endif
+
+void closeDirect(DirectFile& file) {
+	closeFile(file.handle);
+	file.handle = INVALID_FILE;
+}
+
+DirectOutput::DirectOutput(size_t buffer_size) : buffer(allocateAligned(buffer_size)), buffer_size(buffer_size),
+	pending(0), flushed_offset(0), dropped_offset(0) {
+}
+
+DirectOutput::~DirectOutput() {
+	closeDirect(file);
+	freeAligned(buffer);
+}
+
+bool DirectOutput::open(const fs::path& path, uint64_t offset) {
+	if (buffer == nullptr || !openDirect(path, true, file)) {
+		return false;
+	}
+	flushed_offset = alignDown(offset);
+	dropped_offset = flushed_offset;
+	pending = (size_t)(offset - flushed_offset);
+	if (pending == 0) {
+		return true;
+	}
+
+	// Pick up the start of the partly written block; it's rewritten with the rest of it
+	DirectFile reader;
+	reader.handle = file.handle;
+	reader.direct = file.direct;
+	return transferOnce(reader, buffer, DIRECT_ALIGNMENT, flushed_offset) >= (int64_t)pending;
+}
+
+bool DirectOutput::flushBlocks(size_t length) {
+	for (size_t done = 0; done < length;) {
+		int64_t put = transferOnce(file, buffer + done, length - done, flushed_offset + done);
+		if (put < 0 && file.direct && isAlignmentError() && reopenBuffered(file)) {
+			continue;
+		}
+		if (put <= 0) {
+			return false;
+		}
+		done += (size_t)put;
+	}
+
+	// Without O_DIRECT, push this buffer towards the disk now and drop the one before it from the cache
+	startWriteback(file, flushed_offset, length);
+	dropCached(file, dropped_offset, flushed_offset - dropped_offset);
+	dropped_offset = flushed_offset;
+	return true;
+}
+
+bool DirectOutput::write(const char* data, size_t length) {
+	while (length > 0) {
+		size_t chunk = std::min(length, buffer_size - pending);
+		memcpy(buffer + pending, data, chunk);
+		pending += chunk;
+		data += chunk;
+		length -= chunk;
+
+		if (pending == buffer_size) {
+			if (!flushBlocks(buffer_size)) {
+				return false;
+			}
+			flushed_offset += buffer_size;
+			pending = 0;
+		}
+	}
+	return true;
+}
+
+bool DirectOutput::finish() {
+	uint64_t size = position();
+	size_t padded = (size_t)alignUp(pending);
+	memset(buffer + pending, 0, padded - pending);
+	if (padded > 0 && !flushBlocks(padded)) {
+		return false;
+	}
+	dropCached(file, dropped_offset, size - dropped_offset);
+	if (!resizeDirect(file, size)) {
+		return false;
+	}
+	flushed_offset = dropped_offset = size;
+	pending = 0;
+	return true;
+}
+
+bool copyToDirectOutput(const fs::path& source, uint64_t skip, uint64_t length, DirectOutput& output,
+	char* buffer, size_t buffer_size, const CopyProgress& progress, const CopyTap& tap, bool* direct) {
+	DirectFile file;
+	if (!openDirect(source, false, file)) {
+		return false;
+	}
+	adviseSequential(file);
+
+	// Reads start on a block boundary, the bytes in front of `skip` are read and dropped
+	uint64_t end = skip + length;
+	uint64_t position = alignDown(skip);
+	uint64_t copied = 0;
+	bool ok = true;
+	while (ok && position < end) {
+		size_t chunk = (size_t)std::min<uint64_t>(buffer_size, alignUp(end - position));
+		int64_t got = transferOnce(file, buffer, chunk, position);
+		if (got < 0 && file.direct && isAlignmentError() && reopenBuffered(file)) {
+			continue;
+		}
+		uint64_t head = position < skip ? skip - position : 0;
+		uint64_t usable = std::min<uint64_t>(got > 0 ? (uint64_t)got : 0, end - position);
+		if (got <= 0 || usable <= head) {
+			ok = false;
+			break;
+		}
+		usable -= head;
+		if (tap) {
+			tap(buffer + head, (size_t)usable);
+		}
+		ok = output.write(buffer + head, (size_t)usable);
+		dropCached(file, position, (uint64_t)got);
+		throttleIo(usable);
+		position += head + usable;
+		copied += usable;
+		if (ok) progress(copied);
+	}
+
+	if (direct != nullptr) {
+		*direct = file.direct;
+	}
+	closeDirect(file);
+	return ok;
+}
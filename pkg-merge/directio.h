@@ -0,0 +1,65 @@
+// directio.h : merging around the page cache (--direct)
+//
+
+#pragma once
+
+#include "copyengine.h"
+
+// Offsets, lengths and buffer addresses of unbuffered transfers have to be multiples of this.
+// 4 KB covers both 512-byte and 4K-native drives.
+const size_t DIRECT_ALIGNMENT = 4096;
+
+char* allocateAligned(size_t size);
+void freeAligned(char* buffer);
+
+// A file opened with O_DIRECT / FILE_FLAG_NO_BUFFERING when the filesystem allows it. Where it doesn't
+// (tmpfs, some network and FUSE mounts), the file is opened normally and the cache is kept small with
+// posix_fadvise(SEQUENTIAL/DONTNEED) and sync_file_range instead.
+struct DirectFile {
+	FileHandle				handle;
+	bool					direct;
+	bool					write;
+	std::filesystem::path	path;
+	DirectFile() : handle(INVALID_FILE), direct(false), write(false) {}
+};
+
+bool openDirect(const std::filesystem::path& path, bool write, DirectFile& file);
+void closeDirect(DirectFile& file);
+
+// Appends to the merged output through one aligned buffer, so only whole blocks at aligned offsets
+// reach the disk whatever the sizes of the pieces. The unaligned tail is written padded on finish()
+// and the file trimmed back to its real size.
+class DirectOutput {
+public:
+	explicit DirectOutput(size_t buffer_size);
+	~DirectOutput();
+
+	DirectOutput(const DirectOutput&) = delete;
+	DirectOutput& operator=(const DirectOutput&) = delete;
+
+	// Opens the (existing) output and continues at `offset`. The bytes of the block below an unaligned
+	// offset are read back from the file so they're written again unchanged.
+	bool open(const std::filesystem::path& path, uint64_t offset);
+	bool write(const char* data, size_t length);
+	bool finish();
+
+	uint64_t position() const { return flushed_offset + pending; }	// Bytes accepted so far
+	uint64_t flushed() const { return flushed_offset; }				// Bytes below this are in the file
+	bool direct() const { return file.direct; }
+
+private:
+	bool flushBlocks(size_t length);
+
+	DirectFile	file;
+	char*		buffer;
+	size_t		buffer_size;
+	size_t		pending;			// Bytes in `buffer` not yet written
+	uint64_t	flushed_offset;		// File offset of buffer[0], always aligned in direct mode
+	uint64_t	dropped_offset;		// Cached output below this has been written back and dropped (fallback mode)
+};
+
+// Reads `length` bytes of `source` from `skip` on through `buffer` (aligned, `buffer_size` a multiple of
+// DIRECT_ALIGNMENT) and appends them to `output`. `tap` and `progress` work as with copyRange.
+// `direct` receives whether the source could be read unbuffered. Returns false on I/O error.
+bool copyToDirectOutput(const std::filesystem::path& source, uint64_t skip, uint64_t length, DirectOutput& output,
+	char* buffer, size_t buffer_size, const CopyProgress& progress, const CopyTap& tap, bool* direct = nullptr);
@@ -0,0 +1,150 @@
+// fanout.cpp : one reader and a writer thread per target folder, joined by a small pool of chunks
+//
+
+#include "stdafx.h"
+#include "fanout.h"
+#include "throttle.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+
+using std::string;
+using std::vector;
+
+struct FanOutChunk {
+	vector<char>	data;
+	size_t			length;
+	uint64_t		offset;			// Position in the merged output
+	size_t			writers_left;	// Outputs that still have to write it; back in the pool at 0
+};
+
+// Helper function to read until `length` bytes are in, a single read may return less
+static bool readFully(FileHandle file, char* buffer, size_t length, uint64_t offset) {
+	for (size_t done = 0; done < length;) {
+		int64_t got = readAt(file, buffer + done, length - done, offset + done);
+		if (got <= 0) return false;
+		done += (size_t)got;
+	}
+	return true;
+}
+
+static bool writeFully(FileHandle file, const char* buffer, size_t length, uint64_t offset) {
+	for (size_t done = 0; done < length;) {
+		int64_t put = writeAt(file, buffer + done, length - done, offset + done);
+		if (put <= 0) return false;
+		done += (size_t)put;
+	}
+	return true;
+}
+
+bool fanOutSegments(const vector<MergeSegment>& segments, const vector<FileHandle>& outputs,
+	const vector<std::filesystem::path>& output_files, size_t buffer_size, const CopyTap& tap,
+	const CopyProgress& progress, string& error) {
+	vector<FanOutChunk> chunks(FANOUT_QUEUE_DEPTH + 1);
+	vector<size_t> free_chunks;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		chunks[i].data.resize(buffer_size);
+		free_chunks.push_back(i);
+	}
+	vector<std::deque<size_t>> queues(outputs.size());
+	bool reading_done = false;
+	bool failed = false;
+	std::mutex lock;
+	std::condition_variable changed;
+
+	auto writer = [&](size_t target) {
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			while (queues[target].empty() && !reading_done && !failed) {
+				changed.wait(guard);
+			}
+			if (failed || queues[target].empty()) break;
+			FanOutChunk& chunk = chunks[queues[target].front()];
+			guard.unlock();
+
+			bool ok = writeFully(outputs[target], chunk.data.data(), chunk.length, chunk.offset);
+			string reason = ok ? string() : lastIoError();
+			if (ok) throttleIo(chunk.length);
+
+			guard.lock();
+			size_t index = queues[target].front();
+			queues[target].pop_front();
+			if (!ok) {
+				if (!failed) {
+					error = "writing " + output_files[target].string() + " failed at offset " + std::to_string(chunk.offset) + ": " + reason;
+				}
+				failed = true;
+				changed.notify_all();
+				break;
+			}
+			// Every writer takes the chunks in order, so the last one to finish a chunk has all before it too
+			if (--chunk.writers_left == 0) {
+				free_chunks.push_back(index);
+				progress(chunk.offset + chunk.length);
+				changed.notify_all();
+			}
+		}
+	};
+
+	vector<std::thread> pool;
+	for (size_t i = 0; i < outputs.size(); i++) {
+		pool.emplace_back(writer, i);
+	}
+
+	for (auto & segment : segments) {
+		FileHandle source = openForRead(segment.file);
+		if (source == INVALID_FILE) {
+			std::lock_guard<std::mutex> guard(lock);
+			error = "could not open " + segment.file.string() + ": " + lastIoError();
+			failed = true;
+			break;
+		}
+		for (uint64_t copied = 0; copied < segment.size;) {
+			size_t index;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				while (free_chunks.empty() && !failed) {
+					changed.wait(guard);
+				}
+				if (failed) break;
+				index = free_chunks.back();
+				free_chunks.pop_back();
+			}
+
+			FanOutChunk& chunk = chunks[index];
+			chunk.length = (size_t)std::min<uint64_t>(segment.size - copied, buffer_size);
+			chunk.offset = segment.offset + copied;
+			if (!readFully(source, chunk.data.data(), chunk.length, copied)) {
+				std::lock_guard<std::mutex> guard(lock);
+				error = "reading " + segment.file.string() + " failed at offset " + std::to_string(copied) + ": " + lastIoError();
+				failed = true;
+				break;
+			}
+			if (tap) tap(chunk.data.data(), chunk.length);
+			copied += chunk.length;
+
+			std::lock_guard<std::mutex> guard(lock);
+			chunk.writers_left = outputs.size();
+			for (auto & queue : queues) {
+				queue.push_back(index);
+			}
+			changed.notify_all();
+		}
+		closeFile(source);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (failed) break;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		reading_done = true;
+		changed.notify_all();
+	}
+	for (auto & thread : pool) {
+		thread.join();
+	}
+	return !failed;
+}
@@ -0,0 +1,20 @@
+// fanout.h : writing one merge to several target folders while reading the pieces only once
+//
+
+#pragma once
+
+#include "copyengine.h"
+#include <string>
+#include <vector>
+
+// Chunks read ahead of the slowest target. Past that the reader waits for it.
+const size_t FANOUT_QUEUE_DEPTH = 8;
+
+// Copies every segment into each of `outputs` at its offset. Each chunk of `buffer_size` bytes is read
+// once and then written by one thread per output, so every target writes at its own pace. A slow target
+// only holds back the reader, and so the other targets, once it is FANOUT_QUEUE_DEPTH chunks behind.
+// `tap` sees every chunk in order as it is read. `progress` receives the bytes that every output has
+// written, called from the writer threads one at a time. On failure `error` says which read or write broke.
+bool fanOutSegments(const std::vector<MergeSegment>& segments, const std::vector<FileHandle>& outputs,
+	const std::vector<std::filesystem::path>& output_files, size_t buffer_size, const CopyTap& tap,
+	const CopyProgress& progress, std::string& error);
@@ -0,0 +1,394 @@
+// fileio.cpp : positional file I/O for Windows and POSIX
+//
+
+#include "stdafx.h"
+#include "fileio.h"
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <winioctl.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+namespace fs = std::filesystem;
+using std::string;
+
+#ifdef _WIN32
+
+FileHandle openForRead(const fs::path& path) {
+	HANDLE h = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	return h == INVALID_HANDLE_VALUE ? INVALID_FILE : (FileHandle)h;
+}
+
+FileHandle openForWrite(const fs::path& path, bool truncate) {
+	// Shared write access: --direct opens a second, unbuffered handle on the output while this one stays open
+	HANDLE h = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	return h == INVALID_HANDLE_VALUE ? INVALID_FILE : (FileHandle)h;
+}
+
+void closeFile(FileHandle file) {
+	if (file != INVALID_FILE) {
+		CloseHandle((HANDLE)file);
+	}
+}
+
+int64_t readAt(FileHandle file, void* buffer, size_t length, uint64_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		// Passing an OVERLAPPED to a synchronous handle makes ReadFile positional
+		OVERLAPPED ov = {};
+		ov.Offset = (DWORD)(offset + done);
+		ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+		DWORD chunk = (DWORD)std::min<size_t>(length - done, 0x40000000);
+		DWORD got = 0;
+		if (!ReadFile((HANDLE)file, (char*)buffer + done, chunk, &got, &ov)) {
+			if (GetLastError() == ERROR_HANDLE_EOF) break;
+			return -1;
+		}
+		if (got == 0) break;
+		done += got;
+	}
+	return (int64_t)done;
+}
+
+int64_t writeAt(FileHandle file, const void* buffer, size_t length, uint64_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		OVERLAPPED ov = {};
+		ov.Offset = (DWORD)(offset + done);
+		ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+		DWORD chunk = (DWORD)std::min<size_t>(length - done, 0x40000000);
+		DWORD put = 0;
+		if (!WriteFile((HANDLE)file, (const char*)buffer + done, chunk, &put, &ov) || put == 0) {
+			return -1;
+		}
+		done += put;
+	}
+	return (int64_t)done;
+}
+
+bool preallocateFile(FileHandle file, uint64_t size) {
+	// Reserve clusters first (best effort), then move end of file so every offset is writable
+	FILE_ALLOCATION_INFO allocation = {};
+	allocation.AllocationSize.QuadPart = (LONGLONG)size;
+	SetFileInformationByHandle((HANDLE)file, FileAllocationInfo, &allocation, sizeof(allocation));
+
+	FILE_END_OF_FILE_INFO end_of_file = {};
+	end_of_file.EndOfFile.QuadPart = (LONGLONG)size;
+	return SetFileInformationByHandle((HANDLE)file, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file)) != 0;
+}
+
+bool resizeFile(FileHandle file, uint64_t size) {
+	FILE_END_OF_FILE_INFO end_of_file = {};
+	end_of_file.EndOfFile.QuadPart = (LONGLONG)size;
+	return SetFileInformationByHandle((HANDLE)file, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file)) != 0;
+}
+
+bool markSparse(FileHandle file) {
+	DWORD returned = 0;
+	return DeviceIoControl((HANDLE)file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL) != 0;
+}
+
+bool punchHole(FileHandle file, uint64_t offset, uint64_t length) {
+	FILE_ZERO_DATA_INFORMATION zero = {};
+	zero.FileOffset.QuadPart = (LONGLONG)offset;
+	zero.BeyondFinalZero.QuadPart = (LONGLONG)(offset + length);
+	DWORD returned = 0;
+	return DeviceIoControl((HANDLE)file, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &returned, NULL) != 0;
+}
+
+void nextDataRange(FileHandle file, uint64_t offset, uint64_t end, uint64_t& data_start, uint64_t& data_end) {
+	FILE_ALLOCATED_RANGE_BUFFER query = {};
+	FILE_ALLOCATED_RANGE_BUFFER range = {};
+	query.FileOffset.QuadPart = (LONGLONG)offset;
+	query.Length.QuadPart = (LONGLONG)(end - offset);
+	DWORD returned = 0;
+	// One range is all we need; ERROR_MORE_DATA only says there are more after it
+	if (!DeviceIoControl((HANDLE)file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), &range, sizeof(range), &returned, NULL) &&
+		GetLastError() != ERROR_MORE_DATA) {
+		data_start = offset;
+		data_end = end;
+		return;
+	}
+	if (returned < sizeof(range)) {
+		data_start = data_end = end;
+		return;
+	}
+	data_start = std::max(offset, (uint64_t)range.FileOffset.QuadPart);
+	data_end = std::min(end, (uint64_t)(range.FileOffset.QuadPart + range.Length.QuadPart));
+}
+
+bool syncFile(FileHandle file) {
+	return FlushFileBuffers((HANDLE)file) != 0;
+}
+
+void startWriteback(FileHandle, uint64_t, uint64_t) {
+	// No asynchronous per-range flush on Windows, FlushFileBuffers does it all at the checkpoint
+}
+
+string lastIoError() {
+	return "Windows error " + std::to_string(GetLastError());
+}
+
+bool mapFileView(const fs::path& path, FileView& view) {
+	view = FileView();
+	HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	// The section keeps the file open on its own, so the file handle isn't needed past this point
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) {
+		return false;
+	}
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == NULL) {
+		CloseHandle(mapping);
+		return false;
+	}
+	view.data = (const char*)data;
+	view.size = (uint64_t)size.QuadPart;
+	view.mapping = mapping;
+	return true;
+}
+
+void unmapFileView(FileView& view) {
+	if (view.data != nullptr) {
+		UnmapViewOfFile(view.data);
+		CloseHandle((HANDLE)view.mapping);
+	}
+	view = FileView();
+}
+
+void adviseSequential(const FileView& view) {
+	// Windows has no read-ahead hint for a mapped view; its own detection picks up sequential faults
+}
+
+void setStdoutBinary() {
+	_setmode(_fileno(stdout), _O_BINARY);
+}
+
+int64_t writeStream(FileHandle file, const void* buffer, size_t length) {
+	size_t done = 0;
+	while (done < length) {
+		DWORD chunk = (DWORD)std::min<size_t>(length - done, 0x40000000);
+		DWORD put = 0;
+		if (!WriteFile((HANDLE)file, (const char*)buffer + done, chunk, &put, NULL) || put == 0) {
+			return -1;
+		}
+		done += put;
+	}
+	return (int64_t)done;
+}
+
+FileHandle takeOverStdout() {
+	fflush(stdout);
+	int data = _dup(_fileno(stdout));
+	if (data < 0) {
+		return INVALID_FILE;
+	}
+	_setmode(data, _O_BINARY);
+	_dup2(_fileno(stderr), _fileno(stdout));
+	return (FileHandle)_get_osfhandle(data);
+}
+
+FileHandle handleFromDescriptor(int descriptor) {
+	intptr_t handle = _get_osfhandle(descriptor);
+	return handle == -1 ? INVALID_FILE : (FileHandle)handle;
+}
+
+#else
+
+FileHandle openForRead(const fs::path& path) {
+	return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+FileHandle openForWrite(const fs::path& path, bool truncate) {
+	return open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+}
+
+void closeFile(FileHandle file) {
+	if (file != INVALID_FILE) {
+		close(file);
+	}
+}
+
+int64_t readAt(FileHandle file, void* buffer, size_t length, uint64_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t got = pread(file, (char*)buffer + done, length - done, (off_t)(offset + done));
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (got == 0) break;
+		done += (size_t)got;
+	}
+	return (int64_t)done;
+}
+
+int64_t writeAt(FileHandle file, const void* buffer, size_t length, uint64_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t put = pwrite(file, (const char*)buffer + done, length - done, (off_t)(offset + done));
+		if (put < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += (size_t)put;
+	}
+	return (int64_t)done;
+}
+
+bool preallocateFile(FileHandle file, uint64_t size) {
+#ifdef __linux__
+	if (fallocate(file, 0, 0, (off_t)size) == 0) {
+		return true;
+	}
+	// Filesystems without fallocate (some network mounts) still accept a plain resize
+	if (errno != EOPNOTSUPP && errno != ENOSYS) {
+		return false;
+	}
+#endif
+	return ftruncate(file, (off_t)size) == 0;
+}
+
+bool resizeFile(FileHandle file, uint64_t size) {
+	return ftruncate(file, (off_t)size) == 0;
+}
+
+bool markSparse(FileHandle file) {
+	(void)file;
+	return true;
+}
+
+bool punchHole(FileHandle file, uint64_t offset, uint64_t length) {
+#ifdef __linux__
+	return fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length) == 0;
+#else
+	(void)file; (void)offset; (void)length;
+	errno = EOPNOTSUPP;
+	return false;
+#endif
+}
+
+void nextDataRange(FileHandle file, uint64_t offset, uint64_t end, uint64_t& data_start, uint64_t& data_end) {
+	data_start = offset;
+	data_end = end;
+#ifdef SEEK_DATA
+	off_t start = lseek(file, (off_t)offset, SEEK_DATA);
+	if (start < 0) {
+		// ENXIO: nothing but a hole up to the end of the file. Anything else: no hole support, all data.
+		if (errno == ENXIO) {
+			data_start = end;
+		}
+		return;
+	}
+	off_t hole = lseek(file, start, SEEK_HOLE);
+	data_start = std::min((uint64_t)start, end);
+	if (hole >= 0) {
+		data_end = std::min((uint64_t)hole, end);
+	}
+#endif
+}
+
+bool syncFile(FileHandle file) {
+	return fdatasync(file) == 0;
+}
+
+void startWriteback(FileHandle file, uint64_t offset, uint64_t length) {
+#ifdef __linux__
+	sync_file_range(file, (off_t)offset, (off_t)length, SYNC_FILE_RANGE_WRITE);
+#else
+	(void)file; (void)offset; (void)length;
+#endif
+}
+
+string lastIoError() {
+	return strerror(errno);
+}
+
+bool mapFileView(const fs::path& path, FileView& view) {
+	view = FileView();
+	int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file < 0) {
+		return false;
+	}
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size == 0) {
+		close(file);
+		return false;
+	}
+	void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0);
+	close(file);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	view.data = (const char*)data;
+	view.size = (uint64_t)info.st_size;
+	return true;
+}
+
+void unmapFileView(FileView& view) {
+	if (view.data != nullptr) {
+		munmap((void*)view.data, (size_t)view.size);
+	}
+	view = FileView();
+}
+
+void adviseSequential(const FileView& view) {
+	if (view.data != nullptr) {
+		madvise((void*)view.data, (size_t)view.size, MADV_SEQUENTIAL);
+	}
+}
+
+void setStdoutBinary() {
+}
+
+int64_t writeStream(FileHandle file, const void* buffer, size_t length) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t put = write(file, (const char*)buffer + done, length - done);
+		if (put < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += (size_t)put;
+	}
+	return (int64_t)done;
+}
+
+FileHandle takeOverStdout() {
+	fflush(stdout);
+	int data = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+	if (data < 0) {
+		return INVALID_FILE;
+	}
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+	return data;
+}
+
+FileHandle handleFromDescriptor(int descriptor) {
+	return fcntl(descriptor, F_GETFD) < 0 ? INVALID_FILE : descriptor;
+}
+
+#endif
@@ -0,0 +1,83 @@
+// fileio.h : thin platform layer for positional file I/O used by the merge engines
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <filesystem>
+
+#ifdef _WIN32
+typedef void*	FileHandle;			// HANDLE
+#define INVALID_FILE ((FileHandle)(intptr_t)-1)
+#else
+typedef int		FileHandle;			// POSIX file descriptor
+#define INVALID_FILE (-1)
+#endif
+
+FileHandle openForRead(const std::filesystem::path& path);
+FileHandle openForWrite(const std::filesystem::path& path, bool truncate);
+void closeFile(FileHandle file);
+
+// Positional I/O, never touches a shared file pointer so several threads may use the same handle.
+// Both loop over short transfers and return the number of bytes moved (short only at EOF), or -1 on error.
+int64_t readAt(FileHandle file, void* buffer, size_t length, uint64_t offset);
+int64_t writeAt(FileHandle file, const void* buffer, size_t length, uint64_t offset);
+
+// Sizes the file to exactly `size` bytes, reserving the blocks up front where the filesystem allows it
+// so parallel positional writes don't fragment the output. Returns false if the file can't be sized.
+bool preallocateFile(FileHandle file, uint64_t size);
+
+// Sets the end of file without reserving anything, e.g. to end a sparse output in a hole
+bool resizeFile(FileHandle file, uint64_t size);
+
+// Lets the filesystem store never-written ranges of the file as holes (NTFS needs this per file, POSIX
+// filesystems do it anyway)
+bool markSparse(FileHandle file);
+
+// Deallocates `length` bytes at `offset`, which then read back as zeros. Returns false where the
+// filesystem can't do it.
+bool punchHole(FileHandle file, uint64_t offset, uint64_t length);
+
+// Finds the first range in [offset, end) that holds data: SEEK_DATA/SEEK_HOLE on POSIX, the allocated
+// ranges on Windows. Everything before `data_start` is a hole; data_start == end means no data at all.
+// Filesystems that can't tell report the whole range as data.
+void nextDataRange(FileHandle file, uint64_t offset, uint64_t end, uint64_t& data_start, uint64_t& data_end);
+
+// Waits until everything written to the file so far is on stable storage
+bool syncFile(FileHandle file);
+
+// Starts writing `length` bytes at `offset` back to disk without waiting for them, so a later syncFile()
+// has less to do. Only a hint: does nothing where the platform can't do it.
+void startWriteback(FileHandle file, uint64_t offset, uint64_t length);
+
+// Human readable description of the last failed I/O call on this thread
+std::string lastIoError();
+
+// Read-only mapping of a whole file
+struct FileView {
+	const char*	data;
+	uint64_t	size;
+	void*		mapping;		// Section handle on Windows, unused on POSIX
+	FileView() : data(nullptr), size(0), mapping(nullptr) {}
+};
+
+// Maps `path` read-only. Returns false (view left empty) if the file can't be opened or mapped.
+bool mapFileView(const std::filesystem::path& path, FileView& view);
+void unmapFileView(FileView& view);
+// Tells the kernel the view will be read front to back, so it reads ahead further and drops pages behind
+void adviseSequential(const FileView& view);
+
+// Appends to a stream (pipe, terminal, or a file at its current position). Returns the bytes written or -1.
+int64_t writeStream(FileHandle file, const void* buffer, size_t length);
+
+// Takes over the process's stdout for data: returns a handle to it and points stdout at stderr, so nothing
+// printed afterwards can end up in the data
+FileHandle takeOverStdout();
+
+// Handle of an inherited file descriptor, e.g. "fd:3" on the command line. Not owned by the caller.
+FileHandle handleFromDescriptor(int descriptor);
+
+// Stops the C runtime from translating line endings on stdout, so binary data can be written to it
+void setStdoutBinary();
@@ -0,0 +1,213 @@
+// inplace.cpp : crash-safe record and recovery for --in-place merges
+//
+
+#include "stdafx.h"
+#include "inplace.h"
+#include <fstream>
+#include <sstream>
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+
+InPlaceMerge::InPlaceMerge(const fs::path& merged_file, const vector<MergeSegment>& segments)
+	: merged_file(merged_file), pieces(segments), consumed_pieces(0) {
+	record_file = merged_file;
+	record_file += ".inplace";
+}
+
+bool InPlaceMerge::save() const {
+	std::ostringstream text;
+	text << "# pkg-merge in-place v1\n";
+	text << "output\t" << fs::absolute(merged_file).string() << "\n";
+	for (auto & piece : pieces) {
+		text << "piece\t" << piece.offset << "\t" << piece.size << "\t" << piece.label << "\t" << fs::absolute(piece.file).string() << "\n";
+	}
+	text << "consumed\t" << consumed_pieces << "\n";
+	string contents = text.str();
+
+	// Write aside and rename over the old record so a crash leaves either the old or the new one
+	fs::path temp_file = record_file;
+	temp_file += ".tmp";
+	FileHandle temp = openForWrite(temp_file, true);
+	if (temp == INVALID_FILE) {
+		return false;
+	}
+	bool ok = writeAt(temp, contents.data(), contents.size(), 0) == (int64_t)contents.size() && syncFile(temp);
+	closeFile(temp);
+
+	std::error_code error;
+	if (ok) {
+		fs::rename(temp_file, record_file, error);
+	}
+	return ok && !error;
+}
+
+bool InPlaceMerge::load(const fs::path& record_file, InPlaceMerge& merge) {
+	std::ifstream record(record_file, std::ios::binary);
+	if (!record) {
+		return false;
+	}
+	merge = InPlaceMerge();
+	merge.record_file = record_file;
+
+	string line;
+	bool finished = false;
+	while (std::getline(record, line)) {
+		if (line.empty() || line[0] == '#') continue;
+		vector<string> fields;
+		std::istringstream columns(line);
+		string field;
+		while (std::getline(columns, field, '\t')) {
+			fields.push_back(field);
+		}
+		if (fields[0] == "output" && fields.size() == 2) {
+			merge.merged_file = fields[1];
+		} else if (fields[0] == "piece" && fields.size() == 5) {
+			merge.pieces.push_back({ fs::path(fields[4]), fields[3], strtoull(fields[2].c_str(), NULL, 10),
+				strtoull(fields[1].c_str(), NULL, 10) });
+		} else if (fields[0] == "consumed" && fields.size() == 2) {
+			merge.consumed_pieces = (size_t)strtoull(fields[1].c_str(), NULL, 10);
+			finished = true;
+		}
+	}
+	// The consumed line comes last, so a record without it was never completely written
+	return finished && !merge.merged_file.empty() && !merge.pieces.empty() && merge.consumed_pieces < merge.pieces.size();
+}
+
+InPlaceStart InPlaceMerge::start() {
+	std::error_code error;
+	fs::remove(merged_file, error);
+	if (!save()) {
+		return InPlaceStart::Failed;
+	}
+	fs::rename(pieces.front().file, merged_file, error);
+	if (error) {
+		std::error_code ignored;
+		fs::remove(record_file, ignored);
+		return error == std::errc::cross_device_link ? InPlaceStart::CrossDevice : InPlaceStart::Failed;
+	}
+	return InPlaceStart::Started;
+}
+
+bool InPlaceMerge::consume(FileHandle merged, size_t index) {
+	// The piece may only go once its bytes are durable in the output and the record says so
+	if (!syncFile(merged)) {
+		return false;
+	}
+	consumed_pieces = index;
+	if (!save()) {
+		return false;
+	}
+	std::error_code error;
+	fs::remove(pieces[index].file, error);
+	return !error;
+}
+
+bool InPlaceMerge::commit(FileHandle merged) {
+	if (!syncFile(merged)) {
+		return false;
+	}
+	std::error_code error;
+	fs::remove(record_file, error);
+	return !error;
+}
+
+bool InPlaceMerge::rollback() {
+	if (consumed_pieces > 0) {
+		return false;
+	}
+	const MergeSegment& root = pieces.front();
+	std::error_code error;
+	// A record without the rename behind it (crash in between) only has to go away
+	if (!fs::exists(root.file) && fs::exists(merged_file)) {
+		fs::resize_file(merged_file, root.size, error);
+		if (!error) {
+			fs::rename(merged_file, root.file, error);
+		}
+		if (error) {
+			return false;
+		}
+	}
+	fs::remove(record_file, error);
+	return !error;
+}
+
+// Helper function to append the pieces an interrupted merge didn't consume yet
+static bool finishInPlace(InPlaceMerge& merge, const fs::path& merged_file, CopyEngine engine, char* buffer, size_t buffer_size,
+	const OutputSink& output) {
+	auto & pieces = merge.segments();
+	std::error_code error;
+
+	// Pieces recorded as consumed whose removal didn't happen anymore
+	for (size_t i = 1; i <= merge.consumed(); i++) {
+		fs::remove(pieces[i].file, error);
+	}
+
+	FileHandle merged = openForWrite(merged_file, false);
+	if (merged == INVALID_FILE) {
+		printTo(output, "[error] could not open '%s': %s\n", merged_file.string().c_str(), lastIoError().c_str());
+		return false;
+	}
+	bool ok = true;
+	for (size_t i = merge.consumed() + 1; ok && i < pieces.size(); i++) {
+		auto & piece = pieces[i];
+		FileHandle source = openForRead(piece.file);
+		if (source == INVALID_FILE) {
+			printTo(output, "[error] %s of '%s' is gone (%s), the merge can't be finished\n", piece.label.c_str(),
+				merged_file.filename().string().c_str(), piece.file.string().c_str());
+			ok = false;
+			break;
+		}
+		printTo(output, "\t[work] appending %s...", piece.label.c_str());
+		CopyEngine used = engine;
+		ok = copyRange(engine, source, 0, merged, piece.offset, piece.size, buffer, buffer_size, [](uint64_t) {}, &used);
+		closeFile(source);
+		ok = ok && merge.consume(merged, i);
+		printTo(output, ok ? "done (%s)\n" : "failed (%s)\n", engineName(used));
+	}
+	ok = ok && merge.commit(merged);
+	closeFile(merged);
+	return ok;
+}
+
+bool recoverInPlaceMerges(const fs::path& target_dir, CopyEngine engine, char* buffer, size_t buffer_size, const OutputSink& output) {
+	vector<fs::path> records;
+	std::error_code error;
+	for (auto & entry : fs::directory_iterator(target_dir, error)) {
+		if (entry.path().extension() == ".inplace") {
+			records.push_back(entry.path());
+		}
+	}
+
+	bool ok = true;
+	for (auto & record_file : records) {
+		fs::path merged_file = record_file;
+		merged_file.replace_extension();
+		InPlaceMerge merge(merged_file, {});
+		if (!InPlaceMerge::load(record_file, merge)) {
+			printTo(output, "[error] in-place record %s is damaged, resolve it by hand\n", record_file.string().c_str());
+			ok = false;
+			continue;
+		}
+		if (merge.consumed() == 0) {
+			if (merge.rollback()) {
+				printTo(output, "[info] rolled back the interrupted in-place merge of %s, its root part is back in place\n",
+					merged_file.filename().string().c_str());
+			} else {
+				printTo(output, "[error] could not roll back %s: %s\n", merged_file.string().c_str(), lastIoError().c_str());
+				ok = false;
+			}
+			continue;
+		}
+		// Consumed pieces are gone from the source folder, so the only way is forward
+		printTo(output, "[info] finishing the interrupted in-place merge of %s (%zu of %zu pieces already consumed)\n",
+			merged_file.filename().string().c_str(), merge.consumed(), merge.segments().size() - 1);
+		if (finishInPlace(merge, merged_file, engine, buffer, buffer_size, output)) {
+			printTo(output, "[success] %s completed\n", merged_file.filename().string().c_str());
+		} else {
+			ok = false;
+		}
+	}
+	return ok;
+}
@@ -0,0 +1,60 @@
+// inplace.h : --in-place merges that turn the root part into the output and append the other pieces to it
+//
+
+#pragma once
+
+#include "copyengine.h"
+#include "console.h"
+#include <vector>
+
+enum class InPlaceStart {
+	Started,		// The root part is now the output
+	CrossDevice,	// Source and target are on different filesystems, nothing was touched
+	Failed
+};
+
+// "<merged file>.inplace" is written before the root part is moved and records how to undo or finish
+// the merge after a crash: the root's original path and size, every other piece with its offset and
+// size, and how many of them were consumed (deleted after the output was flushed past them). Until a
+// piece is consumed the merge can be rolled back exactly, since the root's own bytes are never written.
+class InPlaceMerge {
+public:
+	InPlaceMerge(const std::filesystem::path& merged_file, const std::vector<MergeSegment>& segments);
+
+	// Writes the record and renames the root part to the output
+	InPlaceStart start();
+
+	// Flushes the output, records piece `index` (into segments) as consumed and deletes its source
+	bool consume(FileHandle merged, size_t index);
+
+	// The output is complete: flush it and drop the record
+	bool commit(FileHandle merged);
+
+	// Cuts the output back to the root's size and moves it back where it came from. Only possible
+	// while nothing was consumed.
+	bool rollback();
+
+	size_t consumed() const { return consumed_pieces; }
+	const std::filesystem::path& path() const { return record_file; }
+
+	// Reads a record left behind by an interrupted run
+	static bool load(const std::filesystem::path& record_file, InPlaceMerge& merge);
+
+	// Segments still to append after a crash, for finishing a merge that consumed pieces
+	const std::vector<MergeSegment>& segments() const { return pieces; }
+
+private:
+	InPlaceMerge() : consumed_pieces(0) {}
+	bool save() const;
+
+	std::filesystem::path		record_file;
+	std::filesystem::path		merged_file;
+	std::vector<MergeSegment>	pieces;			// Root first, as in PkgPartSet::segments()
+	size_t						consumed_pieces;	// Pieces after the root that are deleted
+};
+
+// Deals with the .inplace records an interrupted --in-place run left in `target_dir`: merges that
+// consumed nothing are rolled back so the next scan finds the root part again, the others are finished
+// from their record. Messages go to `output`. Returns false if a record couldn't be resolved.
+bool recoverInPlaceMerges(const std::filesystem::path& target_dir, CopyEngine engine, char* buffer, size_t buffer_size,
+	const OutputSink& output);
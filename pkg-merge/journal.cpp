@@ -0,0 +1,116 @@
+// journal.cpp : on-disk progress journal for resumable merges
+//
+
+#include "stdafx.h"
+#include "journal.h"
+#include "checksum.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+
+// Bytes just below the committed offset that are hashed to catch an output that was changed behind our back
+const uint64_t JOURNAL_TAIL_SIZE = 1024 * 1024;
+
+// Helper function to hash the last JOURNAL_TAIL_SIZE bytes below `offset`
+static string tailHash(FileHandle merged, uint64_t offset) {
+	uint64_t start = offset > JOURNAL_TAIL_SIZE ? offset - JOURNAL_TAIL_SIZE : 0;
+	vector<char> tail((size_t)(offset - start));
+	if (readAt(merged, tail.data(), tail.size(), start) != (int64_t)tail.size()) {
+		return "";
+	}
+	Xxh64 xxh;
+	xxh.update(tail.data(), tail.size());
+	return xxh.hex();
+}
+
+MergeJournal::MergeJournal(const fs::path& merged_file, const vector<MergeSegment>& segments) : segments(segments) {
+	journal_file = merged_file;
+	journal_file += ".journal";
+	for (auto & segment : segments) {
+		std::error_code error;
+		auto mtime = fs::last_write_time(segment.file, error);
+		mtimes.push_back(error ? 0 : (long long)mtime.time_since_epoch().count());
+	}
+}
+
+string MergeJournal::describe() const {
+	std::ostringstream text;
+	text << "# pkg-merge journal v1\n";
+	for (size_t i = 0; i < segments.size(); i++) {
+		text << "segment\t" << segments[i].offset << "\t" << segments[i].size << "\t" << mtimes[i] << "\t"
+			<< fs::absolute(segments[i].file).string() << "\n";
+	}
+	return text.str();
+}
+
+uint64_t MergeJournal::resumeOffset(FileHandle merged, string& reason) const {
+	std::ifstream journal(journal_file, std::ios::binary);
+	if (!journal) {
+		reason = "no journal found";
+		return 0;
+	}
+	std::stringstream contents;
+	contents << journal.rdbuf();
+	string text = contents.str();
+
+	// Everything above the "committed" line has to describe exactly the sources we see now
+	string layout = describe();
+	if (text.compare(0, layout.size(), layout) != 0) {
+		reason = "source pieces changed since the journal was written";
+		return 0;
+	}
+
+	std::istringstream committed(text.substr(layout.size()));
+	string key, hash;
+	unsigned long long offset = 0;
+	if (!(committed >> key >> offset >> hash) || key != "committed" || offset == 0) {
+		reason = "journal has no completed data";
+		return 0;
+	}
+
+	char byte;
+	if (readAt(merged, &byte, 1, offset - 1) != 1) {
+		reason = "existing output is shorter than the journal says";
+		return 0;
+	}
+	if (tailHash(merged, offset) != hash) {
+		reason = "existing output doesn't match the journal";
+		return 0;
+	}
+	return offset;
+}
+
+bool MergeJournal::checkpoint(FileHandle merged, uint64_t offset) {
+	// Data first: the journal must never claim bytes that could still be lost
+	if (!syncFile(merged)) {
+		return false;
+	}
+
+	string text = describe();
+	text += "committed\t" + std::to_string(offset) + "\t" + tailHash(merged, offset) + "\n";
+
+	// Write aside and rename over the old journal so a crash leaves either the old or the new one
+	fs::path temp_file = journal_file;
+	temp_file += ".tmp";
+	FileHandle temp = openForWrite(temp_file, true);
+	if (temp == INVALID_FILE) {
+		return false;
+	}
+	bool ok = writeAt(temp, text.data(), text.size(), 0) == (int64_t)text.size() && syncFile(temp);
+	closeFile(temp);
+
+	std::error_code error;
+	if (ok) {
+		fs::rename(temp_file, journal_file, error);
+	}
+	return ok && !error;
+}
+
+void MergeJournal::remove() {
+	std::error_code error;
+	fs::remove(journal_file, error);
+}
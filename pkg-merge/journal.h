@@ -0,0 +1,37 @@
+// journal.h : on-disk progress journal that lets an interrupted merge continue where it stopped
+//
+
+#pragma once
+
+#include "copyengine.h"
+#include <vector>
+
+// How much of the output is made durable between two journal updates
+const uint64_t JOURNAL_CHECKPOINT_INTERVAL = 256ULL * 1024 * 1024;
+// Writeback of the output is started this often in between, so a checkpoint doesn't flush it all at once
+const uint64_t JOURNAL_WRITEBACK_INTERVAL = 32ULL * 1024 * 1024;
+
+// "<merged file>.journal" records the layout of the merge (every source with its offset, size and mtime)
+// and the offset up to which the output is known to be on disk, plus a hash of the bytes just below it.
+class MergeJournal {
+public:
+	MergeJournal(const std::filesystem::path& merged_file, const std::vector<MergeSegment>& segments);
+
+	// Offset a --resume run can continue from. Returns 0 (start over) with the reason filled in when
+	// there's no journal, the sources changed since it was written, or the existing output doesn't match it.
+	uint64_t resumeOffset(FileHandle merged, std::string& reason) const;
+
+	// Flushes the output to disk and then records everything below `offset` as done
+	bool checkpoint(FileHandle merged, uint64_t offset);
+
+	void remove();
+
+	const std::filesystem::path& path() const { return journal_file; }
+
+private:
+	std::string describe() const;	// Journal lines describing the layout, without the committed offset
+
+	std::filesystem::path		journal_file;
+	std::vector<MergeSegment>	segments;
+	std::vector<long long>		mtimes;
+};
@@ -0,0 +1,1440 @@
+// merger.cpp : scan, group and merge logic shared by the command line and the merge service
+//
+
+#include "stdafx.h"
+#include "merger.h"
+#include "concatreader.h"
+#include "directio.h"
+#include "pkgheader.h"
+#include "parallelcopy.h"
+#include "uringengine.h"
+#include "checksum.h"
+#include "journal.h"
+#include "progress.h"
+#include "inplace.h"
+#include "sparse.h"
+#include "delta.h"
+#include "split.h"
+#include "verify.h"
+#include "devices.h"
+#include "fanout.h"
+#include "console.h"
+#include <stdio.h>
+#include <string>
+#include <filesystem>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <string.h>
+#include <stdarg.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+
+namespace fs = std::filesystem;
+using std::string;
+using std::map;
+using std::vector;
+
+
+// Helper function to convert string to lowercase for case-insensitive comparison
+string toLower(const string& str) {
+	string result = str;
+	std::transform(result.begin(), result.end(), result.begin(),
+		[](unsigned char c) { return std::tolower(c); });
+	return result;
+}
+
+// Helper function to remove leading and trailing quotes from path strings
+string cleanPathString(const string& path) {
+	string result = path;
+	
+	// Remove leading quote
+	if (!result.empty() && result.front() == '\"') {
+		result.erase(0, 1);
+	}
+	
+	// Remove trailing quote
+	if (!result.empty() && result.back() == '\"') {
+		result.erase(result.length() - 1, 1);
+	}
+	
+	return result;
+}
+
+BufferPool::~BufferPool() {
+	for (auto & entry : free_buffers) {
+		freeAligned(entry.second);
+	}
+}
+
+char* BufferPool::take(size_t size) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = free_buffers.find(size);
+		if (it != free_buffers.end()) {
+			char* buffer = it->second;
+			free_buffers.erase(it);
+			return buffer;
+		}
+	}
+	return allocateAligned(size);
+}
+
+void BufferPool::give(char* buffer, size_t size) {
+	std::lock_guard<std::mutex> guard(lock);
+	free_buffers.emplace(size, buffer);
+}
+
+// Helper function to get a copy buffer, from the service's pool when there is one. Aligned so --direct can read into it.
+static char* takeBuffer(const MergeOptions& options, size_t size) {
+	return options.buffers != nullptr ? options.buffers->take(size) : allocateAligned(size);
+}
+
+static void giveBuffer(const MergeOptions& options, char* buffer, size_t size) {
+	if (options.buffers != nullptr) {
+		options.buffers->give(buffer, size);
+	} else {
+		freeAligned(buffer);
+	}
+}
+
+vector<fs::path> splitTargetList(const string& targets) {
+	vector<fs::path> dirs;
+	for (size_t start = 0; start <= targets.length();) {
+		size_t end = targets.find(';', start);
+		if (end == string::npos) end = targets.length();
+		string dir = cleanPathString(targets.substr(start, end - start));
+		if (!dir.empty()) {
+			dirs.push_back(fs::path(dir));
+		}
+		start = end + 1;
+	}
+	return dirs;
+}
+
+// Helper function to print a message to the merge's output
+static void say(const MergeOptions& options, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	string text = formatText(format, args);
+	va_end(args);
+	emit(options.output, text);
+}
+
+// Console output of one package. Sequential merges print straight through; concurrent jobs hold their
+// lines and print them as one block once the package is done, so groups never interleave.
+struct GroupLog {
+	bool				deferred;
+	OutputSink			output;
+	string				text;
+	string				pending;		// Latest progress line, committed by the next print()
+	GroupLog(bool deferred, const OutputSink& output) : deferred(deferred), output(output) {}
+	void print(const char* format, ...);
+	void progress(const char* format, ...);
+	void flush();
+};
+
+void GroupLog::print(const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	string line = formatText(format, args);
+	va_end(args);
+	if (!deferred) {
+		emit(output, line);
+	} else {
+		text += pending + line;
+		pending.clear();
+	}
+}
+
+void GroupLog::progress(const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	string line = formatText(format, args);
+	va_end(args);
+	if (!deferred) {
+		emit(output, "\r" + line);
+	} else {
+		// Only the last progress state of a step is worth keeping
+		pending = line;
+	}
+}
+
+void GroupLog::flush() {
+	if (!deferred) return;
+	emit(output, text + pending);
+	text.clear();
+	pending.clear();
+}
+
+// Helper function to print how long a part took
+static void printPartDone(GroupLog& log, const PartTiming& timing) {
+	log.print("done (%s, %.2f s, %.1f MB/s)\n", timing.method.c_str(), timing.seconds, timing.megabytesPerSecond());
+}
+
+// Helper function to copy one segment into the merged output through the copy engine, starting `skip`
+// bytes into it when a resumed merge already has the front. The copy loop only moves the meter's counter;
+// the root segment is counted quietly, the others are drawn by its reporter. With a journal, the output is
+// checkpointed every JOURNAL_CHECKPOINT_INTERVAL, and writeback of what was copied is started every
+// JOURNAL_WRITEBACK_INTERVAL so the checkpoint's flush finds little left to write. With `direct_out` the bytes are appended through it
+// instead and the engine isn't used; with `sparse` they go through the hole-preserving copy instead.
+static bool copySegment(const MergeSegment& segment, uint64_t skip, FileHandle merged, CopyEngine engine, char* buffer, size_t buffer_size,
+	GroupLog& log, ProgressMeter& meter, const CopyTap& tap, MergeJournal* journal, DirectOutput* direct_out, SparseCopy* sparse) {
+	uint64_t next_checkpoint = segment.offset + skip + JOURNAL_CHECKPOINT_INTERVAL;
+	uint64_t written_back = segment.offset + skip;
+	auto progress = [&](uint64_t copied) {
+		meter.update(segment.offset + skip + copied);
+		// Direct output holds back the unaligned tail, so only what it flushed can be committed
+		uint64_t position = direct_out != nullptr ? direct_out->flushed() : segment.offset + skip + copied;
+		if (journal != nullptr && direct_out == nullptr && position >= written_back + JOURNAL_WRITEBACK_INTERVAL) {
+			startWriteback(merged, written_back, position - written_back);
+			written_back = position;
+		}
+		if (journal != nullptr && position >= next_checkpoint) {
+			journal->checkpoint(merged, position);
+			next_checkpoint = position + JOURNAL_CHECKPOINT_INTERVAL;
+		}
+	};
+	meter.beginPart(segment.label, segment.offset == 0);
+
+	if (direct_out != nullptr) {
+		bool direct_source = false;
+		if (!copyToDirectOutput(segment.file, skip, segment.size - skip, *direct_out, buffer, buffer_size, progress, tap, &direct_source)) {
+			meter.endPart("direct");
+			log.print("\n[error] direct copy failed on '%s': %s\n", segment.file.string().c_str(), lastIoError().c_str());
+			return false;
+		}
+		printPartDone(log, meter.endPart(direct_source ? "direct" : "cache hints"));
+		return true;
+	}
+
+	FileHandle to_merge = openForRead(segment.file);
+	if (to_merge == INVALID_FILE) {
+		meter.endPart(engineName(engine));
+		log.print("\n[error] could not open '%s': %s\n", segment.file.string().c_str(), lastIoError().c_str());
+		return false;
+	}
+
+	CopyEngine used = engine;
+	bool ok;
+	string method;
+	if (sparse != nullptr) {
+		uint64_t skipped = sparse->skipped();
+		ok = copySparse(to_merge, skip, merged, segment.offset + skip, segment.size - skip, buffer, buffer_size, *sparse, progress, tap);
+		method = "sparse, " + std::to_string((sparse->skipped() - skipped) / 1024) + " KB skipped";
+	} else {
+		ok = copyRange(engine, to_merge, skip, merged, segment.offset + skip, segment.size - skip, buffer, buffer_size,
+			progress, &used, tap);
+		method = engineName(used);
+	}
+	closeFile(to_merge);
+	const PartTiming& timing = meter.endPart(method);
+
+	if (!ok) {
+		log.print("\n[error] %s copy failed on '%s': %s\n", sparse != nullptr ? "sparse" : engineName(used), segment.file.string().c_str(),
+			lastIoError().c_str());
+		return false;
+	}
+
+	printPartDone(log, timing);
+	return true;
+}
+
+// Helper function to feed bytes a resumed merge already has on disk to the hasher, reading them back
+// from the output (reads only, nothing is written again)
+static bool hashExisting(InlineHasher& hasher, FileHandle merged, uint64_t offset, uint64_t length, char* buffer, size_t buffer_size) {
+	for (uint64_t done = 0; done < length;) {
+		size_t chunk = (size_t)std::min<uint64_t>(length - done, buffer_size);
+		if (readAt(merged, buffer, chunk, offset + done) != (int64_t)chunk) {
+			return false;
+		}
+		hasher.feed(buffer, chunk);
+		done += chunk;
+	}
+	return true;
+}
+
+// Helper function to record the timing of every piece and of the whole package for --metrics-json
+static void recordMetrics(const MergeOptions& options, const string& phase, const string& title, const ProgressMeter& meter,
+	bool ok, uint64_t bytes, double seconds) {
+	if (options.metrics == nullptr) return;
+	for (auto & part : meter.parts()) {
+		options.metrics->record("part", title, part.label, part.method, part.bytes, part.seconds);
+	}
+	options.metrics->record(phase, title, "", ok ? "ok" : "failed", bytes, seconds);
+}
+
+// Helper function to end a --sparse output at its full size (it may end in a hole) and report what was skipped
+static bool finishSparse(FileHandle merged, uint64_t merged_size, const SparseCopy& sparse, GroupLog& log) {
+	if (!resizeFile(merged, merged_size)) {
+		log.print("[error] could not set the size of the sparse output: %s\n", lastIoError().c_str());
+		return false;
+	}
+	log.print("\t[info] sparse: %.1f MB not written (%.1f MB of holes in the pieces, %.1f MB of zero blocks)\n",
+		sparse.skipped() / (1024.0 * 1024.0), sparse.hole_bytes / (1024.0 * 1024.0), sparse.zero_bytes / (1024.0 * 1024.0));
+	return true;
+}
+
+// Helper function for --delta: updates an existing output block by block instead of writing it again
+static string mergeDelta(const string& title, const PkgPartSet& part_set, const fs::path& merged_file, const MergeOptions& options,
+	GroupLog& log) {
+	bool existed = fs::exists(merged_file);
+	log.print("\t[work] %s %s block by block...\n", existed ? "comparing" : "writing", merged_file.filename().string().c_str());
+
+	auto merge_started = std::chrono::steady_clock::now();
+	ProgressMeter meter(part_set.size(), 0, [&log](const string& line) { log.progress("%s", line.c_str()); }, !log.deferred);
+	meter.beginPart("all pieces", false);
+	DeltaStats stats;
+	bool ok = deltaMerge(part_set, merged_file, [&](uint64_t position) { meter.update(position); }, stats);
+	const PartTiming& timing = meter.endPart("delta");
+	recordMetrics(options, "merge", title, meter, ok, stats.bytes_written, secondsSince(merge_started));
+
+	if (!ok) {
+		log.print("\n[error] delta merge of package %s failed: %s\n", title.c_str(), lastIoError().c_str());
+		return "";
+	}
+	printPartDone(log, timing);
+	log.print("\t[info] %llu of %llu blocks rewritten (%.1f MB), %llu verified, %llu skipped as unchanged\n",
+		(unsigned long long)stats.rewritten, (unsigned long long)stats.blocks, stats.bytes_written / (1024.0 * 1024.0),
+		(unsigned long long)stats.verified, (unsigned long long)stats.unchanged);
+	return merged_file.string();
+}
+
+// Helper function to finish an --in-place merge once the root part has become the output: appends the
+// other pieces and, with --in-place=delete, removes each one as soon as it's durable in the output. A
+// failure rolls back while nothing was removed; after that the record stays for the next run to finish.
+static string appendInPlace(const string& title, InPlaceMerge& in_place, const vector<MergeSegment>& segments, uint64_t merged_size,
+	const fs::path& merged_file, const MergeOptions& options, char* buffer, size_t BUFFER_SIZE, GroupLog& log) {
+	log.print("\t[work] moved root package file to %s, nothing to copy\n", merged_file.filename().string().c_str());
+
+	auto merge_started = std::chrono::steady_clock::now();
+	ProgressMeter meter(merged_size, segments.front().size, [&log](const string& line) { log.progress("%s", line.c_str()); }, !log.deferred);
+	FileHandle merged = openForWrite(merged_file, false);
+	bool ok = merged != INVALID_FILE;
+	if (!ok) {
+		log.print("[error] could not open '%s': %s\n", merged_file.string().c_str(), lastIoError().c_str());
+	}
+	std::unique_ptr<SparseCopy> sparse;
+	if (ok && options.sparse) {
+		markSparse(merged);
+		sparse.reset(new SparseCopy(segments.front().size));
+	}
+	for (size_t i = 1; ok && i < segments.size(); i++) {
+		ok = copySegment(segments[i], 0, merged, options.engine, buffer, BUFFER_SIZE, log, meter, nullptr, nullptr, nullptr, sparse.get());
+		if (ok && options.consume) {
+			ok = in_place.consume(merged, i);
+			if (!ok) {
+				log.print("[error] could not remove '%s' after merging it: %s\n", segments[i].file.string().c_str(), lastIoError().c_str());
+			}
+		}
+	}
+	if (ok && sparse) {
+		ok = finishSparse(merged, merged_size, *sparse, log);
+	}
+	if (ok && !in_place.commit(merged)) {
+		log.print("[error] could not flush '%s': %s\n", merged_file.string().c_str(), lastIoError().c_str());
+		ok = false;
+	}
+	closeFile(merged);
+	recordMetrics(options, "merge", title, meter, ok, merged_size - segments.front().size, secondsSince(merge_started));
+
+	if (!ok) {
+		if (in_place.consumed() == 0 && in_place.rollback()) {
+			log.print("[error] in-place merge of package %s failed, rolled back: the root package file is where it was\n", title.c_str());
+		} else {
+			log.print("[error] in-place merge of package %s failed after removing %zu pieces; run again with --in-place to finish it from %s\n",
+				title.c_str(), in_place.consumed(), in_place.path().string().c_str());
+		}
+		return "";
+	}
+	if (options.consume) {
+		log.print("\t[info] removed %zu merged pieces\n", in_place.consumed());
+	}
+	return merged_file.string();
+}
+
+// Helper function for a list of target folders: reads every piece once and writes the output into all
+// of them at the same time. Returns the output in the first folder, or an empty string if any copy failed.
+static string mergeFanOut(const string& title, const PkgPartSet& part_set, const string& merged_file_name, const fs::path& target_dir,
+	const MergeOptions& options, size_t buffer_size, GroupLog& log) {
+	vector<fs::path> files;
+	vector<FileHandle> outputs;
+	files.push_back(target_dir / merged_file_name);
+	for (auto & more_target : options.more_targets) {
+		files.push_back(more_target / merged_file_name);
+	}
+	bool ok = true;
+	for (auto & file : files) {
+		std::error_code error;
+		fs::remove(file, error);
+		FileHandle output = openForWrite(file, true);
+		if (output == INVALID_FILE) {
+			log.print("[error] could not create '%s': %s\n", file.string().c_str(), lastIoError().c_str());
+			ok = false;
+			break;
+		}
+		outputs.push_back(output);
+	}
+
+	uint64_t merged_size = part_set.size();
+	auto merge_started = std::chrono::steady_clock::now();
+	ProgressMeter meter(merged_size, 0, [&log](const string& line) { log.progress("%s", line.c_str()); }, !log.deferred);
+
+	const vector<MergeSegment>& segments = part_set.segments();
+	std::unique_ptr<InlineHasher> hasher;
+	CopyTap tap;
+	size_t next_part = 0;
+	uint64_t hashed = 0;
+	if (options.hash) {
+		hasher.reset(new InlineHasher(buffer_size));
+		tap = [&](const char* data, size_t length) {
+			// Chunks never span two pieces, so a chunk at a piece's offset starts that piece's digests
+			while (next_part < segments.size() && segments[next_part].offset == hashed) {
+				hasher->beginPart(segments[next_part++].file.filename().string());
+			}
+			hasher->feed(data, length);
+			hashed += length;
+		};
+	}
+
+	if (ok) {
+		log.print("\t[work] reading %zu pieces once and writing them to %zu folders...\n", segments.size(), files.size());
+		string error;
+		meter.beginPart("all pieces", false);
+		ok = fanOutSegments(segments, outputs, files, buffer_size, tap, [&](uint64_t written) { meter.update(written); }, error);
+		const PartTiming& timing = meter.endPart(std::to_string(files.size()) + " targets");
+		if (ok) {
+			printPartDone(log, timing);
+		} else {
+			log.print("\n[error] %s\n", error.c_str());
+		}
+	}
+
+	if (hasher) {
+		hasher->finish();
+		for (size_t i = 0; ok && i < files.size(); i++) {
+			hasher->whole.name = merged_file_name;
+			if (!writeManifest(files[i], hasher->whole, hasher->parts)) {
+				log.print("[warn] could not write checksum manifest for %s\n", files[i].string().c_str());
+			}
+		}
+		if (ok) {
+			log.print("\t[info] sha256 %s, xxh64 %s written to %s.manifest in every folder\n", hasher->whole.sha256.c_str(),
+				hasher->whole.xxh64.c_str(), merged_file_name.c_str());
+		}
+	}
+
+	for (auto & output : outputs) {
+		closeFile(output);
+	}
+	recordMetrics(options, "merge", title, meter, ok, merged_size, secondsSince(merge_started));
+
+	if (!ok) {
+		log.print("[error] merge of package %s failed, removing incomplete outputs\n", title.c_str());
+		for (size_t i = 0; i < outputs.size(); i++) {
+			std::error_code error;
+			fs::remove(files[i], error);
+		}
+		return "";
+	}
+	return files.front().string();
+}
+
+// Helper function to list a created output, and its copies in the other target folders
+static void addCreated(vector<string>& created_files, const string& created, const MergeOptions& options) {
+	created_files.push_back(created);
+	for (auto & more_target : options.more_targets) {
+		created_files.push_back((more_target / fs::path(created).filename()).string());
+	}
+}
+
+// Merges one package into target_dir. Returns the created file, or an empty string if the merge failed.
+static string mergePackage(const string& title, Package pkg, const fs::path& target_dir, const MergeOptions& options,
+	char* buffer, size_t BUFFER_SIZE, GroupLog& log) {
+	size_t pieces = pkg.parts.size();
+	
+	// Add _sc file to the count if it exists
+	if (pkg.sc_part != nullptr) {
+		pieces++;
+	}
+	
+	auto title_id = title.c_str();
+
+	log.print("[work] beginning to merge %d %s for package %s...\n", (int)pieces, pieces == 1 ? "piece" : "pieces", title_id);
+
+	// Use custom output name if _sc file exists, otherwise use title_id
+	string merged_file_name;
+	if (!pkg.output_name.empty()) {
+		merged_file_name = pkg.output_name + "-merged.pkg";
+		log.print("[info] using custom output name from _sc file: %s\n", merged_file_name.c_str());
+	} else {
+		merged_file_name = title + "-merged.pkg";
+	}
+	
+	string full_merged_file = (target_dir / merged_file_name).string();
+	auto merged_file = fs::path(full_merged_file);
+	PkgPartSet part_set(pkg);
+	const vector<MergeSegment>& segments = part_set.segments();
+	uint64_t merged_size = part_set.size();
+	MergeJournal journal(merged_file, segments);
+
+	if (options.delta) {
+		return mergeDelta(title, part_set, merged_file, options, log);
+	}
+
+	if (!options.more_targets.empty()) {
+		return mergeFanOut(title, part_set, merged_file_name, target_dir, options, BUFFER_SIZE, log);
+	}
+
+	// --in-place turns the root part into the output, so only the other pieces are written
+	if (options.in_place) {
+		InPlaceMerge in_place(merged_file, segments);
+		InPlaceStart started = in_place.start();
+		if (started == InPlaceStart::Started) {
+			return appendInPlace(title, in_place, segments, merged_size, merged_file, options, buffer, BUFFER_SIZE, log);
+		}
+		if (started == InPlaceStart::Failed) {
+			log.print("[error] could not move the root package file to '%s': %s\n", full_merged_file.c_str(), lastIoError().c_str());
+			return "";
+		}
+		log.print("\t[info] source and target are on different filesystems, copying the root package file instead\n");
+	}
+
+	// A --resume run keeps the front of an interrupted output if its journal still vouches for it
+	uint64_t resume = 0;
+	FileHandle merged = INVALID_FILE;
+	if (options.resume && fs::exists(merged_file)) {
+		merged = openForWrite(merged_file, false);
+		string reason;
+		if (merged != INVALID_FILE && (resume = journal.resumeOffset(merged, reason)) == 0) {
+			log.print("[info] can't resume %s (%s), starting over\n", merged_file_name.c_str(), reason.c_str());
+		}
+		if (resume == 0) {
+			closeFile(merged);
+			merged = INVALID_FILE;
+		}
+	}
+
+	if (resume > 0) {
+		log.print("[info] resuming %s at byte %llu of %llu (%.0lf%%)\n", merged_file_name.c_str(), (unsigned long long)resume,
+			(unsigned long long)merged_size, (double)resume / (double)merged_size * 100);
+	} else {
+		if (fs::exists(full_merged_file)) {
+			fs::remove(full_merged_file);
+		}
+		// A journal of an earlier output must not vouch for this one
+		journal.remove();
+		merged = openForWrite(merged_file, true);
+	}
+	if (merged == INVALID_FILE) {
+		log.print("[error] could not create '%s': %s\n", full_merged_file.c_str(), lastIoError().c_str());
+		return "";
+	}
+
+	// The copy loops only move the meter; its reporter draws the line a few times a second
+	auto merge_started = std::chrono::steady_clock::now();
+	ProgressMeter meter(merged_size, resume, [&log](const string& line) { log.progress("%s", line.c_str()); }, !log.deferred);
+
+	bool ok;
+	if (options.parallel > 0) {
+		// Every offset is known up front, so size the output once and fill all segments at the same time
+		log.print("\t[work] preallocating %llu bytes and copying %zu pieces with %u streams...\n",
+			(unsigned long long)merged_size, segments.size(), options.parallel);
+		ok = preallocateFile(merged, merged_size);
+		if (!ok) {
+			log.print("[error] could not preallocate '%s': %s\n", full_merged_file.c_str(), lastIoError().c_str());
+		} else {
+			meter.beginPart("all pieces", false);
+			string error;
+			ok = copySegmentsParallel(segments, merged, options.engine, BUFFER_SIZE, options.parallel,
+				[&](uint64_t copied) { meter.update(copied); }, error);
+			const PartTiming& timing = meter.endPart(std::to_string(options.parallel) + " streams");
+			if (ok) {
+				printPartDone(log, timing);
+			} else {
+				log.print("\n[error] %s\n", error.c_str());
+			}
+		}
+	} else {
+		// Hash the bytes on their way through the copy buffer instead of re-reading the output afterwards
+		std::unique_ptr<InlineHasher> hasher;
+		CopyTap tap;
+		if (options.hash) {
+			hasher.reset(new InlineHasher(BUFFER_SIZE));
+			tap = [&](const char* data, size_t length) { hasher->feed(data, length); };
+		}
+
+		// --direct appends through its own aligned buffer rather than writing at each segment's offset
+		std::unique_ptr<DirectOutput> direct_out;
+		ok = true;
+		if (options.direct) {
+			direct_out.reset(new DirectOutput(BUFFER_SIZE));
+			ok = direct_out->open(merged_file, resume);
+			if (!ok) {
+				log.print("[error] could not open '%s' for direct I/O: %s\n", full_merged_file.c_str(), lastIoError().c_str());
+			} else if (!direct_out->direct()) {
+				log.print("\t[info] target filesystem has no direct I/O, limiting the page cache with fadvise instead\n");
+			}
+		}
+
+		// A resumed output may hold old bytes past the resume point, so skipped ranges below its size get punched
+		std::unique_ptr<SparseCopy> sparse;
+		if (ok && options.sparse) {
+			std::error_code error;
+			uint64_t existing = resume > 0 ? fs::file_size(merged_file, error) : 0;
+			markSparse(merged);
+			sparse.reset(new SparseCopy(error ? UINT64_MAX : existing));
+		}
+
+		// Deal with root file first, then all the regular pieces, then the _sc file as the last part
+		if (ok && resume == 0) {
+			log.print("\t[work] copying root package file to new file...");
+		}
+		for (auto & segment : segments) {
+			if (!ok) break;
+			uint64_t skip = std::min(segment.size, resume > segment.offset ? resume - segment.offset : 0);
+			if (hasher) {
+				hasher->beginPart(segment.file.filename().string());
+				ok = hashExisting(*hasher, merged, segment.offset, skip, buffer, BUFFER_SIZE);
+			}
+			if (skip == segment.size) {
+				log.print("\t[work] %s already merged, skipping\n", segment.label.c_str());
+				continue;
+			}
+			if (skip > 0 && segment.offset == 0) {
+				log.print("\t[work] copying rest of root package file...");
+			}
+			if (ok) ok = copySegment(segment, skip, merged, options.engine, buffer, BUFFER_SIZE, log, meter, tap,
+				options.journal ? &journal : nullptr, direct_out.get(), sparse.get());
+			uint64_t committed = direct_out ? direct_out->flushed() : segment.offset + segment.size;
+			if (ok && options.journal && committed > 0 && !journal.checkpoint(merged, committed)) {
+				log.print("[warn] could not update journal %s: %s\n", journal.path().string().c_str(), lastIoError().c_str());
+			}
+		}
+		if (ok && direct_out && !direct_out->finish()) {
+			log.print("[error] could not finish writing '%s': %s\n", full_merged_file.c_str(), lastIoError().c_str());
+			ok = false;
+		}
+		direct_out.reset();
+		if (ok && sparse) {
+			ok = finishSparse(merged, merged_size, *sparse, log);
+		}
+
+		if (hasher) {
+			hasher->finish();
+			if (ok) {
+				hasher->whole.name = merged_file_name;
+				if (writeManifest(merged_file, hasher->whole, hasher->parts)) {
+					log.print("\t[info] sha256 %s, xxh64 %s written to %s.manifest\n", hasher->whole.sha256.c_str(),
+						hasher->whole.xxh64.c_str(), merged_file_name.c_str());
+				} else {
+					log.print("[warn] could not write checksum manifest for %s\n", merged_file_name.c_str());
+				}
+			}
+		}
+	}
+
+	closeFile(merged);
+
+	recordMetrics(options, "merge", title, meter, ok, merged_size - resume, secondsSince(merge_started));
+
+	if (!ok) {
+		if (options.journal && options.parallel == 0 && fs::exists(journal.path())) {
+			log.print("[error] merge of package %s failed, keeping partial output; run again with --resume to continue\n", title_id);
+		} else {
+			log.print("[error] merge of package %s failed, removing incomplete output\n", title_id);
+			fs::remove(merged_file);
+		}
+		return "";
+	}
+
+	journal.remove();
+	return full_merged_file;
+}
+
+// Helper function to check one package against its PKG header and print what was found
+bool preflightReport(const string& title, const Package& pkg, const MergeOptions& options) {
+	PkgHeader header;
+	vector<string> problems;
+	if (preflightPackage(pkg, header, problems)) {
+		say(options, "[success] %s: %s, %llu bytes in %zu pieces, matches its header\n", title.c_str(),
+			header.content_id.empty() ? "no content ID" : header.content_id.c_str(), (unsigned long long)header.package_size,
+			pkg.parts.size() + 1 + (pkg.sc_part != nullptr ? 1 : 0));
+		return true;
+	}
+	say(options, "[error] %s%s%s is incomplete or damaged:\n", title.c_str(), header.content_id.empty() ? "" : " ",
+		header.content_id.c_str());
+	for (auto & problem : problems) {
+		say(options, "\t- %s\n", problem.c_str());
+	}
+	return false;
+}
+
+vector<string> merge(map<string, Package> packages, const fs::path& target_dir, MergeOptions options) {
+	vector<string> created_files;
+
+	// A missing piece or a truncated download fails here, before anything is written
+	if (options.preflight) {
+		for (auto it = packages.begin(); it != packages.end();) {
+			auto preflight_started = std::chrono::steady_clock::now();
+			bool good = preflightReport(it->first, it->second, options);
+			if (options.metrics != nullptr) {
+				options.metrics->record("preflight", it->first, "", good ? "ok" : "failed", 0, secondsSince(preflight_started));
+			}
+			if (good) {
+				++it;
+			} else {
+				say(options, "[error] skipping package %s (use --no-check to merge it anyway)\n", it->first.c_str());
+				it = packages.erase(it);
+			}
+		}
+		if (packages.empty()) {
+			return created_files;
+		}
+	}
+
+	// Calculate optimal buffer size based on available files
+	// Start with 512 KB minimum, but scale up for large files
+	size_t max_file_size = 0;
+	for (auto & root : packages) {
+		auto pkg = root.second;
+		// Check all parts for the largest file
+		for (auto & part : pkg.parts) {
+			size_t part_size = fs::file_size(part.file);
+			if (part_size > max_file_size) {
+				max_file_size = part_size;
+			}
+		}
+		// Check _sc file if exists
+		if (pkg.sc_part != nullptr) {
+			size_t sc_size = fs::file_size(pkg.sc_part->file);
+			if (sc_size > max_file_size) {
+				max_file_size = sc_size;
+			}
+		}
+	}
+
+	// Adaptive buffer sizing strategy
+	const char* size_class;
+	size_t BUFFER_SIZE = mergeBufferSize(max_file_size, &size_class);
+	if (BUFFER_SIZE < 1024 * 1024) {
+		say(options, "[Performance info] Using %zu KB buffer for %s files\n", BUFFER_SIZE / 1024, size_class);
+	} else {
+		say(options, "[Performance info] Using %zu MB buffer for %s files%s\n", BUFFER_SIZE / (1024 * 1024), size_class,
+			BUFFER_SIZE >= 8 * 1024 * 1024 ? " (>4GB)" : "");
+	}
+	// On a copy-on-write filesystem shared with the sources the output can reuse their extents. Hashing and
+	// --direct need the bytes to pass through us, so they keep copying.
+	if (options.engine == CopyEngine::Auto && !options.hash && !options.direct && !options.sparse && options.more_targets.empty() &&
+		!packages.empty() && isReflinkPossible(packages.begin()->second.file, target_dir)) {
+		options.engine = CopyEngine::Reflink;
+		say(options, "[Performance info] Source and target share a reflink-capable filesystem, cloning extents instead of copying\n");
+	}
+	if (!options.more_targets.empty()) {
+		say(options, "[Performance info] Reading every piece once and writing it to %zu target folders at the same time\n",
+			options.more_targets.size() + 1);
+	} else if (options.direct) {
+		say(options, "[Performance info] Direct I/O: reading and writing around the page cache\n");
+	} else if (options.sparse) {
+		say(options, "[Performance info] Sparse copy: holes in the pieces and all-zero blocks stay holes in the output\n");
+	} else {
+		say(options, "[Performance info] Copy engine: %s\n", engineName(options.engine));
+	}
+	if (options.engine == CopyEngine::IoUring) {
+		say(options, "[Performance info] io_uring queue depth %u (%llu MB of registered buffers per stream)\n", ioUringQueueDepth(),
+			(unsigned long long)(ioUringQueueDepth() * BUFFER_SIZE / (1024 * 1024)));
+	}
+	if (options.parallel > 0) {
+		say(options, "[Performance info] Preallocating output and writing with %u parallel streams\n", options.parallel);
+	}
+	if (options.max_rate > 0) {
+		say(options, "[Performance info] Copying at most %.1f MB/s across all %s\n", options.max_rate / (1024.0 * 1024.0),
+			options.jobs > 1 || options.parallel > 0 ? "jobs and streams" : "pieces");
+	}
+
+	unsigned jobs = std::min<unsigned>(options.jobs, (unsigned)packages.size());
+	if (jobs <= 1) {
+		// Allocate buffer ONCE on heap, reuse for all files
+		char* buffer = takeBuffer(options, BUFFER_SIZE);
+		GroupLog log(false, options.output);
+
+		for (auto & root : packages) {
+			string created = mergePackage(root.first, root.second, target_dir, options, buffer, BUFFER_SIZE, log);
+			if (!created.empty()) {
+				// Add the created file to the list
+				addCreated(created_files, created, options);
+			}
+		}
+
+		// Free buffer once at the end
+		giveBuffer(options, buffer, BUFFER_SIZE);
+		return created_files;
+	}
+
+	// Groups share nothing, so run them on workers. Largest first: the long merges start right away
+	// and the small ones fill the gaps at the end instead of one big group finishing last on its own.
+	// Each group also holds a slot on every disk it reads or writes, and a disk only hands out a few
+	// slots (one for a spinning disk by default), so two merges don't seek against each other on one
+	// disk while another disk has nothing to do.
+	struct MergeJob {
+		uint64_t								size;
+		map<string, Package>::const_iterator	package;
+		vector<size_t>							devices;	// Into DeviceMap::devices(), each disk once
+		bool									started;
+	};
+	DeviceMap device_map;
+	vector<MergeJob> queue;
+	for (auto it = packages.cbegin(); it != packages.cend(); ++it) {
+		PkgPartSet part_set(it->second);
+		MergeJob job{ part_set.size(), it, {}, false };
+		for (auto & segment : part_set.segments()) {
+			job.devices.push_back(device_map.deviceOf(segment.file));
+		}
+		job.devices.push_back(device_map.deviceOf(target_dir));
+		for (auto & more_target : options.more_targets) {
+			job.devices.push_back(device_map.deviceOf(more_target));
+		}
+		std::sort(job.devices.begin(), job.devices.end());
+		job.devices.erase(std::unique(job.devices.begin(), job.devices.end()), job.devices.end());
+		queue.push_back(job);
+	}
+	std::stable_sort(queue.begin(), queue.end(), [](const MergeJob& a, const MergeJob& b) { return a.size > b.size; });
+
+	const vector<BlockDevice>& devices = device_map.devices();
+	vector<unsigned> device_limit(devices.size());
+	vector<unsigned> device_busy(devices.size(), 0);
+	string device_list;
+	for (size_t i = 0; i < devices.size(); i++) {
+		device_limit[i] = devices[i].rotational ? options.hdd_jobs : options.ssd_jobs;
+		size_t users = (size_t)std::count_if(queue.begin(), queue.end(), [i](const MergeJob& job) {
+			return std::find(job.devices.begin(), job.devices.end(), i) != job.devices.end();
+		});
+		char entry[160];
+		snprintf(entry, sizeof(entry), "%s%s (%s, %zu %s, up to %u at once)", i == 0 ? "" : ", ", devices[i].name.c_str(),
+			devices[i].rotational ? "HDD" : "SSD", users, users == 1 ? "package" : "packages", device_limit[i]);
+		device_list += entry;
+	}
+
+	say(options, "[Performance info] Merging %zu packages with %u jobs, largest first\n", queue.size(), jobs);
+	say(options, "[Performance info] Disks: %s\n", device_list.c_str());
+
+	vector<string> results(queue.size());
+	std::mutex schedule_lock;
+	std::condition_variable schedule_changed;
+	size_t unstarted = queue.size();
+
+	// Called with schedule_lock held: the largest waiting job whose disks all have a free slot
+	auto nextJob = [&]() -> size_t {
+		for (size_t i = 0; i < queue.size(); i++) {
+			if (queue[i].started) continue;
+			bool fits = true;
+			for (size_t device : queue[i].devices) {
+				fits = fits && device_busy[device] < device_limit[device];
+			}
+			if (fits) return i;
+		}
+		return queue.size();
+	};
+
+	auto worker = [&]() {
+		// Per-worker buffer, nothing is shared between groups
+		char* buffer = takeBuffer(options, BUFFER_SIZE);
+		std::unique_lock<std::mutex> guard(schedule_lock);
+		while (unstarted > 0) {
+			size_t index = nextJob();
+			if (index == queue.size()) {
+				// Every waiting job needs a disk that is full; a finishing job frees one
+				schedule_changed.wait(guard);
+				continue;
+			}
+			MergeJob& job = queue[index];
+			job.started = true;
+			unstarted--;
+			for (size_t device : job.devices) device_busy[device]++;
+			guard.unlock();
+
+			auto & root = *job.package;
+			GroupLog log(true, options.output);
+			results[index] = mergePackage(root.first, root.second, target_dir, options, buffer, BUFFER_SIZE, log);
+			log.flush();
+
+			guard.lock();
+			for (size_t device : job.devices) device_busy[device]--;
+			schedule_changed.notify_all();
+		}
+		guard.unlock();
+		giveBuffer(options, buffer, BUFFER_SIZE);
+	};
+
+	vector<std::thread> pool;
+	for (unsigned i = 0; i < jobs; i++) {
+		pool.emplace_back(worker);
+	}
+	for (auto & thread : pool) {
+		thread.join();
+	}
+
+	for (auto & created : results) {
+		if (!created.empty()) {
+			addCreated(created_files, created, options);
+		}
+	}
+	return created_files;
+}
+
+// Writes one package to a stream in order (root, numbered pieces, _sc) without creating any file.
+// Everything printed goes to stderr by then, `out` only ever sees PKG bytes.
+bool streamPackage(const string& title, const Package& pkg, FileHandle out, const MergeOptions& options) {
+	PkgPartSet part_set(pkg);
+	const vector<MergeSegment>& segments = part_set.segments();
+	uint64_t merged_size = part_set.size();
+
+	uint64_t largest = 0;
+	for (auto & segment : segments) {
+		largest = std::max(largest, segment.size);
+	}
+	const char* size_class;
+	size_t BUFFER_SIZE = mergeBufferSize(largest, &size_class);
+	char* buffer = takeBuffer(options, BUFFER_SIZE);
+	GroupLog log(false, options.output);
+	auto stream_started = std::chrono::steady_clock::now();
+	ProgressMeter meter(merged_size, 0, [&log](const string& line) { log.progress("%s", line.c_str()); }, true);
+
+	log.print("[work] streaming %zu pieces of package %s (%llu bytes)...\n", segments.size(), title.c_str(),
+		(unsigned long long)merged_size);
+
+	bool ok = true;
+	for (auto & segment : segments) {
+		FileHandle to_merge = openForRead(segment.file);
+		if (to_merge == INVALID_FILE) {
+			log.print("\n[error] could not open '%s': %s\n", segment.file.string().c_str(), lastIoError().c_str());
+			ok = false;
+			break;
+		}
+		const char* method = "buffered";
+		// A pipe takes at most its capacity per call, far too often to print each one
+		auto progress = [&](uint64_t copied) { meter.update(segment.offset + copied); };
+		meter.beginPart(segment.label, false);
+		if (options.engine == CopyEngine::Buffered) {
+			// streamRange only drops to the read/write loop when nothing else works; --engine=buffered asks for it
+			for (uint64_t copied = 0; ok && copied < segment.size;) {
+				size_t chunk = (size_t)std::min<uint64_t>(segment.size - copied, BUFFER_SIZE);
+				int64_t got = readAt(to_merge, buffer, chunk, copied);
+				ok = got > 0 && writeStream(out, buffer, (size_t)got) == got;
+				if (ok) throttleIo((uint64_t)got);
+				if (ok) progress(copied += (uint64_t)got);
+			}
+		} else {
+			ok = streamRange(to_merge, 0, out, segment.size, buffer, BUFFER_SIZE, progress, &method);
+		}
+		closeFile(to_merge);
+		const PartTiming& timing = meter.endPart(method);
+		if (!ok) {
+			log.print("\n[error] streaming '%s' failed (%s): %s\n", segment.file.string().c_str(), method, lastIoError().c_str());
+			break;
+		}
+		printPartDone(log, timing);
+	}
+
+	recordMetrics(options, "stream", title, meter, ok, merged_size, secondsSince(stream_started));
+
+	giveBuffer(options, buffer, BUFFER_SIZE);
+	return ok;
+}
+
+// Cuts a merged PKG back into pieces of `piece_size` bytes in `target_dir` (-split). The header has to
+// declare the file's size, so the pieces merge back into a PKG the pre-flight check accepts.
+bool splitPackage(const fs::path& merged_file, const fs::path& target_dir, uint64_t piece_size, bool sc_tail,
+	const MergeOptions& options) {
+	PkgHeader header;
+	string error;
+	if (!readPkgHeader(merged_file, header, error)) {
+		say(options, "[error] can't split '%s': %s\n", merged_file.string().c_str(), error.c_str());
+		return false;
+	}
+	uint64_t merged_size = fs::file_size(merged_file);
+	if (header.package_size != merged_size) {
+		say(options, "[%s] '%s' is %llu bytes but its header declares %llu\n", options.preflight ? "error" : "warn",
+			merged_file.filename().string().c_str(), (unsigned long long)merged_size, (unsigned long long)header.package_size);
+		if (options.preflight) {
+			say(options, "[error] not splitting an incomplete PKG (use --no-check to split it anyway)\n");
+			return false;
+		}
+	}
+
+	string title = splitTitle(merged_file);
+	vector<MergeSegment> pieces = planSplit(title, merged_size, piece_size, sc_tail, target_dir);
+	if (sc_tail && pieces.size() == 1) {
+		say(options, "[warn] %s fits in one piece, writing it as the root without an _sc tail\n", title.c_str());
+	}
+	// Never overwrite: a stale piece next to a fresh set would be merged into it
+	for (auto & piece : pieces) {
+		if (fs::exists(piece.file)) {
+			say(options, "[error] '%s' already exists. Split into an empty folder or remove the old pieces first\n",
+				piece.file.string().c_str());
+			return false;
+		}
+	}
+
+	unsigned threads = options.parallel > 0 ? options.parallel : defaultParallelThreads();
+	const char* size_class;
+	size_t buffer_size = mergeBufferSize(pieces.front().size, &size_class);
+	say(options, "[Performance info] Using %zu KB buffer for %s files\n", buffer_size / 1024, size_class);
+	say(options, "[Performance info] Copy engine: %s\n", engineName(options.engine));
+	say(options, "[work] splitting %s (%llu bytes) into %zu pieces of up to %llu bytes with %u streams...\n", title.c_str(),
+		(unsigned long long)merged_size, pieces.size(), (unsigned long long)piece_size, threads);
+
+	GroupLog log(false, options.output);
+	auto split_started = std::chrono::steady_clock::now();
+	ProgressMeter meter(merged_size, 0, [&log](const string& line) { log.progress("%s", line.c_str()); }, true, "split");
+	meter.beginPart("all pieces", false);
+	bool ok = splitMerged(merged_file, pieces, options.engine, buffer_size, threads, [&](uint64_t copied) { meter.update(copied); }, error);
+	const PartTiming& timing = meter.endPart(std::to_string(threads) + " streams");
+	if (ok) {
+		printPartDone(log, timing);
+	} else {
+		log.print("\n[error] %s\n", error.c_str());
+	}
+	recordMetrics(options, "split", title, meter, ok, merged_size, secondsSince(split_started));
+
+	if (ok) {
+		for (auto & piece : pieces) {
+			say(options, "The file was created: %s\n", piece.file.string().c_str());
+		}
+	}
+	return ok;
+}
+
+// Checks the PKG `part_set` makes up against the digests stored in it (--verify, -verify) and prints every
+// region that doesn't match. Returns false if the PKG can't be parsed or a digest doesn't match.
+bool verifyReport(const string& title, const PkgPartSet& part_set, const MergeOptions& options) {
+	auto verify_started = std::chrono::steady_clock::now();
+	PkgVerifier verifier(part_set);
+	string error;
+	if (!verifier.open(error)) {
+		say(options, "[error] can't verify %s: %s\n", title.c_str(), error.c_str());
+		if (options.metrics != nullptr) {
+			options.metrics->record("verify", title, "", "failed", 0, secondsSince(verify_started));
+		}
+		return false;
+	}
+	const VerifyReport& report = verifier.report();
+	if (report.checks.empty()) {
+		say(options, "[warn] %s stores no digests that can be checked without its keys\n", title.c_str());
+		return true;
+	}
+
+	GroupLog log(false, options.output);
+	ProgressMeter meter(verifier.plannedBytes(), 0, [&log](const string& line) { log.progress("%s", line.c_str()); }, true, "verified");
+	log.print("[work] verifying %zu digests of %s...\n", report.checks.size(), title.c_str());
+	meter.beginPart("all digests", false);
+	verifier.run(defaultVerifyThreads(), [&](uint64_t hashed) { meter.update(hashed); });
+	const PartTiming& timing = meter.endPart(std::to_string(report.threads) + (report.threads == 1 ? " thread" : " threads"));
+	recordMetrics(options, "verify", title, meter, report.failures() == 0, report.bytes, secondsSince(verify_started));
+	printPartDone(log, timing);
+
+	for (auto & check : report.checks) {
+		if (check.result == DigestResult::Mismatch) {
+			log.print("\t[error] %s (%llu bytes at %llu): SHA-256 is %s, the package says %s\n", check.name.c_str(),
+				(unsigned long long)check.size, (unsigned long long)check.offset, check.actual.c_str(), check.expected.c_str());
+		} else if (check.result == DigestResult::Unreadable) {
+			log.print("\t[error] %s (%llu bytes at %llu): could not be read, the PKG is truncated or a piece is missing\n",
+				check.name.c_str(), (unsigned long long)check.size, (unsigned long long)check.offset);
+		}
+	}
+	if (report.encrypted > 0) {
+		log.print("\t[info] %zu encrypted %s skipped, their digests cover the decrypted data\n", report.encrypted,
+			report.encrypted == 1 ? "entry" : "entries");
+	}
+	log.print("[Performance info] hashed %.1f MB in %.2f s (%.1f MB/s, %s SHA-256)\n", report.bytes / (1024.0 * 1024.0),
+		report.seconds, report.seconds > 0 ? report.bytes / (1024.0 * 1024.0) / report.seconds : 0, sha256Accelerated() ? "SHA-NI" : "portable");
+	size_t failures = report.failures();
+	if (failures > 0) {
+		log.print("[error] %s: %zu of %zu digests don't match\n", title.c_str(), failures, report.checks.size());
+		return false;
+	}
+	log.print("[success] %s: all %zu digests match\n", title.c_str(), report.checks.size());
+	return true;
+}
+
+// Helper function to verify a merged output file
+bool verifyMerged(const fs::path& merged_file, const MergeOptions& options) {
+	Package merged;
+	merged.file = merged_file;
+	return verifyReport(splitTitle(merged_file), PkgPartSet(merged), options);
+}
+
+// Helper function to scan the source folder, timed for --metrics-json
+bool scanTimed(const fs::path& source_path, bool single_mode, map<string, Package>& packages, const MergeOptions& options) {
+	auto scan_started = std::chrono::steady_clock::now();
+	bool ok;
+	if (!options.output) {
+		ok = scanPackages(source_path, single_mode, stdout, packages);
+	} else {
+		// The scan prints to a FILE*, so its report is collected there and handed on in one piece
+		FILE* report = tmpfile();
+		ok = scanPackages(source_path, single_mode, report != NULL ? report : stdout, packages);
+		if (report != NULL) {
+			string text;
+			char chunk[4096];
+			rewind(report);
+			for (size_t got; (got = fread(chunk, 1, sizeof(chunk), report)) > 0;) {
+				text.append(chunk, got);
+			}
+			fclose(report);
+			emit(options.output, text);
+		}
+	}
+	if (options.metrics != nullptr) {
+		options.metrics->record("scan", "", "", std::to_string(packages.size()) + (packages.size() == 1 ? " package" : " packages"), 0, secondsSince(scan_started));
+	}
+	return ok;
+}
+
+// Helper function to write the --metrics-json file, if one was asked for
+void writeMetrics(const MergeOptions& options) {
+	if (options.metrics == nullptr) return;
+	if (options.metrics->write(fs::path(options.metrics_file))) {
+		say(options, "[info] timings written to %s\n", options.metrics_file.c_str());
+	} else {
+		say(options, "[warn] could not write metrics to '%s': %s\n", options.metrics_file.c_str(), lastIoError().c_str());
+	}
+}
+
+// Helper function to parse a single "--name[=value]" option
+bool parseOption(const string& arg, MergeOptions& options) {
+	size_t eq = arg.find('=');
+	string name = toLower(arg.substr(0, eq));
+	string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+	if (name == "--engine") {
+		if (!parseEngineName(toLower(value), options.engine)) {
+			say(options, "[error] Unknown copy engine '%s'. Must be 'auto', 'copy_file_range', 'splice', 'buffered' or 'io_uring'\n", value.c_str());
+			return false;
+		}
+		if (!isEngineAvailable(options.engine)) {
+			say(options, "[error] Copy engine '%s' is not available on this platform\n", value.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	if (name == "--parallel") {
+		if (value.empty()) {
+			options.parallel = defaultParallelThreads();
+			return true;
+		}
+		char* end = NULL;
+		long threads = strtol(value.c_str(), &end, 10);
+		if (*end != '\0' || threads < 1 || threads > 64) {
+			say(options, "[error] Invalid stream count '%s' for --parallel. Must be between 1 and 64\n", value.c_str());
+			return false;
+		}
+		options.parallel = (unsigned)threads;
+		return true;
+	}
+
+	if (name == "--queue-depth") {
+		char* end = NULL;
+		long depth = strtol(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || depth < 1 || depth > 64) {
+			say(options, "[error] Invalid queue depth '%s'. Must be between 1 and 64\n", value.c_str());
+			return false;
+		}
+		setIoUringQueueDepth((unsigned)depth);
+		return true;
+	}
+
+	if (name == "--jobs") {
+		char* end = NULL;
+		long jobs = strtol(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || jobs < 1 || jobs > 64) {
+			say(options, "[error] Invalid job count '%s' for --jobs. Must be between 1 and 64\n", value.c_str());
+			return false;
+		}
+		options.jobs = (unsigned)jobs;
+		return true;
+	}
+
+	if (name == "--hdd-jobs" || name == "--ssd-jobs") {
+		char* end = NULL;
+		long jobs = strtol(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || jobs < 1 || jobs > 64) {
+			say(options, "[error] Invalid job count '%s' for %s. Must be between 1 and 64\n", value.c_str(), name.c_str());
+			return false;
+		}
+		(name == "--hdd-jobs" ? options.hdd_jobs : options.ssd_jobs) = (unsigned)jobs;
+		return true;
+	}
+
+	if (name == "--hash") {
+		options.hash = true;
+		return true;
+	}
+
+	if (name == "--resume") {
+		options.resume = true;
+		return true;
+	}
+
+	if (name == "--no-journal") {
+		options.journal = false;
+		return true;
+	}
+
+	if (name == "--direct") {
+		options.direct = true;
+		return true;
+	}
+
+	if (name == "--no-check") {
+		options.preflight = false;
+		return true;
+	}
+
+	if (name == "--watch") {
+		options.watch = true;
+		return true;
+	}
+
+	if (name == "--in-place") {
+		if (!value.empty() && toLower(value) != "keep" && toLower(value) != "delete") {
+			say(options, "[error] Invalid value '%s' for --in-place. Must be 'keep' or 'delete'\n", value.c_str());
+			return false;
+		}
+		options.in_place = true;
+		options.consume = toLower(value) == "delete";
+		return true;
+	}
+
+	if (name == "--sparse") {
+		options.sparse = true;
+		return true;
+	}
+
+	if (name == "--delta") {
+		options.delta = true;
+		return true;
+	}
+
+	if (name == "--verify") {
+		options.verify = true;
+		return true;
+	}
+
+	if (name == "--max-rate") {
+		if (!parseRate(value, options.max_rate)) {
+			say(options, "[error] Invalid rate '%s' for --max-rate. Use bytes per second, e.g. 50M or 1.5G\n", value.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	if (name == "--io-priority") {
+		string level = toLower(value);
+		if (level == "low") {
+			options.io_priority = IoPriority::Low;
+		} else if (level == "idle") {
+			options.io_priority = IoPriority::Idle;
+		} else if (level == "normal") {
+			options.io_priority = IoPriority::Normal;
+		} else {
+			say(options, "[error] Invalid I/O priority '%s'. Must be 'normal', 'low' or 'idle'\n", value.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	if (name == "--metrics-json") {
+		if (value.empty()) {
+			say(options, "[error] --metrics-json needs a file name, e.g. --metrics-json=merge-metrics.json\n");
+			return false;
+		}
+		options.metrics_file = cleanPathString(value);
+		return true;
+	}
+
+	say(options, "[error] Unknown option '%s'\n", arg.c_str());
+	return false;
+}
+
+bool parseArguments(const vector<string>& args, MergeOptions& options, vector<string>& positional) {
+	for (size_t i = 0; i < args.size(); i++) {
+		if (args[i].compare(0, 2, "--") != 0) {
+			positional.push_back(args[i]);
+			continue;
+		}
+		string option = args[i];
+		string name = toLower(option);
+		if (option.find('=') == string::npos && (name == "--jobs" || name == "--engine" || name == "--queue-depth" || name == "--metrics-json" ||
+			name == "--max-rate" || name == "--io-priority" || name == "--hdd-jobs" || name == "--ssd-jobs") && i + 1 < args.size()) {
+			option += "=" + args[++i];
+		}
+		if (!parseOption(option, options)) return false;
+	}
+	return true;
+}
+
+// Helper function to reject option combinations that can't work together
+bool validateOptions(const MergeOptions& options, bool stream) {
+	if (options.hash && options.parallel > 0) {
+		say(options, "[error] --hash needs the bytes in output order and can't be combined with --parallel\n");
+		return false;
+	}
+	if (options.resume && options.parallel > 0) {
+		say(options, "[error] --resume continues from a single committed offset and can't be combined with --parallel\n");
+		return false;
+	}
+	if (options.resume && !options.journal) {
+		say(options, "[error] --resume continues from the journal and can't be combined with --no-journal\n");
+		return false;
+	}
+	if (options.direct && options.parallel > 0) {
+		say(options, "[error] --direct streams the output through one aligned buffer and can't be combined with --parallel\n");
+		return false;
+	}
+	if (options.direct && options.engine != CopyEngine::Auto) {
+		say(options, "[error] --direct does its own unbuffered reads and writes and can't be combined with --engine=%s\n", engineName(options.engine));
+		return false;
+	}
+	if (options.watch && (options.parallel > 0 || options.jobs > 1 || options.hash || options.resume || options.direct)) {
+		say(options, "[error] --watch appends one piece at a time and can't be combined with --parallel, --jobs, --hash, --resume or --direct\n");
+		return false;
+	}
+	if (stream && (options.parallel > 0 || options.jobs > 1 || options.hash || options.resume || options.direct || options.watch)) {
+		say(options, "[error] streaming to '-' or fd:N writes strictly in order and can't be combined with --parallel, --jobs, --hash, --resume, --direct or --watch\n");
+		return false;
+	}
+	if (stream && options.engine != CopyEngine::Auto && options.engine != CopyEngine::Buffered) {
+		say(options, "[error] streaming picks splice or sendfile on its own, only --engine=buffered can be forced\n");
+		return false;
+	}
+	if (options.in_place && (stream || options.parallel > 0 || options.hash || options.resume || options.direct || options.watch)) {
+		say(options, "[error] --in-place appends to the root package file and can't be combined with --parallel, --hash, --resume, --direct, --watch or streaming\n");
+		return false;
+	}
+	if (options.verify && stream) {
+		say(options, "[error] --verify reads the finished output back and can't be combined with streaming (verify the pieces with -verify instead)\n");
+		return false;
+	}
+	if (options.sparse && (stream || options.parallel > 0 || options.direct || options.watch)) {
+		say(options, "[error] --sparse decides per block what to write and can't be combined with --parallel, --direct, --watch or streaming\n");
+		return false;
+	}
+	if (options.sparse && options.engine != CopyEngine::Auto && options.engine != CopyEngine::Buffered) {
+		say(options, "[error] --sparse reads every block itself and can't be combined with --engine=%s\n", engineName(options.engine));
+		return false;
+	}
+	if (options.delta && (stream || options.parallel > 0 || options.hash || options.resume || options.direct || options.watch ||
+		options.in_place || options.sparse)) {
+		say(options, "[error] --delta updates the existing output block by block and can't be combined with --parallel, --hash, --resume,\n");
+		say(options, "        --direct, --watch, --in-place, --sparse or streaming\n");
+		return false;
+	}
+	if (options.hash && options.engine != CopyEngine::Auto && options.engine != CopyEngine::Buffered) {
+		say(options, "[error] --hash needs the data in the copy buffer, which the %s engine bypasses. Use --engine=buffered\n", engineName(options.engine));
+		return false;
+	}
+	return true;
+}
+
+// Helper function to check the further folders of a target list and what can be done with them
+static bool validateTargets(const fs::path& target_path, const MergeOptions& options) {
+	if (options.more_targets.empty()) {
+		return true;
+	}
+	vector<fs::path> checked = { target_path };
+	for (auto & more_target : options.more_targets) {
+		if (!fs::is_directory(more_target)) {
+			say(options, "[error] target directory '%s' does not exist\n", more_target.string().c_str());
+			return false;
+		}
+		for (auto & other : checked) {
+			std::error_code error;
+			if (fs::equivalent(more_target, other, error)) {
+				say(options, "[error] target directory '%s' is listed twice\n", more_target.string().c_str());
+				return false;
+			}
+		}
+		checked.push_back(more_target);
+	}
+	if (options.parallel > 0 || options.resume || options.direct || options.in_place || options.sparse || options.delta) {
+		say(options, "[error] writing to several target folders shares one read of every chunk and can't be combined with\n");
+		say(options, "        --parallel, --resume, --direct, --in-place, --sparse or --delta\n");
+		return false;
+	}
+	if (options.engine != CopyEngine::Auto && options.engine != CopyEngine::Buffered) {
+		say(options, "[error] writing to several target folders reads every chunk into memory once, --engine=%s doesn't apply\n",
+			engineName(options.engine));
+		return false;
+	}
+	return true;
+}
+
+bool mergeFolder(const fs::path& source_path, const fs::path& target_path, bool single_mode, const MergeOptions& options,
+	vector<string>& created_files) {
+	// Validate source directory
+	if (!fs::exists(source_path)) {
+		say(options, "[error] source directory '%s' does not exist\n", source_path.string().c_str());
+		return false;
+	}
+
+	if (!fs::is_directory(source_path)) {
+		say(options, "[error] source argument '%s' is not a directory\n", source_path.string().c_str());
+		return false;
+	}
+
+	// Validate target directory
+	if (!fs::exists(target_path)) {
+		say(options, "[error] target directory '%s' does not exist\n", target_path.string().c_str());
+		return false;
+	}
+
+	if (!fs::is_directory(target_path)) {
+		say(options, "[error] target argument '%s' is not a directory\n", target_path.string().c_str());
+		return false;
+	}
+
+	if (!validateTargets(target_path, options)) {
+		return false;
+	}
+
+	// Crashed --in-place merges are settled first: a rollback puts their root part back for the scan
+	if (options.in_place) {
+		vector<char> buffer(8 * 1024 * 1024);
+		if (!recoverInPlaceMerges(target_path, options.engine, buffer.data(), buffer.size(), options.output)) {
+			return false;
+		}
+	}
+
+	map<string, Package> packages;
+	if (!scanTimed(source_path, single_mode, packages, options)) {
+		return false;
+	}
+
+	created_files = merge(packages, target_path, options);
+
+	// A bad piece merges without complaint, only the digests inside the PKG can tell
+	size_t corrupt = 0;
+	if (options.verify) {
+		for (const auto& file : created_files) {
+			say(options, "\n");
+			if (!verifyMerged(fs::path(file), options)) corrupt++;
+		}
+	}
+
+	if (corrupt > 0) {
+		say(options, "\n[error] %zu of %zu merged packages failed verification\n", corrupt, created_files.size());
+		return false;
+	}
+	say(options, "\n[success] completed\n");
+
+	// Display all created files
+	for (const auto& file : created_files) {
+		say(options, "The file was created: %s\n", file.c_str());
+	}
+	return true;
+}
@@ -0,0 +1,113 @@
+// merger.h : scan, group and merge logic behind the command line and the merge service
+//
+
+#pragma once
+
+#include "pkgparts.h"
+#include "copyengine.h"
+#include "metrics.h"
+#include "throttle.h"
+#include "console.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <functional>
+
+// Aligned copy buffers kept from one merge to the next, so a long-running service neither allocates nor
+// faults in fresh buffers for every job. Safe to share between threads.
+class BufferPool {
+public:
+	BufferPool() {}
+	~BufferPool();
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	// A free buffer of `size` bytes, or a new one if none is free
+	char* take(size_t size);
+	void give(char* buffer, size_t size);
+
+private:
+	std::mutex							lock;
+	std::multimap<size_t, char*>		free_buffers;
+};
+
+struct MergeOptions {
+	CopyEngine			engine;			// Engine forced with --engine=, Auto picks per file pair
+	unsigned			parallel;		// Concurrent streams for --parallel, 0 = append sequentially
+	unsigned			jobs;			// Packages merged at the same time in -multiple mode (--jobs)
+	unsigned			hdd_jobs;		// Of those, merges touching one spinning disk at the same time (--hdd-jobs)
+	unsigned			ssd_jobs;		// Same for a solid-state disk (--ssd-jobs)
+	bool				hash;			// Hash while copying and write a checksum manifest (--hash)
+	bool				resume;			// Continue an interrupted merge from its journal (--resume)
+	bool				journal;		// Keep <output>.journal while merging sequentially (off with --no-journal)
+	bool				direct;			// Keep the merge out of the page cache (--direct)
+	bool				preflight;		// Check every part set against its PKG header first (off with --no-check)
+	bool				watch;			// Merge pieces as they finish downloading (--watch)
+	bool				in_place;		// Turn the root part into the output instead of copying it (--in-place)
+	bool				consume;		// Delete each piece once it's durably in the output (--in-place=delete)
+	bool				sparse;			// Leave zero blocks and source holes as holes in the output (--sparse)
+	bool				verify;			// Check every output against the digests stored in the PKG (--verify)
+	bool				delta;			// Only rewrite the blocks of an existing output that changed (--delta)
+	uint64_t			max_rate;		// Bytes per second all copies together may move (--max-rate), 0 = no cap
+	IoPriority			io_priority;	// --io-priority=low|idle
+	std::string			metrics_file;	// Where --metrics-json writes the phase timings, empty = off
+	MetricsRecorder*	metrics;		// Collects them while metrics_file is set
+	OutputSink			output;			// Where messages go, stdout when empty
+	BufferPool*			buffers;		// Copy buffers come from here when set, otherwise each merge allocates its own
+	std::vector<std::filesystem::path>	more_targets;	// Further folders every output is written to as well ("A;B;C" target)
+	MergeOptions() : engine(CopyEngine::Auto), parallel(0), jobs(1), hdd_jobs(1), ssd_jobs(4), hash(false), resume(false), journal(true), direct(false), preflight(true),
+		watch(false), in_place(false), consume(false), sparse(false), verify(false),
+		delta(false), max_rate(0), io_priority(IoPriority::Normal), metrics(nullptr), buffers(nullptr) {}
+};
+
+std::string toLower(const std::string& str);
+// Removes leading and trailing quotes from a path argument
+std::string cleanPathString(const std::string& path);
+
+// Parses a single "--name[=value]" option into `options`
+bool parseOption(const std::string& arg, MergeOptions& options);
+// Parses every "--" argument of `args` (options that always take a value may also be written as
+// "--name value") and leaves the others in `positional`, in order
+bool parseArguments(const std::vector<std::string>& args, MergeOptions& options, std::vector<std::string>& positional);
+// Splits a target argument into its folders: "A;B;C" writes every output to all three
+std::vector<std::filesystem::path> splitTargetList(const std::string& targets);
+// Rejects option combinations that can't work together; `stream` is set when the target is "-" or fd:N
+bool validateOptions(const MergeOptions& options, bool stream);
+
+// Checks one package against its PKG header and prints what was found
+bool preflightReport(const std::string& title, const Package& pkg, const MergeOptions& options);
+
+// Scans the source folder, timed for --metrics-json
+bool scanTimed(const std::filesystem::path& source_path, bool single_mode, std::map<std::string, Package>& packages,
+	const MergeOptions& options);
+
+// Merges every package into `target_dir`, and into options.more_targets from the same reads, with --jobs
+// workers scheduled over the disks involved. Returns the files created; packages that failed are reported
+// and left out.
+std::vector<std::string> merge(std::map<std::string, Package> packages, const std::filesystem::path& target_dir, MergeOptions options);
+
+// A whole merge run the way the command line does it: settles crashed --in-place merges, scans
+// `source_path`, merges every package into `target_path` and options.more_targets, verifies the outputs
+// with --verify and prints the summary. `created_files` receives the outputs. Returns false if the
+// folders are unusable, the scan fails or an output fails verification.
+bool mergeFolder(const std::filesystem::path& source_path, const std::filesystem::path& target_path, bool single_mode,
+	const MergeOptions& options, std::vector<std::string>& created_files);
+
+// Writes one package to a stream in order (root, numbered pieces, _sc) without creating any file.
+// Everything printed goes to stderr by then, `out` only ever sees PKG bytes.
+bool streamPackage(const std::string& title, const Package& pkg, FileHandle out, const MergeOptions& options);
+
+// Cuts a merged PKG back into pieces of `piece_size` bytes in `target_dir` (-split). The header has to
+// declare the file's size, so the pieces merge back into a PKG the pre-flight check accepts.
+bool splitPackage(const std::filesystem::path& merged_file, const std::filesystem::path& target_dir, uint64_t piece_size,
+	bool sc_tail, const MergeOptions& options);
+
+// Checks the PKG `part_set` makes up against the digests stored in it (--verify, -verify) and prints every
+// region that doesn't match. Returns false if the PKG can't be parsed or a digest doesn't match.
+bool verifyReport(const std::string& title, const PkgPartSet& part_set, const MergeOptions& options);
+bool verifyMerged(const std::filesystem::path& merged_file, const MergeOptions& options);
+
+// Writes the --metrics-json file, if one was asked for
+void writeMetrics(const MergeOptions& options);
@@ -0,0 +1,78 @@
+// metrics.cpp : JSON timings for --metrics-json
+//
+
+#include "stdafx.h"
+#include "metrics.h"
+#include <fstream>
+#include <sstream>
+#include <ctime>
+
+namespace fs = std::filesystem;
+using std::string;
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Helper function to quote a string for JSON (paths on Windows are full of backslashes)
+static string jsonString(const string& value) {
+	string quoted = "\"";
+	for (unsigned char c : value) {
+		if (c == '"' || c == '\\') {
+			quoted += '\\';
+			quoted += (char)c;
+		} else if (c < 0x20) {
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", c);
+			quoted += escape;
+		} else {
+			quoted += (char)c;
+		}
+	}
+	return quoted + "\"";
+}
+
+MetricsRecorder::MetricsRecorder() : started(std::chrono::steady_clock::now()), started_unix((long long)time(NULL)) {}
+
+void MetricsRecorder::record(const string& phase, const string& package, const string& part, const string& detail,
+	uint64_t bytes, double seconds) {
+	std::lock_guard<std::mutex> guard(lock);
+	entries.emplace_back(phase, package, part, detail, bytes, seconds);
+}
+
+bool MetricsRecorder::write(const fs::path& file) const {
+	std::ostringstream json;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		json << "{\n";
+		json << "  \"tool\": \"pkg-merge\",\n";
+		json << "  \"started_unix\": " << started_unix << ",\n";
+		json << "  \"total_seconds\": " << secondsSince(started) << ",\n";
+		json << "  \"phases\": [";
+		for (size_t i = 0; i < entries.size(); i++) {
+			auto & entry = entries[i];
+			double rate = entry.seconds > 0 ? (double)entry.bytes / (1024.0 * 1024.0) / entry.seconds : 0;
+			json << (i == 0 ? "\n" : ",\n") << "    {\"phase\": " << jsonString(entry.phase)
+				<< ", \"package\": " << jsonString(entry.package) << ", \"part\": " << jsonString(entry.part)
+				<< ", \"detail\": " << jsonString(entry.detail) << ", \"bytes\": " << entry.bytes
+				<< ", \"seconds\": " << entry.seconds << ", \"mb_per_second\": " << rate << "}";
+		}
+		json << "\n  ]\n}\n";
+	}
+
+	fs::path temp_file = file;
+	temp_file += ".tmp";
+	{
+		std::ofstream out(temp_file, std::ios::binary | std::ios::trunc);
+		if (!out) {
+			return false;
+		}
+		out << json.str();
+		if (!out.flush()) {
+			return false;
+		}
+	}
+	std::error_code error;
+	fs::rename(temp_file, file, error);
+	return !error;
+}
@@ -0,0 +1,44 @@
+// metrics.h : structured timings of a run, written with --metrics-json=<file>
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <filesystem>
+
+struct MetricsEntry {
+	std::string			phase;			// "scan", "preflight", "merge", "part", "stream"...
+	std::string			package;		// Empty for phases that cover the whole run
+	std::string			part;			// Label of the piece for "part" entries
+	std::string			detail;			// Engine, result or anything else worth keeping
+	uint64_t			bytes;
+	double				seconds;
+	MetricsEntry(const std::string& phase, const std::string& package, const std::string& part, const std::string& detail,
+		uint64_t bytes, double seconds) : phase(phase), package(package), part(part), detail(detail), bytes(bytes), seconds(seconds) {}
+};
+
+// Collects one entry per phase from any thread and writes them as a single JSON document:
+// { "tool", "started_unix", "total_seconds", "phases": [ { phase, package, part, detail, bytes, seconds, mb_per_second } ] }
+class MetricsRecorder {
+public:
+	MetricsRecorder();
+
+	void record(const std::string& phase, const std::string& package, const std::string& part, const std::string& detail,
+		uint64_t bytes, double seconds);
+
+	// Writes aside and renames, so a reader never sees half a document. Returns false on I/O errors.
+	bool write(const std::filesystem::path& file) const;
+
+private:
+	mutable std::mutex					lock;
+	std::vector<MetricsEntry>			entries;
+	std::chrono::steady_clock::time_point	started;
+	long long							started_unix;
+};
+
+// Seconds since `start`, for timing a phase
+double secondsSince(std::chrono::steady_clock::time_point start);
@@ -0,0 +1,91 @@
+// parallelcopy.cpp : thread pool that writes merge segments into their final offsets
+//
+
+#include "stdafx.h"
+#include "parallelcopy.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+using std::string;
+using std::vector;
+
+// Work is handed out in slices of at most this many bytes
+const uint64_t PARALLEL_SLICE_SIZE = 256ULL * 1024 * 1024;
+
+struct CopySlice {
+	const MergeSegment*	segment;
+	uint64_t			start;		// Offset inside the segment's source file
+	uint64_t			length;
+};
+
+unsigned defaultParallelThreads() {
+	// Beyond a handful of streams even NVMe stops scaling, and spinning disks only get slower
+	unsigned cores = std::thread::hardware_concurrency();
+	return std::max(2u, std::min(cores == 0 ? 4u : cores, 8u));
+}
+
+bool copySegmentsParallel(const vector<MergeSegment>& segments, FileHandle merged, CopyEngine engine,
+	size_t buffer_size, unsigned threads, const CopyProgress& progress, string& error) {
+	vector<CopySlice> slices;
+	for (auto & segment : segments) {
+		for (uint64_t start = 0; start < segment.size; start += PARALLEL_SLICE_SIZE) {
+			slices.push_back({ &segment, start, std::min(PARALLEL_SLICE_SIZE, segment.size - start) });
+		}
+	}
+	threads = std::max(1u, std::min<unsigned>(threads, (unsigned)slices.size()));
+
+	std::atomic<size_t> next_slice(0);
+	std::atomic<uint64_t> total_copied(0);
+	std::atomic<bool> failed(false);
+	std::mutex progress_lock;
+
+	auto worker = [&]() {
+		char* buffer = new char[buffer_size];
+		size_t index;
+		while (!failed && (index = next_slice++) < slices.size()) {
+			const CopySlice& slice = slices[index];
+			FileHandle source = openForRead(slice.segment->file);
+			if (source == INVALID_FILE) {
+				string reason = lastIoError();
+				std::lock_guard<std::mutex> guard(progress_lock);
+				if (!failed) {
+					error = "could not open '" + slice.segment->file.string() + "': " + reason;
+				}
+				failed = true;
+				break;
+			}
+
+			uint64_t reported = 0;
+			bool ok = copyRange(engine, source, slice.start, merged, slice.segment->offset + slice.start, slice.length,
+				buffer, buffer_size, [&](uint64_t copied) {
+					uint64_t total = total_copied += copied - reported;
+					reported = copied;
+					std::lock_guard<std::mutex> guard(progress_lock);
+					progress(total);
+				});
+			closeFile(source);
+
+			if (!ok) {
+				string reason = lastIoError();
+				std::lock_guard<std::mutex> guard(progress_lock);
+				if (!failed) {
+					error = "copy of " + slice.segment->label + " failed at offset " + std::to_string(slice.start + reported) + ": " + reason;
+				}
+				failed = true;
+			}
+		}
+		delete[] buffer;
+	};
+
+	vector<std::thread> pool;
+	for (unsigned i = 0; i < threads; i++) {
+		pool.emplace_back(worker);
+	}
+	for (auto & thread : pool) {
+		thread.join();
+	}
+
+	return !failed;
+}
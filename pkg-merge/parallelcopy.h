@@ -0,0 +1,19 @@
+// parallelcopy.h : copy all segments of a merge into a preallocated output at the same time
+//
+
+#pragma once
+
+#include "copyengine.h"
+#include <string>
+#include <vector>
+
+// Default worker count for --parallel without a value
+unsigned defaultParallelThreads();
+
+// Copies every segment into `merged` at its offset using `threads` workers with their own buffers.
+// Segments larger than a slice are split so even a single huge root part keeps several streams busy.
+// `merged` must already be sized (see preallocateFile). `progress` receives the total bytes copied
+// across all workers and is called from worker threads, one at a time. Returns false on the first I/O error,
+// which `error` then describes.
+bool copySegmentsParallel(const std::vector<MergeSegment>& segments, FileHandle merged, CopyEngine engine,
+	size_t buffer_size, unsigned threads, const CopyProgress& progress, std::string& error);
@@ -0,0 +1,146 @@
+// pkgheader.cpp : PS4 PKG header parsing and pre-flight checks of a part set
+//
+
+#include "stdafx.h"
+#include "pkgheader.h"
+#include <algorithm>
+#include <string.h>
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+
+static uint32_t readBig32(const unsigned char* data) {
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static uint64_t readBig64(const unsigned char* data) {
+	return ((uint64_t)readBig32(data) << 32) | readBig32(data + 4);
+}
+
+bool readPkgHeader(const fs::path& root_file, PkgHeader& header, string& error) {
+	unsigned char raw[PKG_HEADER_SIZE];
+	FileHandle root = openForRead(root_file);
+	if (root == INVALID_FILE) {
+		error = "could not open root piece: " + lastIoError();
+		return false;
+	}
+	int64_t got = readAt(root, raw, sizeof(raw), 0);
+	closeFile(root);
+	return parsePkgHeader(raw, got < 0 ? 0 : (size_t)got, header, error);
+}
+
+bool parsePkgHeader(const unsigned char* raw, size_t size, PkgHeader& header, string& error) {
+	if (size < PKG_HEADER_SIZE) {
+		error = "root piece is too small to hold a PKG header";
+		return false;
+	}
+	if (memcmp(raw, PKG_MAGIC, sizeof(PKG_MAGIC)) != 0) {
+		error = "root piece doesn't start with the PKG magic";
+		return false;
+	}
+
+	header.type = readBig32(raw + 0x04);
+	header.entry_count = readBig32(raw + 0x10);
+	header.entry_table_offset = readBig32(raw + 0x18);
+	header.body_offset = readBig64(raw + 0x20);
+	header.body_size = readBig64(raw + 0x28);
+	header.content_offset = readBig64(raw + 0x30);
+	header.content_size = readBig64(raw + 0x38);
+	header.content_id.assign((const char*)raw + 0x40, strnlen((const char*)raw + 0x40, 0x24));
+	header.package_size = readBig64(raw + 0x430);
+	if (size >= PKG_DIGEST_HEADER_SIZE) {
+		memcpy(header.body_digest, raw + 0x160, sizeof(header.body_digest));
+		header.pfs_image_offset = readBig64(raw + 0x410);
+		header.pfs_image_size = readBig64(raw + 0x418);
+		header.pfs_signed_size = readBig32(raw + 0x438);
+		memcpy(header.pfs_image_digest, raw + 0x440, sizeof(header.pfs_image_digest));
+		memcpy(header.pfs_signed_digest, raw + 0x460, sizeof(header.pfs_signed_digest));
+	}
+	return true;
+}
+
+vector<PkgEntry> parsePkgEntries(const unsigned char* raw, uint32_t count) {
+	vector<PkgEntry> entries(count);
+	for (uint32_t i = 0; i < count; i++) {
+		const unsigned char* row = raw + (size_t)i * PKG_ENTRY_SIZE;
+		entries[i].id = readBig32(row);
+		entries[i].name_offset = readBig32(row + 0x04);
+		entries[i].flags1 = readBig32(row + 0x08);
+		entries[i].flags2 = readBig32(row + 0x0C);
+		entries[i].offset = readBig32(row + 0x10);
+		entries[i].size = readBig32(row + 0x14);
+	}
+	return entries;
+}
+
+const char* pkgEntryName(uint32_t id) {
+	switch (id) {
+	case 0x0001: return "digests";
+	case 0x0010: return "entry_keys";
+	case 0x0020: return "image_key";
+	case 0x0080: return "general_digests";
+	case 0x0100: return "metas";
+	case 0x0200: return "entry_names";
+	case 0x0400: return "license.dat";
+	case 0x0401: return "license.info";
+	case 0x0409: return "psreserved.dat";
+	case 0x1000: return "param.sfo";
+	case 0x1001: return "playgo-chunk.dat";
+	case 0x1002: return "playgo-chunk.sha";
+	case 0x1003: return "playgo-manifest.xml";
+	case 0x1006: return "pic1.png";
+	case 0x1200: return "icon0.png";
+	case 0x1220: return "pic0.png";
+	case 0x1240: return "snd0.at9";
+	case 0x1260: return "changeinfo/changeinfo.xml";
+	default: return nullptr;
+	}
+}
+
+bool preflightPackage(const Package& pkg, PkgHeader& header, vector<string>& problems) {
+	size_t problems_before = problems.size();
+	string error;
+	if (!readPkgHeader(pkg.file, header, error)) {
+		problems.push_back(error);
+		return false;
+	}
+
+	// Pieces have to count up from _1 without holes
+	vector<int> numbers;
+	for (auto & part : pkg.parts) {
+		numbers.push_back(part.part);
+	}
+	std::sort(numbers.begin(), numbers.end());
+	int expected = 1;
+	for (int number : numbers) {
+		for (; expected < number; expected++) {
+			problems.push_back("piece _" + std::to_string(expected) + " is missing");
+		}
+		expected = number + 1;
+	}
+
+	PkgPartSet part_set(pkg);
+	uint64_t total = part_set.size();
+	if (header.package_size == 0) {
+		problems.push_back("header doesn't declare a package size");
+	} else if (total < header.package_size) {
+		problems.push_back("pieces add up to " + std::to_string(total) + " bytes but the header declares " +
+			std::to_string(header.package_size) + " (" + std::to_string(header.package_size - total) + " missing, incomplete download?)");
+	} else if (total > header.package_size) {
+		problems.push_back("pieces add up to " + std::to_string(total) + " bytes, " + std::to_string(total - header.package_size) +
+			" more than the " + std::to_string(header.package_size) + " the header declares");
+	}
+
+	// Tables the header points at have to lie inside the package it describes
+	if (header.package_size > 0) {
+		if (header.entry_table_offset >= header.package_size) {
+			problems.push_back("entry table offset " + std::to_string(header.entry_table_offset) + " is past the end of the package");
+		}
+		if (header.body_offset + header.body_size > header.package_size) {
+			problems.push_back("body (" + std::to_string(header.body_offset) + " + " + std::to_string(header.body_size) +
+				" bytes) extends past the end of the package");
+		}
+	}
+	return problems.size() == problems_before;
+}
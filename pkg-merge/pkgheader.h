@@ -0,0 +1,69 @@
+// pkgheader.h : PS4 PKG header parsing and pre-flight checks of a part set
+//
+
+#pragma once
+
+#include "pkgparts.h"
+#include <string>
+#include <vector>
+
+// Fields of the (big endian) PKG header at the start of the root piece that say how big the package is
+struct PkgHeader {
+	uint32_t	type;
+	uint32_t	entry_count;
+	uint32_t	entry_table_offset;
+	uint64_t	body_offset;
+	uint64_t	body_size;
+	uint64_t	content_offset;
+	uint64_t	content_size;
+	std::string	content_id;			// e.g. "UP0000-CUSA00000_00-0000000000000000"
+	uint64_t	package_size;		// Size of the whole merged PKG
+	// Only filled in from a PKG_DIGEST_HEADER_SIZE read (--verify); all zero digests mean none was stored
+	uint8_t		body_digest[32];	// SHA-256 of the body
+	uint64_t	pfs_image_offset;
+	uint64_t	pfs_image_size;
+	uint32_t	pfs_signed_size;	// Leading bytes of the PFS image covered by pfs_signed_digest
+	uint8_t		pfs_image_digest[32];
+	uint8_t		pfs_signed_digest[32];
+	PkgHeader() : type(0), entry_count(0), entry_table_offset(0), body_offset(0), body_size(0),
+		content_offset(0), content_size(0), package_size(0), body_digest(), pfs_image_offset(0), pfs_image_size(0),
+		pfs_signed_size(0), pfs_image_digest(), pfs_signed_digest() {}
+};
+
+// Bytes of the root piece the header occupies, up to and including the package size
+const size_t PKG_HEADER_SIZE = 0x440;
+// Bytes up to the end of the PFS image digests
+const size_t PKG_DIGEST_HEADER_SIZE = 0x480;
+
+// Parses the `size` header bytes at `raw`: everything up to the package size, and the digests as well when
+// `size` reaches PKG_DIGEST_HEADER_SIZE. Returns false with `error` filled in if they can't hold a PKG header.
+bool parsePkgHeader(const unsigned char* raw, size_t size, PkgHeader& header, std::string& error);
+
+// One row of the entry table at entry_table_offset
+struct PkgEntry {
+	uint32_t	id;
+	uint32_t	name_offset;		// Into the data of the PKG_ENTRY_NAMES entry, 0 for unnamed entries
+	uint32_t	flags1;
+	uint32_t	flags2;
+	uint32_t	offset;				// Position of the entry's data in the PKG
+	uint32_t	size;
+	bool encrypted() const { return (flags1 & 0x80000000) != 0; }
+};
+
+const size_t PKG_ENTRY_SIZE = 32;
+const uint32_t PKG_ENTRY_DIGESTS = 0x0001;		// SHA-256 of every entry, in table order
+const uint32_t PKG_ENTRY_NAMES = 0x0200;
+
+// Parses `count` rows of the entry table at `raw`
+std::vector<PkgEntry> parsePkgEntries(const unsigned char* raw, uint32_t count);
+// File name of a well-known entry ("param.sfo", "icon0.png"), nullptr for the rest
+const char* pkgEntryName(uint32_t id);
+
+// Reads the header from the start of `root_file`. Returns false with `error` filled in if it can't be read
+// or doesn't start with PKG_MAGIC.
+bool readPkgHeader(const std::filesystem::path& root_file, PkgHeader& header, std::string& error);
+
+// Checks a part set against its root's header before anything is written: pieces numbered 1..N without
+// gaps, and root + pieces + _sc adding up to the declared package size. Every problem found is appended to
+// `problems`; returns true if there are none.
+bool preflightPackage(const Package& pkg, PkgHeader& header, std::vector<std::string>& problems);
@@ -3,67 +3,26 @@
 // Improved performance speed from bigger parts files
 
 #include "stdafx.h"
+#include "merger.h"
+#include "concatreader.h"
+#include "watch.h"
+#include "bench.h"
+#include "split.h"
+#include "service.h"
 #include <stdio.h>
 #include <string>
 #include <iostream>
-#include <fstream>
 #include <filesystem>
-#include <map>
-#include <list>
-#include <assert.h>
 #include <algorithm>
 #include <cctype>
+#include <string.h>
+#include <memory>
 
 namespace fs = std::filesystem;
 using std::string;
 using std::map;
 using std::vector;
 
-struct Package {
-	int					part;
-	fs::path			file;
-	vector<Package>		parts;
-	Package*			sc_part;		// Special _sc file
-	string				output_name;	// Custom output name if _sc file exists
-	bool operator < (const Package& rhs) const {
-		return part < rhs.part;
-	}
-	Package() : sc_part(nullptr), part(0) {}
-};
-
-const char PKG_MAGIC[4] = { 0x7F, 0x43, 0x4E, 0x54 };
-
-// Helper function to convert string to lowercase for case-insensitive comparison
-string toLower(const string& str) {
-	string result = str;
-	std::transform(result.begin(), result.end(), result.begin(),
-		[](unsigned char c) { return std::tolower(c); });
-	return result;
-}
-
-// Helper function to check if string ends with a specific suffix
-bool endsWith(const string& str, const string& suffix) {
-	if (suffix.length() > str.length()) return false;
-	return str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
-}
-
-// Helper function to remove leading and trailing quotes from path strings
-string cleanPathString(const string& path) {
-	string result = path;
-	
-	// Remove leading quote
-	if (!result.empty() && result.front() == '\"') {
-		result.erase(0, 1);
-	}
-	
-	// Remove trailing quote
-	if (!result.empty() && result.back() == '\"') {
-		result.erase(result.length() - 1, 1);
-	}
-	
-	return result;
-}
-
 // Helper function to split merged arguments when trailing backslash causes quote escaping
 bool splitMergedArguments(const string& merged, string& source, string& target) {
 	// Look for the pattern: path" path (quote in the middle with space)
@@ -83,154 +42,264 @@ bool splitMergedArguments(const string& merged, string& source, string& target)
 	return false;
 }
 
-vector<string> merge(map<string, Package> packages, const fs::path& target_dir) {
-	vector<string> created_files;
-
-	// Calculate optimal buffer size based on available files
-	// Start with 512 KB minimum, but scale up for large files
-	size_t max_file_size = 0;
-	for (auto & root : packages) {
-		auto pkg = root.second;
-		// Check all parts for the largest file
-		for (auto & part : pkg.parts) {
-			size_t part_size = fs::file_size(part.file);
-			if (part_size > max_file_size) {
-				max_file_size = part_size;
-			}
-		}
-		// Check _sc file if exists
-		if (pkg.sc_part != nullptr) {
-			size_t sc_size = fs::file_size(pkg.sc_part->file);
-			if (sc_size > max_file_size) {
-				max_file_size = sc_size;
-			}
-		}
+// Writes `length` bytes at `offset` of a merged PKG to stdout, read straight from the pieces in `source_path`.
+// Without a title the folder is grouped like -single, otherwise like -multiple and the title picks the group.
+int readMerged(const fs::path& source_path, uint64_t offset, uint64_t length, const string& title) {
+	if (!fs::is_directory(source_path)) {
+		fprintf(stderr, "[error] source directory '%s' does not exist\n", source_path.string().c_str());
+		return 1;
 	}
 
-	// Adaptive buffer sizing strategy
-	size_t BUFFER_SIZE;
-	if (max_file_size < 200 * 1024 * 1024) {
-		BUFFER_SIZE = 512 * 1024;  // 512 KB
-		printf("[Performance info] Using 512 KB buffer for small files\n");
-	} else if (max_file_size < 1024 * 1024 * 1024) {
-		BUFFER_SIZE = 2 * 1024 * 1024;  // 2 MB
-		printf("[Performance info] Using 2 MB buffer for medium files\n");
-	} else if (max_file_size < 4ULL * 1024 * 1024 * 1024) {
-		BUFFER_SIZE = 4 * 1024 * 1024;  // 4 MB
-		printf("[Performance info] Using 4 MB buffer for large files\n");
-	} else {
-		BUFFER_SIZE = 8 * 1024 * 1024;  // 8 MB
-		printf("[Performance info] Using 8 MB buffer for huge files (>4GB)\n");
+	map<string, Package> packages;
+	if (!scanPackages(source_path, title.empty(), stderr, packages)) {
+		return 1;
 	}
 
-	// Allocate buffer ONCE on heap, reuse for all files
-	char* buffer = new char[BUFFER_SIZE];
-
-	for (auto & root : packages) {
-		auto pkg = root.second;
-
-		// Before we start, we need to sort the lists properly
-		std::sort(pkg.parts.begin(), pkg.parts.end());
+	auto it = title.empty() ? packages.begin() : packages.find(title);
+	if (it == packages.end()) {
+		fprintf(stderr, "[error] no package '%s' in '%s'\n", title.c_str(), source_path.string().c_str());
+		return 1;
+	}
 
-		size_t pieces = pkg.parts.size();
-		
-		// Add _sc file to the count if it exists
-		if (pkg.sc_part != nullptr) {
-			pieces++;
+	ConcatReader reader{ PkgPartSet(it->second) };
+	if (!reader.open()) {
+		fprintf(stderr, "[error] could not open the pieces of %s: %s\n", it->first.c_str(), lastIoError().c_str());
+		return 1;
+	}
+	if (offset >= reader.size()) {
+		fprintf(stderr, "[error] offset %llu is past the end of %s (%llu bytes)\n",
+			(unsigned long long)offset, it->first.c_str(), (unsigned long long)reader.size());
+		return 1;
+	}
+	length = std::min(length, reader.size() - offset);
+
+	setStdoutBinary();
+	const size_t CHUNK_SIZE = 8 * 1024 * 1024;
+	vector<char> buffer((size_t)std::min<uint64_t>(length, CHUNK_SIZE));
+	for (uint64_t done = 0; done < length;) {
+		size_t chunk = (size_t)std::min<uint64_t>(length - done, CHUNK_SIZE);
+		if (reader.pread(buffer.data(), chunk, offset + done) != (int64_t)chunk) {
+			fprintf(stderr, "[error] read failed at offset %llu: %s\n", (unsigned long long)(offset + done), lastIoError().c_str());
+			return 1;
 		}
-		
-		auto title_id = root.first.c_str();
-
-		printf("[work] beginning to merge %d %s for package %s...\n", pieces, pieces == 1 ? "piece" : "pieces", title_id);
-
-		// Use custom output name if _sc file exists, otherwise use title_id
-		string merged_file_name;
-		if (!pkg.output_name.empty()) {
-			merged_file_name = pkg.output_name + "-merged.pkg";
-			printf("[info] using custom output name from _sc file: %s\n", merged_file_name.c_str());
-		} else {
-			merged_file_name = root.first + "-merged.pkg";
+		if (fwrite(buffer.data(), 1, chunk, stdout) != chunk) {
+			fprintf(stderr, "[error] could not write to stdout\n");
+			return 1;
 		}
-		
-		string full_merged_file = target_dir.string() + "\\" + merged_file_name;
+		done += chunk;
+	}
+	fflush(stdout);
+	return 0;
+}
 
-		if (fs::exists(full_merged_file)) {
-			fs::remove(full_merged_file);
+int main(int argc, char *argv[])
+{
+	string source_dir;
+	string target_dir;
+	string mode = "-single";  // Default mode
+	MergeOptions options;
+
+	// --submit hands the merge to a running -serve instead of doing it here; it and --priority are the
+	// client's own, everything else goes to the service as it was typed
+	bool submit = false;
+	string submit_socket = defaultServiceSocket();
+	long priority = 0;
+	vector<string> arguments;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		string name = toLower(arg.substr(0, arg.find('=')));
+		if (name == "--submit") {
+			submit = true;
+			if (arg.find('=') != string::npos) submit_socket = cleanPathString(arg.substr(arg.find('=') + 1));
+		} else if (name == "--priority") {
+			string value = arg.find('=') != string::npos ? arg.substr(arg.find('=') + 1) : i + 1 < argc ? string(argv[++i]) : string();
+			char* end = NULL;
+			priority = strtol(value.c_str(), &end, 10);
+			if (value.empty() || *end != '\0' || priority < -1000 || priority > 1000) {
+				printf("[error] Invalid priority '%s'. Must be a number between -1000 and 1000\n", value.c_str());
+				return 1;
+			}
+		} else {
+			arguments.push_back(arg);
 		}
+	}
 
-		printf("\t[work] copying root package file to new file...");
-		auto merged_file = fs::path(full_merged_file);
+	// Pull "--" options out first so the positional argument handling below stays as it was
+	vector<string> positional_args;
+	if (!parseArguments(arguments, options, positional_args)) return 1;
+	if (submit) {
+		std::cout << "PKG-merge version 1.1 by xZenithy forked from Tustin master repo" << std::endl;
+		std::cout << std::endl;
+		return submitMerge(submit_socket, arguments, (int)priority);
+	}
+	vector<char*> positional;
+	positional.push_back(argv[0]);
+	for (auto & arg : positional_args) {
+		positional.push_back(&arg[0]);
+	}
+	argc = (int)positional.size();
+	argv = positional.data();
+
+	// A target of "-" (stdout) or "fd:N" streams the merged PKG instead of writing a file. For stdout every
+	// message has to move to stderr before the first one is printed.
+	string stream_target = argc == 3 || argc == 4 ? string(argv[2]) : string();
+	bool stream = stream_target == "-" || toLower(stream_target).compare(0, 3, "fd:") == 0;
+	FileHandle stream_out = INVALID_FILE;
+	if (stream_target == "-") {
+		stream_out = takeOverStdout();
+	} else if (stream) {
+		stream_out = handleFromDescriptor(atoi(stream_target.c_str() + 3));
+	}
 
-		// Deal with root file first
-		fs::copy_file(pkg.file, merged_file, fs::copy_options::update_existing);
-		printf("done\n");
+	if (!validateOptions(options, stream)) return 1;
 
-		// Using C API from here on because it just works and is fast
-		FILE *merged = fopen(full_merged_file.c_str(), "a+b");
+	// Both apply process-wide, before any copy thread exists
+	setMaxRate(options.max_rate);
+	if (!setIoPriority(options.io_priority)) {
+		printf("[warn] could not lower the I/O priority: %s\n", lastIoError().c_str());
+	}
 
-		// Now all the regular pieces...
-		for (auto & part : pkg.parts) {
-			FILE *to_merge = fopen(part.file.string().c_str(), "r+b");
+	std::unique_ptr<MetricsRecorder> metrics;
+	if (!options.metrics_file.empty()) {
+		metrics.reset(new MetricsRecorder());
+		options.metrics = metrics.get();
+	}
 
-			auto total_size = fs::file_size(part.file);
-			assert(total_size != 0);
-			uintmax_t copied = 0;
+	// -read writes PKG bytes to stdout, so it has to run before anything else is printed there
+	if (argc >= 5 && toLower(argv[1]) == "-read") {
+		return readMerged(fs::path(cleanPathString(argv[2])), strtoull(argv[3], NULL, 10), strtoull(argv[4], NULL, 10),
+			argc >= 6 ? string(argv[5]) : string());
+	}
+	// Same for the JSON report of -bench-merge
+	if (argc >= 3 && toLower(argv[1]) == "-bench-merge") {
+		uint64_t size_mb = argc >= 4 ? strtoull(argv[3], NULL, 10) : 0;
+		unsigned pieces = argc >= 5 ? (unsigned)strtoul(argv[4], NULL, 10) : 0;
+		bool with_sc = argc >= 6 && toLower(argv[5]) == "sc";
+		return runMergeBenchmark(fs::path(cleanPathString(argv[2])), size_mb == 0 ? 1024 : size_mb, pieces == 0 ? 8 : pieces, with_sc);
+	}
 
-			size_t read_data;
-			while ((read_data = fread(buffer, 1, BUFFER_SIZE, to_merge)) > 0)
-			{
-				fwrite(buffer, 1, read_data, merged);
-				copied += read_data;
-				auto percentage = ((double)copied / (double)total_size) * 100;
-				printf("\r\t[work] merged %llu/%llu bytes (%.0lf%%) for part %d...", copied, total_size, percentage, part.part);
-			}
-			fclose(to_merge);
+	std::cout << "PKG-merge version 1.1 by xZenithy forked from Tustin master repo" << std::endl;
+	std::cout << std::endl;
 
-			printf("done\n");
+	if (argc >= 6 && toLower(argv[1]) == "-generate") {
+		fs::path dir = fs::path(cleanPathString(argv[2]));
+		uint64_t size_mb = strtoull(argv[4], NULL, 10);
+		unsigned pieces = (unsigned)strtoul(argv[5], NULL, 10);
+		bool with_sc = argc >= 7 && toLower(argv[6]) == "sc";
+		if (!fs::is_directory(dir) || size_mb == 0 || pieces == 0) {
+			printf("[error] usage: pkg-merge.exe -generate \"Folder\" <name> <size in MB> <pieces> [sc]\n");
+			return 1;
 		}
+		printf("[work] writing %llu MB split set '%s' in %u pieces to %s...\n", (unsigned long long)size_mb, argv[3], pieces, dir.string().c_str());
+		if (!generateSplitSet(dir, argv[3], size_mb * 1024 * 1024, pieces, with_sc)) {
+			printf("[error] could not write the split set: %s\n", lastIoError().c_str());
+			return 1;
+		}
+		printf("[success] completed\n");
+		return 0;
+	}
 
-		// Now merge the _sc file as the last part if it exists
-		if (pkg.sc_part != nullptr) {
-			FILE *to_merge = fopen(pkg.sc_part->file.string().c_str(), "r+b");
-
-			auto total_size = fs::file_size(pkg.sc_part->file);
-			assert(total_size != 0);
-			uintmax_t copied = 0;
+	if (argc >= 3 && toLower(argv[1]) == "-check") {
+		fs::path check_path = fs::path(cleanPathString(argv[2]));
+		string check_mode = argc >= 4 ? toLower(argv[3]) : "-single";
+		if (!fs::is_directory(check_path)) {
+			printf("[error] source directory '%s' does not exist\n", check_path.string().c_str());
+			return 1;
+		}
+		map<string, Package> packages;
+		if (!scanPackages(check_path, check_mode != "-multiple", stdout, packages)) {
+			return 1;
+		}
+		size_t failed = 0;
+		for (auto & package : packages) {
+			if (!preflightReport(package.first, package.second, options)) failed++;
+		}
+		if (failed > 0) {
+			printf("\n[error] %zu of %zu packages can't be merged as they are\n", failed, packages.size());
+			return 1;
+		}
+		printf("\n[success] %zu %s ready to merge\n", packages.size(), packages.size() == 1 ? "package is" : "packages are");
+		return 0;
+	}
 
-			size_t read_data;
-			while ((read_data = fread(buffer, 1, BUFFER_SIZE, to_merge)) > 0)
-			{
-				fwrite(buffer, 1, read_data, merged);
-				copied += read_data;
-				auto percentage = ((double)copied / (double)total_size) * 100;
-				printf("\r\t[work] merged %llu/%llu bytes (%.0lf%%) for _sc part (final)...", copied, total_size, percentage);
+	if (argc >= 3 && toLower(argv[1]) == "-verify") {
+		fs::path verify_path = fs::path(cleanPathString(argv[2]));
+		size_t failed = 0;
+		size_t verified = 0;
+		if (fs::is_regular_file(verify_path)) {
+			verified = 1;
+			if (!verifyMerged(verify_path, options)) failed++;
+		} else if (fs::is_directory(verify_path)) {
+			// Straight from the pieces, before anything is merged
+			string verify_mode = argc >= 4 ? toLower(argv[3]) : "-single";
+			map<string, Package> packages;
+			if (!scanTimed(verify_path, verify_mode != "-multiple", packages, options)) {
+				writeMetrics(options);
+				return 1;
 			}
-			fclose(to_merge);
-
-			printf("done\n");
+			for (auto & package : packages) {
+				verified++;
+				if ((options.preflight && !preflightReport(package.first, package.second, options)) ||
+					!verifyReport(package.first, PkgPartSet(package.second), options)) {
+					failed++;
+				}
+			}
+		} else {
+			printf("[error] '%s' is neither a merged PKG nor a folder of pieces\n", verify_path.string().c_str());
+			return 1;
 		}
-
-		fclose(merged);
-
-		// Add the created file to the list
-		created_files.push_back(full_merged_file);
+		writeMetrics(options);
+		if (failed > 0) {
+			printf("\n[error] %zu of %zu packages failed verification\n", failed, verified);
+			return 1;
+		}
+		printf("\n[success] %zu %s verified\n", verified, verified == 1 ? "package" : "packages");
+		return 0;
 	}
 
-	// Free buffer once at the end
-	delete[] buffer;
-
-	return created_files;
-}
-
-int main(int argc, char *argv[])
-{
-	string source_dir;
-	string target_dir;
-	string mode = "-single";  // Default mode
+	if (argc >= 2 && toLower(argv[1]) == "-split") {
+		uint64_t piece_size = 0;
+		if (argc < 5 || !parsePieceSize(argv[4], piece_size)) {
+			printf("[error] usage: pkg-merge.exe -split \"Title-merged.pkg\" \"Target Folder\" <piece size, e.g. 4G or fat32> [sc]\n");
+			return 1;
+		}
+		fs::path merged_file = fs::path(cleanPathString(argv[2]));
+		fs::path split_dir = fs::path(cleanPathString(argv[3]));
+		if (!fs::is_regular_file(merged_file)) {
+			printf("[error] merged PKG '%s' does not exist\n", merged_file.string().c_str());
+			return 1;
+		}
+		if (!fs::is_directory(split_dir)) {
+			printf("[error] target directory '%s' does not exist\n", split_dir.string().c_str());
+			return 1;
+		}
+		if (options.hash || options.resume || options.direct || options.watch || options.in_place || options.sparse || options.delta) {
+			printf("[error] -split only takes --engine, --parallel, --max-rate, --io-priority, --no-check and --metrics-json\n");
+			return 1;
+		}
+		bool split = splitPackage(merged_file, split_dir, piece_size, argc >= 6 && toLower(argv[5]) == "sc", options);
+		writeMetrics(options);
+		if (!split) {
+			return 1;
+		}
+		printf("\n[success] completed\n");
+		return 0;
+	}
 
-	std::cout << "PKG-merge version 1.1 by xZenithy forked from Tustin master repo" << std::endl;
-	std::cout << std::endl;
+	if (argc >= 2 && toLower(argv[1]) == "-serve") {
+		if (options.hash || options.resume || options.direct || options.watch || options.in_place || options.sparse || options.delta ||
+			options.verify || options.parallel > 0 || options.engine != CopyEngine::Auto || !options.metrics_file.empty()) {
+			printf("[error] -serve only takes --jobs, --hdd-jobs, --ssd-jobs, --max-rate, --io-priority and --queue-depth,\n");
+			printf("        the other options come with each merge request\n");
+			return 1;
+		}
+		return runService(argc >= 3 ? cleanPathString(argv[2]) : defaultServiceSocket(), options);
+	}
 
+	if (argc >= 3 && toLower(argv[1]) == "-bench") {
+		uint64_t size_mb = argc >= 4 ? strtoull(argv[3], NULL, 10) : 1024;
+		return runHashBenchmark(fs::path(cleanPathString(argv[2])), size_mb == 0 ? 1024 : size_mb);
+	}
 
 #ifndef _DEBUG
 	// Check if arguments were merged due to trailing backslash before quote
@@ -263,8 +332,35 @@ int main(int argc, char *argv[])
 			std::cout << "\nArguments:" << std::endl;
 			std::cout << "  Source Folder : Path to folder containing PKG files to merge (required)" << std::endl;
 			std::cout << "  Target Folder : Path to folder where merged files will be created (required)" << std::endl;
-			std::cout << "                  Use \".\" for current directory" << std::endl;
+			std::cout << "                  Use \".\" for current directory, \"-\" to stream the PKG to stdout" << std::endl;
+			std::cout << "                  or \"fd:N\" to stream it to an inherited file descriptor" << std::endl;
+			std::cout << "                  \"Folder1;Folder2\" writes every output to each folder, reading the pieces once" << std::endl;
 			std::cout << "  mode          : Merge mode - \"-single\" or \"-multiple\" (optional, default: -single)" << std::endl;
+			std::cout << "\nOptions:" << std::endl;
+			std::cout << "  --engine=NAME : Copy engine - auto, copy_file_range, splice, buffered, io_uring or reflink (default: auto)" << std::endl;
+			std::cout << "                  auto tries the in-kernel engines first and falls back per file," << std::endl;
+			std::cout << "                  and clones extents when source and target share an XFS/Btrfs filesystem" << std::endl;
+			std::cout << "  --queue-depth=N: Reads and writes kept in flight by the io_uring engine (default: 4)" << std::endl;
+			std::cout << "  --parallel[=N]: Preallocate the output and copy all pieces into place with N streams" << std::endl;
+			std::cout << "  --jobs N      : Merge up to N packages at the same time in -multiple mode (default: 1)" << std::endl;
+			std::cout << "  --hdd-jobs=N  : Of those, merges reading or writing one spinning disk at the same time (default: 1)" << std::endl;
+			std::cout << "  --ssd-jobs=N  : Same for a solid-state disk (default: 4)" << std::endl;
+			std::cout << "  --hash        : Compute SHA-256 and XXH64 while merging and write <output>.manifest" << std::endl;
+			std::cout << "  --resume      : Continue an interrupted merge from its <output>.journal" << std::endl;
+			std::cout << "  --no-journal  : Don't keep <output>.journal, a failed merge then starts over" << std::endl;
+			std::cout << "  --watch       : Merge pieces as they finish downloading, the output is ready right after the last one" << std::endl;
+			std::cout << "  --no-check    : Merge even when the pieces don't match the PKG header (missing or extra bytes)" << std::endl;
+			std::cout << "  --direct      : Bypass the page cache (O_DIRECT / unbuffered I/O) so other programs keep their cache" << std::endl;
+			std::cout << "  --in-place[=delete]: Rename the root part to the output and append the rest to it (same filesystem)," << std::endl;
+			std::cout << "                  =delete removes each piece once it's safely merged, for nearly full disks" << std::endl;
+			std::cout << "  --sparse      : Don't write zero-filled blocks and holes of the pieces, leave them as holes in the output" << std::endl;
+			std::cout << "  --delta       : Keep an existing output and only rewrite the 1 MB blocks that changed" << std::endl;
+			std::cout << "  --max-rate=N  : Copy at most N bytes per second in all, e.g. 50M or 1.5G (shared by --jobs and --parallel)" << std::endl;
+			std::cout << "  --io-priority=low|idle: Let other programs' disk I/O go first (ioprio_set / background mode)" << std::endl;
+			std::cout << "  --verify      : Check every merged PKG against the SHA-256 digests stored in it, on all cores" << std::endl;
+			std::cout << "  --metrics-json=FILE: Write the timings of the scan, every check, merge and piece to FILE as JSON" << std::endl;
+			std::cout << "  --submit[=SOCKET]: Hand the merge to a running -serve and print its progress" << std::endl;
+			std::cout << "  --priority=N  : With --submit, run ahead of queued merges with a lower N (default: 0)" << std::endl;
 			std::cout << "\nMerge Modes:" << std::endl;
 			std::cout << "  Single   : Merges all PKG files into one output file" << std::endl;
 			std::cout << "             - If file ending with _sc exists, uses its name for output" << std::endl;
@@ -275,6 +371,23 @@ int main(int argc, char *argv[])
 			std::cout << "             - Example: file_1.pkg, file_2.pkg, file_sc.pkg -> file-merged.pkg" << std::endl;
 			std::cout << "                        other_1.pkg, other_2.pkg, other_sc.pkg -> other-merged.pkg" << std::endl;
 			std::cout << "             - Multiple _sc files allowed (one per group)" << std::endl;
+			std::cout << "\n  Check    : pkg-merge.exe -check \"Source Folder\" [mode]" << std::endl;
+			std::cout << "             - Checks every part set against its PKG header without merging" << std::endl;
+			std::cout << "\n  Verify   : pkg-merge.exe -verify \"Title-merged.pkg\" | \"Source Folder\" [mode]" << std::endl;
+			std::cout << "             - Checks the entry, body and PFS image digests of a merged PKG, or of every set of pieces" << std::endl;
+			std::cout << "\n  Split    : pkg-merge.exe -split \"Title-merged.pkg\" \"Target Folder\" <piece size> [sc]" << std::endl;
+			std::cout << "             - Cuts a merged PKG into Title_0.pkg, Title_1.pkg, ... of the given size (e.g. 4G, 1500M or fat32)" << std::endl;
+			std::cout << "             - sc names the last piece Title_sc.pkg; pieces are written with --parallel streams (default: per core)" << std::endl;
+			std::cout << "\n  Service  : pkg-merge.exe -serve [socket] [--jobs N] [--hdd-jobs=N] [--ssd-jobs=N] [--max-rate=N] [--io-priority=...]" << std::endl;
+			std::cout << "             - Runs merges sent with --submit from a local queue, same merges requested twice run once" << std::endl;
+			std::cout << "\n  Benchmark: pkg-merge.exe -bench \"Scratch Folder\" [size in MB]" << std::endl;
+			std::cout << "             - Measures the cost of --hash against a plain copy" << std::endl;
+			std::cout << "  pkg-merge.exe -bench-merge \"Scratch Folder\" [size in MB] [pieces] [sc]" << std::endl;
+			std::cout << "             - Merges a synthetic set with every engine and buffer size, JSON report on stdout" << std::endl;
+			std::cout << "  pkg-merge.exe -generate \"Folder\" <name> <size in MB> <pieces> [sc]" << std::endl;
+			std::cout << "             - Writes a synthetic split PKG set for testing" << std::endl;
+			std::cout << "\n  Read     : pkg-merge.exe -read \"Source Folder\" <offset> <length> [title] > out.bin" << std::endl;
+			std::cout << "             - Writes a byte range of the merged PKG to stdout without merging it" << std::endl;
 			std::cout << "\nExamples:" << std::endl;
 			std::cout << "  pkg-merge.exe \"C:\\My Documents\\PKGs\" \"C:\\Output Folder\"" << std::endl;
 			std::cout << "  pkg-merge.exe C:\\PKGs . -single" << std::endl;
@@ -309,273 +422,85 @@ int main(int argc, char *argv[])
 
 	printf("[info] Merge mode: %s\n", mode.c_str());
 
-	// Handle "." for current directory
+	if (stream) {
+		if (stream_out == INVALID_FILE) {
+			printf("[error] can't stream to '%s': not an open file descriptor\n", target_dir.c_str());
+			return 1;
+		}
+		if (!fs::is_directory(fs::path(source_dir))) {
+			printf("[error] source directory '%s' does not exist\n", source_dir.c_str());
+			return 1;
+		}
+		map<string, Package> packages;
+		if (!scanTimed(fs::path(source_dir), mode == "-single", packages, options)) {
+			return 1;
+		}
+		if (packages.size() != 1) {
+			printf("[error] a stream holds one package, found %zu. Pick one folder per stream\n", packages.size());
+			return 1;
+		}
+		auto & package = *packages.begin();
+		if (options.preflight && !preflightReport(package.first, package.second, options)) {
+			printf("[error] not streaming package %s (use --no-check to stream it anyway)\n", package.first.c_str());
+			return 1;
+		}
+		bool streamed = streamPackage(package.first, package.second, stream_out, options);
+		writeMetrics(options);
+		if (!streamed) {
+			return 1;
+		}
+		printf("\n[success] completed\n");
+		return 0;
+	}
+
+	// Handle "." for current directory, and "Folder1;Folder2" to write every output to several folders
+	vector<fs::path> target_paths = splitTargetList(target_dir);
+	for (auto & path : target_paths) {
+		if (path == ".") {
+			path = fs::current_path();
+		}
+	}
 	if (target_dir == ".") {
 		target_dir = fs::current_path().string();
 	}
 
 	// std::filesystem::path handles paths with spaces correctly
 	fs::path source_path = fs::path(source_dir);
-	fs::path target_path = fs::path(target_dir);
-
-	// Validate source directory
-	if (!fs::exists(source_path)) {
-		printf("[error] source directory '%s' does not exist\n", source_dir.c_str());
-		return 1;
+	fs::path target_path = target_paths.empty() ? fs::path(target_dir) : target_paths.front();
+	if (target_paths.size() > 1) {
+		options.more_targets.assign(target_paths.begin() + 1, target_paths.end());
 	}
 
-	if (!fs::is_directory(source_path)) {
-		printf("[error] source argument '%s' is not a directory\n", source_dir.c_str());
-		return 1;
-	}
-
-	// Validate target directory
-	if (!fs::exists(target_path)) {
-		printf("[error] target directory '%s' does not exist\n", target_dir.c_str());
-		return 1;
-	}
-
-	if (!fs::is_directory(target_path)) {
-		printf("[error] target argument '%s' is not a directory\n", target_dir.c_str());
-		return 1;
-	}
-
-	// Count _sc files
-	int sc_file_count = 0;
-	for (auto & file : fs::directory_iterator(source_path)) {
-		string file_name = file.path().filename().string();
-		
-		if (file.path().extension() != ".pkg") continue;
-		if (file_name.find("-merged") != string::npos) continue;
-		
-		// Check for _sc.pkg files
-		if (endsWith(file_name, "_sc.pkg")) {
-			sc_file_count++;
+	if (options.watch) {
+		if (!fs::is_directory(source_path)) {
+			printf("[error] source directory '%s' does not exist\n", source_dir.c_str());
+			return 1;
 		}
-	}
-
-	// Check mode-specific constraints
-	if (mode == "-single" && sc_file_count > 1) {
-		printf("[error] Have been detected more than 1 file ended with '_sc'. Merge process aborted!\n");
-		printf("[info] Use mode '-multiple' to process multiple PKG groups independently\n");
-		return 1;
-	}
-
-	if (sc_file_count > 0) {
-		if (mode == "-single") {
-			printf("[info] Detected 1 file ending with '_sc' - will be merged as the last part\n");
-		} else {
-			printf("[info] Detected %d file(s) ending with '_sc' - will process multiple PKG groups\n", sc_file_count);
+		if (!fs::is_directory(target_path)) {
+			printf("[error] target directory '%s' does not exist\n", target_dir.c_str());
+			return 1;
 		}
-	}
-
-	// After the mode validation, replace the file processing section with this:
-
-	map<string, Package> packages;
-	
-	// In SINGLE mode, we need two passes to avoid the _sc file being processed first
-	if (mode == "-single") {
-		// FIRST PASS: Process all NON-_sc files
-		for (auto & file : fs::directory_iterator(source_path)) {
-			string file_name = file.path().filename().string();
-
-			if (file.path().extension() != ".pkg") {
-				printf("[warn] '%s' is not a PKG file. skipping...\n", file_name.c_str());
-				continue;
-			}
-
-			if (file_name.find("-merged") != string::npos) continue;
-			
-			// Skip _sc files in first pass
-			if (endsWith(file_name, "_sc.pkg")) {
-				continue;
-			}
-
-			size_t found_part_begin = file_name.find_last_of("_") + 1;
-			size_t found_part_end = file_name.find_first_of(".");
-			string part = file_name.substr(found_part_begin, found_part_end - found_part_begin);
-			string title_id = file_name.substr(0, found_part_begin - 1);
-			char* ptr = NULL;
-			auto pkg_piece = strtol(part.c_str(), &ptr, 10);
-			if (ptr == NULL) {
-				printf("[warn] '%s' is not a valid piece (fails integer conversion). skipping...\n", part.c_str());
-				continue;
-			}
-
-			//Check if package exists
-			auto it = packages.find(title_id);
-			if (it != packages.end()) {
-				//Exists, so add this as a piece
-				auto pkg = &it->second;
-				auto piece = Package();
-				piece.file = file.path();
-				piece.part = pkg_piece;
-				pkg->parts.push_back(piece);
-				printf("[success] found piece %d for PKG file %s\n", pkg_piece, title_id.c_str());
-				continue;
-			}
-
-			//Wasn't found, so let's try to see if it's a root PKG file.
-			std::ifstream ifs(file.path().string(), std::ios::binary);
-			char magic[4];
-			ifs.read(magic, sizeof(magic));
-			ifs.close();
-
-			if (memcmp(magic, PKG_MAGIC, sizeof(PKG_MAGIC) != 0)) {
-				printf("[warn] assumed root PKG file '%s' doesn't match PKG magic (is %x, wants %x). skipping...\n", file_name.c_str(), magic, PKG_MAGIC);
-				continue;
-			}
-
-			auto package = Package();
-			package.part = 0;
-			package.file = file.path();
-			packages.insert(std::pair<string, Package>(title_id, package));
-			printf("[success] found root PKG file for %s\n", title_id.c_str());
+		if (mode != "-single") {
+			printf("[error] --watch follows one package at a time and only works in -single mode\n");
+			return 1;
 		}
-		
-		// SECOND PASS: Process _sc file and attach to first package found
-		for (auto & file : fs::directory_iterator(source_path)) {
-			string file_name = file.path().filename().string();
-
-			if (file.path().extension() != ".pkg") continue;
-			if (file_name.find("-merged") != string::npos) continue;
-			
-			// Only process _sc files in second pass
-			if (endsWith(file_name, "_sc.pkg")) {
-				// Extract base name (everything before _sc.pkg)
-				string base_name = file_name.substr(0, file_name.length() - 7); // Remove "_sc.pkg"
-				
-				// In single mode, attach to the first (and should be only) package
-				if (packages.empty()) {
-					// No packages found, create one with the _sc file as root
-					auto package = Package();
-					package.part = 0;
-					package.file = file.path();
-					package.output_name = base_name;
-					
-					auto sc_package = new Package();
-					sc_package->file = file.path();
-					sc_package->part = 9999;
-					package.sc_part = sc_package;
-					
-					packages.insert(std::pair<string, Package>(base_name, package));
-					printf("[success] found _sc PKG file for %s (will be merged as last part)\n", base_name.c_str());
-				} else {
-					// Attach to the first package found
-					auto it = packages.begin();
-					auto pkg = &it->second;
-					
-					auto sc_package = new Package();
-					sc_package->file = file.path();
-					sc_package->part = 9999;
-					pkg->sc_part = sc_package;
-					pkg->output_name = base_name;
-					printf("[success] found _sc PKG file for %s (will be merged as last part)\n", base_name.c_str());
-				}
-			}
+		if (!options.more_targets.empty()) {
+			printf("[error] --watch writes to one target folder\n");
+			return 1;
 		}
-	} else {
-		// MULTIPLE MODE: Original single-pass logic works fine
-		for (auto & file : fs::directory_iterator(source_path)) {
-			string file_name = file.path().filename().string();
-
-			if (file.path().extension() != ".pkg") {
-				printf("[warn] '%s' is not a PKG file. skipping...\n", file_name.c_str());
-				continue;
-			}
-
-			if (file_name.find("-merged") != string::npos) continue;
-
-			// Check if this is a _sc file
-			if (endsWith(file_name, "_sc.pkg")) {
-				// Extract base name (everything before _sc.pkg)
-				string base_name = file_name.substr(0, file_name.length() - 7); // Remove "_sc.pkg"
-				string title_id = base_name;
-				
-				auto it = packages.find(title_id);
-				
-				if (it == packages.end()) {
-					// No matching package found, create new one
-					auto package = Package();
-					package.part = 0;
-					package.file = file.path();
-					package.output_name = base_name;
-					
-					auto sc_package = new Package();
-					sc_package->file = file.path();
-					sc_package->part = 9999;
-					package.sc_part = sc_package;
-					
-					packages.insert(std::pair<string, Package>(title_id, package));
-					printf("[success] found _sc PKG file for %s (will be merged as last part)\n", base_name.c_str());
-				} else {
-					// Found matching package, add _sc as the last part
-					auto pkg = &it->second;
-					auto sc_package = new Package();
-					sc_package->file = file.path();
-					sc_package->part = 9999;
-					pkg->sc_part = sc_package;
-					pkg->output_name = base_name;
-					printf("[success] found _sc PKG file for %s (will be merged as last part)\n", base_name.c_str());
-				}
-				
-				continue;
-			}
-
-			size_t found_part_begin = file_name.find_last_of("_") + 1;
-			size_t found_part_end = file_name.find_first_of(".");
-			string part = file_name.substr(found_part_begin, found_part_end - found_part_begin);
-			string title_id = file_name.substr(0, found_part_begin - 1);
-			char* ptr = NULL;
-			auto pkg_piece = strtol(part.c_str(), &ptr, 10);
-			if (ptr == NULL) {
-				printf("[warn] '%s' is not a valid piece (fails integer conversion). skipping...\n", part.c_str());
-				continue;
-			}
-
-			//Check if package exists
-			auto it = packages.find(title_id);
-			if (it != packages.end()) {
-				//Exists, so add this as a piece
-				auto pkg = &it->second;
-				auto piece = Package();
-				piece.file = file.path();
-				piece.part = pkg_piece;
-				pkg->parts.push_back(piece);
-				printf("[success] found piece %d for PKG file %s\n", pkg_piece, title_id.c_str());
-				continue;
-			}
-
-			//Wasn't found, so let's try to see if it's a root PKG file.
-			std::ifstream ifs(file.path().string(), std::ios::binary);
-			char magic[4];
-			ifs.read(magic, sizeof(magic));
-			ifs.close();
-
-			if (memcmp(magic, PKG_MAGIC, sizeof(PKG_MAGIC) != 0)) {
-				printf("[warn] assumed root PKG file '%s' doesn't match PKG magic (is %x, wants %x). skipping...\n", file_name.c_str(), magic, PKG_MAGIC);
-				continue;
-			}
-
-			auto package = Package();
-			package.part = 0;
-			package.file = file.path();
-			packages.insert(std::pair<string, Package>(title_id, package));
-			printf("[success] found root PKG file for %s\n", title_id.c_str());
+		string created = watchAndMerge(source_path, target_path, options.engine, options.output, options.metrics);
+		bool intact = created.empty() || !options.verify || verifyMerged(fs::path(created), options);
+		writeMetrics(options);
+		if (created.empty() || !intact) {
+			return 1;
 		}
+		printf("\n[success] completed\n");
+		printf("The file was created: %s\n", created.c_str());
+		return 0;
 	}
 
-
-	vector<string> created_files = merge(packages, target_path);
-
-	printf("\n[success] completed\n");
-
-	// Display all created files
-	for (const auto& file : created_files) {
-		printf("The file was created: %s\n", file.c_str());
-	}
-
-	return 0;
+	vector<string> created_files;
+	bool merged = mergeFolder(source_path, target_path, mode == "-single", options, created_files);
+	writeMetrics(options);
+	return merged ? 0 : 1;
 }
-
-
@@ -0,0 +1,255 @@
+// pkgparts.cpp : grouping of split PKG pieces into packages and their merged layout
+//
+
+#include "stdafx.h"
+#include "pkgparts.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+namespace fs = std::filesystem;
+using std::string;
+using std::map;
+using std::vector;
+
+const char PKG_MAGIC[4] = { 0x7F, 0x43, 0x4E, 0x54 };
+
+// Helper function to check if string ends with a specific suffix
+static bool endsWith(const string& str, const string& suffix) {
+	if (suffix.length() > str.length()) return false;
+	return str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
+
+bool parsePieceName(const string& file_name, string& title_id, int& part, bool& sc) {
+	if (endsWith(file_name, "_sc.pkg")) {
+		sc = true;
+		part = -1;
+		title_id = file_name.substr(0, file_name.length() - 7); // Remove "_sc.pkg"
+		return true;
+	}
+
+	size_t found_part_begin = file_name.find_last_of("_") + 1;
+	size_t found_part_end = file_name.find_first_of(".");
+	string number = file_name.substr(found_part_begin, found_part_end - found_part_begin);
+	char* ptr = NULL;
+	long value = strtol(number.c_str(), &ptr, 10);
+	if (found_part_begin == 0 || ptr == number.c_str() || *ptr != '\0') {
+		return false;
+	}
+	sc = false;
+	part = (int)value;
+	title_id = file_name.substr(0, found_part_begin - 1);
+	return true;
+}
+
+// One .pkg file of the source folder, as seen by the single directory pass
+struct CatalogEntry {
+	fs::path	path;
+	string		file_name;
+	uint64_t	size;
+	string		title_id;		// Name before the last '_'
+	int			part;			// Number after the last '_', -1 for the _sc file
+	bool		sc;
+	bool		root;			// Starts with PKG_MAGIC (filled in by probeRoots)
+	uint32_t	magic;			// First four bytes, big endian, for the warning when it isn't a root
+	CatalogEntry() : size(0), part(0), sc(false), root(false), magic(0) {}
+};
+
+// Most pieces fit in one directory block, but network shares and disks pay a round trip per probe
+const unsigned MAX_PROBE_THREADS = 8;
+
+// Helper function to read the first four bytes of `entries` with a few threads at once
+static void probeEntries(const vector<CatalogEntry*>& entries) {
+	std::atomic<size_t> next(0);
+	auto probe = [&]() {
+		for (size_t i = next++; i < entries.size(); i = next++) {
+			CatalogEntry& entry = *entries[i];
+			unsigned char magic[sizeof(PKG_MAGIC)] = {};
+			FileHandle file = openForRead(entry.path);
+			if (file != INVALID_FILE) {
+				readAt(file, magic, sizeof(magic), 0);
+				closeFile(file);
+			}
+			entry.magic = ((uint32_t)magic[0] << 24) | ((uint32_t)magic[1] << 16) | ((uint32_t)magic[2] << 8) | magic[3];
+			entry.root = memcmp(magic, PKG_MAGIC, sizeof(PKG_MAGIC)) == 0;
+		}
+	};
+
+	unsigned threads = (unsigned)std::min<size_t>(entries.size(), MAX_PROBE_THREADS);
+	vector<std::thread> workers;
+	for (unsigned i = 1; i < threads; i++) {
+		workers.emplace_back(probe);
+	}
+	probe();
+	for (auto & worker : workers) {
+		worker.join();
+	}
+}
+
+// Helper function to find the root of every title: its lowest-numbered piece is probed first, and the next
+// one only if that isn't a root, so a folder of thousands of pieces costs about one open per title
+static void probeRoots(vector<CatalogEntry>& catalog) {
+	map<string, vector<CatalogEntry*>> titles;
+	for (auto & entry : catalog) {
+		if (!entry.sc) titles[entry.title_id].push_back(&entry);
+	}
+	vector<vector<CatalogEntry*>> pending;
+	for (auto & title : titles) {
+		std::stable_sort(title.second.begin(), title.second.end(), [](const CatalogEntry* lhs, const CatalogEntry* rhs) {
+			return lhs->part < rhs->part;
+		});
+		pending.push_back(title.second);
+	}
+
+	for (size_t round = 0; !pending.empty(); round++) {
+		vector<CatalogEntry*> candidates;
+		for (auto & pieces : pending) {
+			candidates.push_back(pieces[round]);
+		}
+		probeEntries(candidates);
+		// Titles whose root turned up, or that ran out of pieces, are done
+		pending.erase(std::remove_if(pending.begin(), pending.end(), [round](const vector<CatalogEntry*>& pieces) {
+			return pieces[round]->root || round + 1 == pieces.size();
+		}), pending.end());
+	}
+}
+
+// Helper function to walk the source folder once and parse every PKG file name
+static vector<CatalogEntry> readCatalog(const fs::path& source_path, FILE* log) {
+	vector<CatalogEntry> catalog;
+	for (auto & file : fs::directory_iterator(source_path)) {
+		string file_name = file.path().filename().string();
+
+		if (file.path().extension() != ".pkg") {
+			fprintf(log, "[warn] '%s' is not a PKG file. skipping...\n", file_name.c_str());
+			continue;
+		}
+		if (file_name.find("-merged") != string::npos) continue;
+
+		CatalogEntry entry;
+		entry.path = file.path();
+		entry.file_name = file_name;
+		std::error_code error;
+		entry.size = file.file_size(error);		// Comes with the directory listing on Windows, no extra stat
+		if (error || entry.size == 0) {
+			fprintf(log, "[warn] '%s' is empty or unreadable. skipping...\n", file_name.c_str());
+			continue;
+		}
+
+		if (!parsePieceName(file_name, entry.title_id, entry.part, entry.sc)) {
+			size_t found_part_begin = file_name.find_last_of("_") + 1;
+			string part = file_name.substr(found_part_begin, file_name.find_first_of(".") - found_part_begin);
+			fprintf(log, "[warn] '%s' is not a valid piece (fails integer conversion). skipping...\n", part.c_str());
+			continue;
+		}
+		catalog.push_back(entry);
+	}
+	return catalog;
+}
+
+// Helper function to attach an _sc file to `title_id`, or start a package from it if there's none
+static void attachScPart(map<string, Package>& packages, const string& title_id, const CatalogEntry& entry, FILE* log) {
+	auto sc_package = new Package();
+	sc_package->file = entry.path;
+	sc_package->part = 9999;
+
+	auto it = packages.find(title_id);
+	if (it == packages.end()) {
+		// No matching package found, create one with the _sc file as root
+		auto package = Package();
+		package.part = 0;
+		package.file = entry.path;
+		it = packages.insert(std::pair<string, Package>(title_id, package)).first;
+	}
+	it->second.sc_part = sc_package;
+	it->second.output_name = entry.title_id;
+	fprintf(log, "[success] found _sc PKG file for %s (will be merged as last part)\n", entry.title_id.c_str());
+}
+
+bool scanPackages(const fs::path& source_path, bool single_mode, FILE* log, map<string, Package>& packages) {
+	vector<CatalogEntry> catalog = readCatalog(source_path, log);
+
+	int sc_file_count = (int)std::count_if(catalog.begin(), catalog.end(), [](const CatalogEntry& entry) { return entry.sc; });
+
+	// Check mode-specific constraints
+	if (single_mode && sc_file_count > 1) {
+		fprintf(log, "[error] Have been detected more than 1 file ended with '_sc'. Merge process aborted!\n");
+		fprintf(log, "[info] Use mode '-multiple' to process multiple PKG groups independently\n");
+		return false;
+	}
+
+	if (sc_file_count > 0) {
+		if (single_mode) {
+			fprintf(log, "[info] Detected 1 file ending with '_sc' - will be merged as the last part\n");
+		} else {
+			fprintf(log, "[info] Detected %d file(s) ending with '_sc' - will process multiple PKG groups\n", sc_file_count);
+		}
+	}
+
+	probeRoots(catalog);
+
+	// Lowest piece number first, so the root of a group is settled before its pieces whatever the directory order
+	std::stable_sort(catalog.begin(), catalog.end(), [](const CatalogEntry& lhs, const CatalogEntry& rhs) {
+		return lhs.part < rhs.part;
+	});
+
+	for (auto & entry : catalog) {
+		if (!entry.root || entry.sc || packages.count(entry.title_id) != 0) continue;
+		auto package = Package();
+		package.part = 0;
+		package.file = entry.path;
+		packages.insert(std::pair<string, Package>(entry.title_id, package));
+		fprintf(log, "[success] found root PKG file for %s\n", entry.title_id.c_str());
+	}
+
+	for (auto & entry : catalog) {
+		if (entry.sc) continue;
+		auto it = packages.find(entry.title_id);
+		if (it == packages.end()) {
+			fprintf(log, "[warn] assumed root PKG file '%s' doesn't match PKG magic (is %x, wants %x). skipping...\n",
+				entry.file_name.c_str(), (unsigned)entry.magic, 0x7F434E54u);
+			continue;
+		}
+		if (it->second.file == entry.path) continue;
+
+		auto piece = Package();
+		piece.file = entry.path;
+		piece.part = entry.part;
+		it->second.parts.push_back(piece);
+		fprintf(log, "[success] found piece %d for PKG file %s\n", entry.part, entry.title_id.c_str());
+	}
+
+	// The _sc file goes last. In SINGLE mode it belongs to the first (and should be only) package, whatever its name
+	for (auto & entry : catalog) {
+		if (!entry.sc) continue;
+		string title_id = single_mode && !packages.empty() ? packages.begin()->first : entry.title_id;
+		attachScPart(packages, title_id, entry, log);
+	}
+
+	return true;
+}
+
+PkgPartSet::PkgPartSet(const Package& pkg) {
+	uint64_t offset = 0;
+	auto add = [&](const fs::path& file, const string& label) {
+		uint64_t size = fs::file_size(file);
+		assert(size != 0);
+		layout.push_back({ file, label, size, offset });
+		offset += size;
+	};
+
+	// Numbered pieces go in part order, whatever order the directory listed them in
+	vector<Package> parts = pkg.parts;
+	std::sort(parts.begin(), parts.end());
+
+	add(pkg.file, "root");
+	for (auto & part : parts) {
+		add(part.file, "part " + std::to_string(part.part));
+	}
+	if (pkg.sc_part != nullptr) {
+		add(pkg.sc_part->file, "_sc part (final)");
+	}
+}
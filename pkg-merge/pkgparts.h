@@ -0,0 +1,44 @@
+// pkgparts.h : grouping of split PKG pieces into packages and their merged layout
+//
+
+#pragma once
+
+#include "copyengine.h"
+#include <stdio.h>
+#include <map>
+#include <vector>
+
+struct Package {
+	int						part;
+	std::filesystem::path	file;
+	std::vector<Package>	parts;
+	Package*				sc_part;		// Special _sc file
+	std::string				output_name;	// Custom output name if _sc file exists
+	bool operator < (const Package& rhs) const {
+		return part < rhs.part;
+	}
+	Package() : part(0), sc_part(nullptr) {}
+};
+
+extern const char PKG_MAGIC[4];
+
+// Splits a piece file name into its title and number: "game_3.pkg" is piece 3 of "game", "Title_sc.pkg"
+// is the _sc tail of "Title" (part -1, `sc` set). Returns false if the name has no valid piece number.
+bool parsePieceName(const std::string& file_name, std::string& title_id, int& part, bool& sc);
+
+// Groups the PKG pieces of `source_path` by title: root part (checked against PKG_MAGIC), numbered
+// `_N` pieces and the `_sc` tail. Single mode allows one `_sc` file and attaches it to the first package.
+// Progress goes to `log`. Returns false if the directory can't be merged in this mode.
+bool scanPackages(const std::filesystem::path& source_path, bool single_mode, FILE* log, std::map<std::string, Package>& packages);
+
+// The pieces of one package in merge order (root, numbered parts, _sc) with the offset each lands at
+class PkgPartSet {
+public:
+	explicit PkgPartSet(const Package& pkg);
+
+	const std::vector<MergeSegment>& segments() const { return layout; }
+	uint64_t size() const { return layout.empty() ? 0 : layout.back().offset + layout.back().size; }
+
+private:
+	std::vector<MergeSegment>	layout;
+};
@@ -0,0 +1,99 @@
+// progress.cpp : progress meter with a fixed-rate reporter thread
+//
+
+#include "stdafx.h"
+#include "progress.h"
+#include <algorithm>
+
+using std::string;
+
+string formatDuration(double seconds) {
+	unsigned long long total = seconds > 0 ? (unsigned long long)(seconds + 0.5) : 0;
+	char text[32];
+	if (total >= 3600) {
+		snprintf(text, sizeof(text), "%llu:%02llu:%02llu", total / 3600, total / 60 % 60, total % 60);
+	} else {
+		snprintf(text, sizeof(text), "%llu:%02llu", total / 60, total % 60);
+	}
+	return text;
+}
+
+ProgressMeter::ProgressMeter(uint64_t total, uint64_t start, const ProgressRender& render, bool live, const char* verb)
+	: total(total), start_position(start), verb(verb), render(render), current(start), started(Clock::now()), part_start(start),
+	part_quiet(true), part_started(started), drawn_length(0), stopping(false) {
+	if (live) {
+		reporter = std::thread(&ProgressMeter::run, this);
+	}
+}
+
+ProgressMeter::~ProgressMeter() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	if (reporter.joinable()) {
+		reporter.join();
+	}
+}
+
+void ProgressMeter::run() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (!stopping) {
+		wake.wait_for(guard, std::chrono::milliseconds(PROGRESS_INTERVAL_MS));
+		if (!stopping && !part_quiet) {
+			draw();
+		}
+	}
+}
+
+void ProgressMeter::beginPart(const string& label, bool quiet) {
+	std::lock_guard<std::mutex> guard(lock);
+	part_label = label;
+	part_start = current.load(std::memory_order_relaxed);
+	part_quiet = quiet;
+	part_started = Clock::now();
+	drawn_length = 0;
+}
+
+const PartTiming& ProgressMeter::endPart(const string& method) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (!part_quiet) {
+		draw();
+	}
+	part_quiet = true;
+	uint64_t position = current.load(std::memory_order_relaxed);
+	timings.emplace_back(part_label, method, position - part_start,
+		std::chrono::duration<double>(Clock::now() - part_started).count());
+	return timings.back();
+}
+
+double ProgressMeter::elapsed() const {
+	return std::chrono::duration<double>(Clock::now() - started).count();
+}
+
+// Called with `lock` held
+string ProgressMeter::line() const {
+	uint64_t position = std::min(current.load(std::memory_order_relaxed), total);
+	double seconds = elapsed();
+	// Bytes a resumed merge found on disk weren't copied in this run, so they don't count for the rate
+	double rate = seconds > 0 ? (double)(position - std::min(position, start_position)) / seconds : 0;
+	double percentage = total > 0 ? (double)position / (double)total * 100 : 100;
+
+	char text[512];
+	snprintf(text, sizeof(text), "\t[work] %s %llu/%llu bytes (%.0lf%%) for %s, %.1f MB/s, ETA %s...",
+		verb, (unsigned long long)position, (unsigned long long)total, percentage, part_label.c_str(), rate / (1024.0 * 1024.0),
+		rate > 0 ? formatDuration((double)(total - position) / rate).c_str() : "-:--");
+	return text;
+}
+
+// Called with `lock` held
+void ProgressMeter::draw() {
+	string text = line();
+	size_t length = text.size();
+	if (length < drawn_length) {
+		text.append(drawn_length - length, ' ');
+	}
+	drawn_length = length;
+	render(text);
+}
@@ -0,0 +1,81 @@
+// progress.h : progress counters updated by the copy loops and drawn by a reporter thread at a fixed rate
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+
+// Receives one finished status line (no "\r", no newline)
+typedef std::function<void(const std::string& line)> ProgressRender;
+
+// How often a live meter redraws its line
+const unsigned PROGRESS_INTERVAL_MS = 250;
+
+struct PartTiming {
+	std::string			label;
+	std::string			method;			// Engine or path the bytes took
+	uint64_t			bytes;
+	double				seconds;
+	PartTiming(const std::string& label, const std::string& method, uint64_t bytes, double seconds)
+		: label(label), method(method), bytes(bytes), seconds(seconds) {}
+	double megabytesPerSecond() const { return seconds > 0 ? (double)bytes / (1024.0 * 1024.0) / seconds : 0; }
+};
+
+// Progress of one package. The copy loops only store the output position in an atomic; formatting and
+// printing happen on the reporter thread every PROGRESS_INTERVAL_MS, however small the copy chunks are.
+// A meter that isn't `live` (concurrent --jobs, whose lines are held back anyway) starts no thread and
+// only renders the final state of each part.
+class ProgressMeter {
+public:
+	// `total` is the size of the output, `start` what a resumed merge already has. `verb` starts the line.
+	ProgressMeter(uint64_t total, uint64_t start, const ProgressRender& render, bool live, const char* verb = "merged");
+	~ProgressMeter();
+
+	// The next bytes come from `label`. Quiet parts are counted and timed but not drawn.
+	void beginPart(const std::string& label, bool quiet);
+	// Draws the part's final state once more and returns its timing
+	const PartTiming& endPart(const std::string& method);
+
+	// Called from the copy loops, from any thread
+	void update(uint64_t position) { current.store(position, std::memory_order_relaxed); }
+
+	const std::vector<PartTiming>& parts() const { return timings; }
+	double elapsed() const;
+
+private:
+	void run();
+	void draw();
+	std::string line() const;
+
+	typedef std::chrono::steady_clock Clock;
+
+	uint64_t				total;
+	uint64_t				start_position;
+	const char*				verb;
+	ProgressRender			render;
+	std::atomic<uint64_t>	current;		// Output position written by the copy loops
+	Clock::time_point		started;
+
+	std::mutex				lock;			// Guards everything below and serializes drawing
+	std::string				part_label;
+	uint64_t				part_start;
+	bool					part_quiet;
+	Clock::time_point		part_started;
+	size_t					drawn_length;	// Longer lines are padded over when a shorter one replaces them
+	std::vector<PartTiming>	timings;
+
+	bool					stopping;
+	std::condition_variable	wake;
+	std::thread				reporter;
+};
+
+// Formats seconds as m:ss, or h:mm:ss from an hour up
+std::string formatDuration(double seconds);
@@ -0,0 +1,763 @@
+// service.cpp : the -serve job queue and its socket protocol, and the --submit client
+//
+// One request per connection, one line each way per message. Fields are separated by tabs and escaped
+// (\\, \t, \n, \r), so paths and progress lines pass through unchanged:
+//   client:  MERGE <priority> <working directory> <argument>...
+//   service: queued <job> <jobs ahead> new|joined
+//            out <text>          what the merge prints, progress lines start with \r
+//            done <exit code>    then the service closes the connection
+
+#include "stdafx.h"
+#include "service.h"
+#include "devices.h"
+#include <list>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET ServiceSocket;
+const ServiceSocket INVALID_SERVICE_SOCKET = INVALID_SOCKET;
+const int SEND_FLAGS = 0;
+const int SHUTDOWN_BOTH = SD_BOTH;
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+typedef int ServiceSocket;
+const ServiceSocket INVALID_SERVICE_SOCKET = -1;
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+const int SHUTDOWN_BOTH = SHUT_RDWR;
+#endif
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+
+// A request line longer than this isn't one of ours
+const size_t MAX_REQUEST_SIZE = 64 * 1024;
+// A client that doesn't send its request, or stops reading its output, for this long is dropped
+const int CLIENT_TIMEOUT_MS = 10000;
+// A client following a merge that falls this far behind its output is dropped
+const size_t MAX_CLIENT_BACKLOG = 4 * 1024 * 1024;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void requestStop(int) {
+	stop_requested = 1;
+}
+
+static void closeSocket(ServiceSocket socket) {
+#ifdef _WIN32
+	closesocket(socket);
+#else
+	close(socket);
+#endif
+}
+
+// Helper function to wait up to `timeout_ms` for a connection on a listening socket
+static bool waitReadable(ServiceSocket socket, int timeout_ms) {
+#ifdef _WIN32
+	WSAPOLLFD poll_fd = { socket, POLLRDNORM, 0 };
+	return WSAPoll(&poll_fd, 1, timeout_ms) > 0;
+#else
+	struct pollfd poll_fd = { socket, POLLIN, 0 };
+	return poll(&poll_fd, 1, timeout_ms) > 0;
+#endif
+}
+
+static void setTimeouts(ServiceSocket socket, int timeout_ms) {
+#ifdef _WIN32
+	DWORD timeout = (DWORD)timeout_ms;
+#else
+	struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+#endif
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+// Helper function to fill in the address of `socket_path`. Returns false if the path is too long for it.
+static bool socketAddress(const string& socket_path, sockaddr_un& address) {
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socket_path.empty() || socket_path.length() >= sizeof(address.sun_path)) {
+		return false;
+	}
+	memcpy(address.sun_path, socket_path.c_str(), socket_path.length());
+	return true;
+}
+
+// Helper function to connect to the socket at `socket_path`, INVALID_SERVICE_SOCKET if nobody listens there
+static ServiceSocket connectTo(const string& socket_path) {
+	sockaddr_un address;
+	if (!socketAddress(socket_path, address)) {
+		return INVALID_SERVICE_SOCKET;
+	}
+	ServiceSocket socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socket == INVALID_SERVICE_SOCKET) {
+		return INVALID_SERVICE_SOCKET;
+	}
+	if (connect(socket, (const sockaddr*)&address, sizeof(address)) != 0) {
+		closeSocket(socket);
+		return INVALID_SERVICE_SOCKET;
+	}
+	return socket;
+}
+
+static string escapeField(const string& text) {
+	string escaped;
+	escaped.reserve(text.length());
+	for (char c : text) {
+		switch (c) {
+		case '\\': escaped += "\\\\"; break;
+		case '\t': escaped += "\\t"; break;
+		case '\n': escaped += "\\n"; break;
+		case '\r': escaped += "\\r"; break;
+		default: escaped += c; break;
+		}
+	}
+	return escaped;
+}
+
+// Helper function to split a received line into its unescaped fields
+static vector<string> splitFields(const string& line) {
+	vector<string> fields(1);
+	for (size_t i = 0; i < line.length(); i++) {
+		char c = line[i];
+		if (c == '\t') {
+			fields.emplace_back();
+		} else if (c == '\\' && i + 1 < line.length()) {
+			char next = line[++i];
+			fields.back() += next == 't' ? '\t' : next == 'n' ? '\n' : next == 'r' ? '\r' : next;
+		} else {
+			fields.back() += c;
+		}
+	}
+	return fields;
+}
+
+static bool sendAll(ServiceSocket socket, const string& data) {
+	for (size_t sent = 0; sent < data.length();) {
+		int result = send(socket, data.c_str() + sent, (int)std::min<size_t>(data.length() - sent, 1 << 20), SEND_FLAGS);
+		if (result <= 0) {
+			return false;
+		}
+		sent += (size_t)result;
+	}
+	return true;
+}
+
+static string encodeLine(const vector<string>& fields) {
+	string line;
+	for (size_t i = 0; i < fields.size(); i++) {
+		line += (i == 0 ? "" : "\t") + escapeField(fields[i]);
+	}
+	return line + "\n";
+}
+
+static bool sendLine(ServiceSocket socket, const vector<string>& fields) {
+	return sendAll(socket, encodeLine(fields));
+}
+
+// Reads a connection line by line
+class LineReader {
+public:
+	explicit LineReader(ServiceSocket socket) : socket(socket) {}
+
+	// The next line without its newline. Returns false once the connection is closed or broken.
+	bool next(string& line) {
+		size_t end;
+		while ((end = buffered.find('\n')) == string::npos) {
+			if (buffered.length() > MAX_REQUEST_SIZE) {
+				return false;
+			}
+			char chunk[4096];
+			int got = recv(socket, chunk, sizeof(chunk), 0);
+			if (got <= 0) {
+				return false;
+			}
+			buffered.append(chunk, (size_t)got);
+		}
+		line = buffered.substr(0, end);
+		buffered.erase(0, end + 1);
+		return true;
+	}
+
+private:
+	ServiceSocket	socket;
+	string			buffered;
+};
+
+string defaultServiceSocket() {
+#ifdef _WIN32
+	const char* temp = getenv("TEMP");
+	return (fs::path(temp != NULL ? temp : ".") / "pkg-merge.sock").string();
+#else
+	const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir != NULL && runtime_dir[0] != '\0') {
+		return (fs::path(runtime_dir) / "pkg-merge.sock").string();
+	}
+	return "/tmp/pkg-merge-" + std::to_string((unsigned long)getuid()) + ".sock";
+#endif
+}
+
+// Lines on their way to one client following a merge. The merge only queues them; a thread of the
+// subscriber's own sends them, so a client that reads slowly holds up neither the merge nor the others.
+class ServiceSubscriber {
+public:
+	// Takes over `socket` and starts sending to it
+	static std::shared_ptr<ServiceSubscriber> start(ServiceSocket socket);
+
+	// Queues a line. Returns false once the client is gone or has fallen MAX_CLIENT_BACKLOG behind,
+	// which drops it.
+	bool send(const vector<string>& fields);
+
+	// Queues the last line; the connection closes once everything before it is out
+	void close(const vector<string>& fields);
+
+	// Waits for every subscriber's last line to go out, or its client to be dropped
+	static void waitForAll();
+
+private:
+	explicit ServiceSubscriber(ServiceSocket socket) : socket(socket), closing(false), gone(false) {}
+	void run();
+
+	ServiceSocket					socket;
+	std::mutex						lock;
+	std::condition_variable			changed;
+	string							outbox;			// Encoded lines not handed to the socket yet
+	bool							closing;
+	bool							gone;
+
+	static std::mutex				running_lock;
+	static std::condition_variable	running_changed;
+	static unsigned					running;		// Sender threads still going
+};
+
+std::mutex ServiceSubscriber::running_lock;
+std::condition_variable ServiceSubscriber::running_changed;
+unsigned ServiceSubscriber::running = 0;
+
+std::shared_ptr<ServiceSubscriber> ServiceSubscriber::start(ServiceSocket socket) {
+	std::shared_ptr<ServiceSubscriber> subscriber(new ServiceSubscriber(socket));
+	{
+		std::lock_guard<std::mutex> guard(running_lock);
+		running++;
+	}
+	// The thread keeps the subscriber alive until the connection is closed
+	std::thread(&ServiceSubscriber::run, subscriber).detach();
+	return subscriber;
+}
+
+bool ServiceSubscriber::send(const vector<string>& fields) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (gone) return false;
+	if (outbox.length() > MAX_CLIENT_BACKLOG) {
+		// Wakes the sender if it's stuck in send(), it closes the connection
+		gone = true;
+		shutdown(socket, SHUTDOWN_BOTH);
+		changed.notify_all();
+		return false;
+	}
+	outbox += encodeLine(fields);
+	changed.notify_all();
+	return true;
+}
+
+void ServiceSubscriber::close(const vector<string>& fields) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (!gone) outbox += encodeLine(fields);
+	closing = true;
+	changed.notify_all();
+}
+
+void ServiceSubscriber::run() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (true) {
+		while (outbox.empty() && !closing && !gone) {
+			changed.wait(guard);
+		}
+		if (gone || outbox.empty()) break;
+		string sending;
+		sending.swap(outbox);
+		guard.unlock();
+		bool sent = sendAll(socket, sending);
+		guard.lock();
+		if (!sent) {
+			// The client went away, the merge carries on without it
+			gone = true;
+		}
+	}
+	gone = true;
+	outbox.clear();
+	guard.unlock();
+	closeSocket(socket);
+
+	std::lock_guard<std::mutex> running_guard(running_lock);
+	running--;
+	running_changed.notify_all();
+}
+
+void ServiceSubscriber::waitForAll() {
+	std::unique_lock<std::mutex> guard(running_lock);
+	while (running > 0) {
+		running_changed.wait(guard);
+	}
+}
+
+// One requested merge, queued or running, with every connection waiting for it
+struct ServiceJob {
+	unsigned				id;
+	int						priority;		// Higher runs first, equal ones in order of arrival
+	string					key;			// Requests with the same key write the same outputs
+	string					settings;		// The options they were made with, which have to match to share a merge
+	fs::path				source;
+	fs::path				target;
+	bool					single_mode;
+	MergeOptions			options;
+	vector<size_t>			devices;		// Into the service's DeviceMap, each disk once
+	bool					started;
+
+	std::mutex				output_lock;	// Subscribers and transcript, written from the merge's threads
+	vector<std::shared_ptr<ServiceSubscriber>>	subscribers;
+	string					transcript;		// Everything printed so far, replayed to requests that join later
+	string					pending;		// Latest progress line, committed by the next message
+
+	ServiceJob() : id(0), priority(0), single_mode(true), started(false) {}
+};
+
+class MergeService {
+public:
+	explicit MergeService(const MergeOptions& options) : options(options), next_id(1), reading(0), stopping(false) {}
+
+	int run(const string& socket_path);
+
+private:
+	void serveConnection(ServiceSocket client);
+	void handleRequest(ServiceSocket client);
+	bool parseRequest(const vector<string>& fields, ServiceSocket client, std::shared_ptr<ServiceJob>& job);
+	void worker();
+	std::shared_ptr<ServiceJob> nextJob();
+	size_t jobsAhead(const ServiceJob& job) const;
+	static void publish(ServiceJob& job, const string& text);
+	static void finish(ServiceJob& job, int exit_code);
+
+	MergeOptions							options;
+	BufferPool								buffers;		// Warm copy buffers, shared by every merge
+	DeviceMap								device_map;
+	vector<unsigned>						device_busy;
+	std::mutex								lock;			// Everything below
+	std::condition_variable					changed;
+	std::list<std::shared_ptr<ServiceJob>>	jobs;			// Queued and running, in order of arrival
+	unsigned								next_id;
+	unsigned								reading;		// Connections whose request is still being read
+	bool									stopping;
+};
+
+// Hands a line the merge printed to everyone following it
+void MergeService::publish(ServiceJob& job, const string& text) {
+	std::lock_guard<std::mutex> guard(job.output_lock);
+	if (!text.empty() && text[0] == '\r') {
+		job.pending = text;
+	} else {
+		job.transcript += job.pending + text;
+		job.pending.clear();
+	}
+	for (auto it = job.subscribers.begin(); it != job.subscribers.end();) {
+		if ((*it)->send({ "out", text })) {
+			++it;
+		} else {
+			it = job.subscribers.erase(it);
+		}
+	}
+}
+
+void MergeService::finish(ServiceJob& job, int exit_code) {
+	std::lock_guard<std::mutex> guard(job.output_lock);
+	for (auto & subscriber : job.subscribers) {
+		subscriber->close({ "done", std::to_string(exit_code) });
+	}
+	job.subscribers.clear();
+}
+
+// Called with `lock` held: the number of queued merges that will start before `job`
+size_t MergeService::jobsAhead(const ServiceJob& job) const {
+	return (size_t)std::count_if(jobs.begin(), jobs.end(), [&job](const std::shared_ptr<ServiceJob>& other) {
+		return !other->started && (other->priority > job.priority || (other->priority == job.priority && other->id < job.id));
+	});
+}
+
+// Called with `lock` held: the highest-priority queued merge whose disks all have a free slot
+std::shared_ptr<ServiceJob> MergeService::nextJob() {
+	std::shared_ptr<ServiceJob> best;
+	for (auto & job : jobs) {
+		if (job->started || (best != nullptr && (job->priority <= best->priority))) continue;
+		bool fits = true;
+		for (size_t device : job->devices) {
+			unsigned limit = device_map.devices()[device].rotational ? options.hdd_jobs : options.ssd_jobs;
+			fits = fits && device_busy[device] < limit;
+		}
+		if (fits) best = job;
+	}
+	return best;
+}
+
+void MergeService::worker() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (!stopping) {
+		std::shared_ptr<ServiceJob> job = nextJob();
+		if (job == nullptr) {
+			// Nothing queued, or every queued merge needs a disk that is full; a finishing merge frees one
+			changed.wait(guard);
+			continue;
+		}
+		job->started = true;
+		for (size_t device : job->devices) device_busy[device]++;
+		guard.unlock();
+
+		printf("[work] job %u: %s -> %s\n", job->id, job->source.string().c_str(), job->target.string().c_str());
+		fflush(stdout);
+		MergeOptions& merge_options = job->options;
+		std::unique_ptr<MetricsRecorder> metrics;
+		if (!merge_options.metrics_file.empty()) {
+			metrics.reset(new MetricsRecorder());
+			merge_options.metrics = metrics.get();
+		}
+		vector<string> created_files;
+		bool merged = mergeFolder(job->source, job->target, job->single_mode, merge_options, created_files);
+		writeMetrics(merge_options);
+		printf("[%s] job %u: %zu %s created\n", merged ? "success" : "error", job->id, created_files.size(),
+			created_files.size() == 1 ? "file" : "files");
+		fflush(stdout);
+
+		guard.lock();
+		for (size_t device : job->devices) device_busy[device]--;
+		jobs.remove(job);
+		changed.notify_all();
+		guard.unlock();
+		// Off the queue first, so no request joins a merge that has already reported its end
+		finish(*job, merged ? 0 : 1);
+		guard.lock();
+	}
+}
+
+// Checks a MERGE request and turns it into a job. Whatever is wrong is told to the client.
+bool MergeService::parseRequest(const vector<string>& fields, ServiceSocket client, std::shared_ptr<ServiceJob>& job) {
+	job.reset(new ServiceJob());
+	MergeOptions& merge_options = job->options;
+	merge_options.output = [client](const string& text) { sendLine(client, { "out", text }); };
+	if (fields.size() < 3 || fields[0] != "MERGE") {
+		sendLine(client, { "out", "[error] not a merge request\n" });
+		return false;
+	}
+	job->priority = atoi(fields[1].c_str());
+	fs::path cwd = fs::path(fields[2]);
+	vector<string> args(fields.begin() + 3, fields.end());
+
+	for (auto & arg : args) {
+		string name = toLower(arg.substr(0, arg.find('=')));
+		if (name == "--max-rate" || name == "--io-priority" || name == "--queue-depth") {
+			sendLine(client, { "out", "[error] " + name + " applies to every merge of the service, pass it to -serve instead\n" });
+			return false;
+		}
+	}
+	vector<string> positional;
+	if (!parseArguments(args, merge_options, positional)) {
+		return false;
+	}
+	if (positional.size() < 2 || positional.size() > 3) {
+		sendLine(client, { "out", "[error] a merge request needs \"Source Folder\" \"Target Folder\" [mode]\n" });
+		return false;
+	}
+	string mode = positional.size() == 3 ? toLower(cleanPathString(positional[2])) : "-single";
+	if (mode != "-single" && mode != "-multiple") {
+		sendLine(client, { "out", "[error] Invalid mode '" + positional[2] + "'. Must be '-single' or '-multiple'\n" });
+		return false;
+	}
+	string target = cleanPathString(positional[1]);
+	if (target == "-" || toLower(target).compare(0, 3, "fd:") == 0) {
+		sendLine(client, { "out", "[error] the service writes files, it can't stream a PKG to the client\n" });
+		return false;
+	}
+	if (merge_options.watch) {
+		sendLine(client, { "out", "[error] --watch runs until the download ends and can't be queued, run it on its own\n" });
+		return false;
+	}
+	if (!validateOptions(merge_options, false)) {
+		return false;
+	}
+
+	// Paths are the client's, not the service's
+	auto resolve = [&cwd](const string& path) {
+		fs::path resolved = fs::path(cleanPathString(path));
+		resolved = (resolved.is_relative() ? cwd / resolved : resolved).lexically_normal();
+		// "Folder" and "Folder/" are the same merge
+		return resolved.has_filename() || !resolved.has_relative_path() ? resolved : resolved.parent_path();
+	};
+	job->source = resolve(positional[0]);
+	vector<fs::path> targets = splitTargetList(target);
+	job->target = resolve(targets.empty() ? target : targets.front().string());
+	for (size_t i = 1; i < targets.size(); i++) {
+		merge_options.more_targets.push_back(resolve(targets[i].string()));
+	}
+	job->single_mode = mode == "-single";
+	if (!merge_options.metrics_file.empty()) {
+		merge_options.metrics_file = resolve(merge_options.metrics_file).string();
+	}
+
+	// The outputs only depend on what is merged and where to, a request naming them with other options
+	// must not write them at the same time
+	vector<string> target_set = { job->target.string() };
+	for (auto & more_target : merge_options.more_targets) {
+		target_set.push_back(more_target.string());
+	}
+	std::sort(target_set.begin(), target_set.end());
+	job->key = job->source.string() + "|" + mode;
+	for (auto & folder : target_set) {
+		job->key += "|" + folder;
+	}
+
+	char settings[512];
+	snprintf(settings, sizeof(settings), "%s|%u|%u|%u|%u|%d%d%d%d%d%d%d%d%d%d|", engineName(merge_options.engine), merge_options.parallel,
+		merge_options.jobs, merge_options.hdd_jobs, merge_options.ssd_jobs, merge_options.hash, merge_options.resume,
+		merge_options.journal, merge_options.direct, merge_options.preflight, merge_options.in_place, merge_options.consume, merge_options.sparse,
+		merge_options.verify, merge_options.delta);
+	job->settings = settings + merge_options.metrics_file;
+	return true;
+}
+
+// Runs on a thread of its own for every connection, so a client that is slow to send its request only
+// holds up itself
+void MergeService::serveConnection(ServiceSocket client) {
+	handleRequest(client);
+	fflush(stdout);
+	std::lock_guard<std::mutex> guard(lock);
+	reading--;
+	changed.notify_all();
+}
+
+void MergeService::handleRequest(ServiceSocket client) {
+	setTimeouts(client, CLIENT_TIMEOUT_MS);
+	LineReader reader(client);
+	string line;
+	std::shared_ptr<ServiceJob> job;
+	if (!reader.next(line) || !parseRequest(splitFields(line), client, job)) {
+		sendLine(client, { "done", "1" });
+		closeSocket(client);
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (stopping) {
+		sendLine(client, { "out", "[error] the service is shutting down\n" });
+		sendLine(client, { "done", "1" });
+		closeSocket(client);
+		return;
+	}
+	auto same = std::find_if(jobs.begin(), jobs.end(), [&job](const std::shared_ptr<ServiceJob>& other) { return other->key == job->key; });
+	if (same != jobs.end()) {
+		// Already queued or running: follow that merge instead of writing the same output twice
+		ServiceJob& existing = **same;
+		if (existing.settings != job->settings) {
+			sendLine(client, { "out", "[error] job " + std::to_string(existing.id) + " is already merging into " + existing.target.string() +
+				" with different options, wait for it to finish or send the same options\n" });
+			sendLine(client, { "done", "1" });
+			closeSocket(client);
+			printf("[info] job %u: turned away a request for the same outputs with different options\n", existing.id);
+			return;
+		}
+		if (!existing.started && job->priority > existing.priority) {
+			existing.priority = job->priority;
+			changed.notify_all();
+		}
+		std::lock_guard<std::mutex> output_guard(existing.output_lock);
+		std::shared_ptr<ServiceSubscriber> subscriber = ServiceSubscriber::start(client);
+		if (subscriber->send({ "queued", std::to_string(existing.id), std::to_string(existing.started ? 0 : jobsAhead(existing)), "joined" }) &&
+			subscriber->send({ "out", existing.transcript + existing.pending })) {
+			existing.subscribers.push_back(subscriber);
+		}
+		printf("[info] job %u: one more request joined\n", existing.id);
+		return;
+	}
+
+	job->id = next_id++;
+	job->options.output = [raw = job.get()](const string& text) { publish(*raw, text); };
+	job->options.buffers = &buffers;
+	job->devices.push_back(device_map.deviceOf(job->source));
+	job->devices.push_back(device_map.deviceOf(job->target));
+	for (auto & more_target : job->options.more_targets) {
+		job->devices.push_back(device_map.deviceOf(more_target));
+	}
+	std::sort(job->devices.begin(), job->devices.end());
+	job->devices.erase(std::unique(job->devices.begin(), job->devices.end()), job->devices.end());
+	device_busy.resize(device_map.devices().size(), 0);
+	std::shared_ptr<ServiceSubscriber> subscriber = ServiceSubscriber::start(client);
+	jobs.push_back(job);
+	subscriber->send({ "queued", std::to_string(job->id), std::to_string(jobsAhead(*job)), "new" });
+	job->subscribers.push_back(subscriber);
+	printf("[info] job %u queued with priority %d: %s -> %s\n", job->id, job->priority, job->source.string().c_str(),
+		job->target.string().c_str());
+	changed.notify_all();
+}
+
+int MergeService::run(const string& socket_path) {
+	sockaddr_un address;
+	if (!socketAddress(socket_path, address)) {
+		printf("[error] socket path '%s' is too long (at most %zu characters)\n", socket_path.c_str(), sizeof(address.sun_path) - 1);
+		return 1;
+	}
+	// A socket file left by a service that crashed is removed, one that still answers isn't ours to take
+	ServiceSocket running = connectTo(socket_path);
+	if (running != INVALID_SERVICE_SOCKET) {
+		closeSocket(running);
+		printf("[error] a service is already listening on %s\n", socket_path.c_str());
+		return 1;
+	}
+	std::error_code error;
+	fs::remove(fs::path(socket_path), error);
+
+	ServiceSocket listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == INVALID_SERVICE_SOCKET || bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+		printf("[error] could not listen on %s: %s\n", socket_path.c_str(), lastIoError().c_str());
+		if (listener != INVALID_SERVICE_SOCKET) closeSocket(listener);
+		return 1;
+	}
+
+	signal(SIGINT, requestStop);
+	signal(SIGTERM, requestStop);
+#ifndef _WIN32
+	// A client that disconnects mid-merge must not take the service down with it
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	printf("[info] listening on %s, Ctrl+C to stop\n", socket_path.c_str());
+	printf("[Performance info] %u %s at once, up to %u per spinning disk and %u per solid-state disk\n", options.jobs,
+		options.jobs == 1 ? "merge" : "merges", options.hdd_jobs, options.ssd_jobs);
+	if (options.max_rate > 0) {
+		printf("[Performance info] Copying at most %.1f MB/s across all merges\n", options.max_rate / (1024.0 * 1024.0));
+	}
+	fflush(stdout);
+
+	vector<std::thread> pool;
+	for (unsigned i = 0; i < options.jobs; i++) {
+		pool.emplace_back(&MergeService::worker, this);
+	}
+	while (!stop_requested) {
+		if (!waitReadable(listener, 500)) continue;
+		ServiceSocket client = accept(listener, NULL, NULL);
+		if (client != INVALID_SERVICE_SOCKET) {
+			std::lock_guard<std::mutex> guard(lock);
+			reading++;
+			std::thread(&MergeService::serveConnection, this, client).detach();
+		}
+	}
+
+	closeSocket(listener);
+	fs::remove(fs::path(socket_path), error);
+
+	std::list<std::shared_ptr<ServiceJob>> dropped;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+		for (auto & job : jobs) {
+			if (!job->started) dropped.push_back(job);
+		}
+		printf("\n[info] stopping: waiting for %zu running %s, %zu queued dropped\n", jobs.size() - dropped.size(),
+			jobs.size() - dropped.size() == 1 ? "merge" : "merges", dropped.size());
+		changed.notify_all();
+	}
+	for (auto & job : dropped) {
+		publish(*job, "[error] the service stopped before this merge started\n");
+		finish(*job, 1);
+	}
+	for (auto & thread : pool) {
+		thread.join();
+	}
+	{
+		// Requests still being read find the service stopping and are turned away
+		std::unique_lock<std::mutex> guard(lock);
+		while (reading > 0) {
+			changed.wait(guard);
+		}
+	}
+	// Clients still get the end of their merge
+	ServiceSubscriber::waitForAll();
+	return 0;
+}
+
+int runService(const string& socket_path, const MergeOptions& options) {
+#ifdef _WIN32
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+		printf("[error] could not start Winsock\n");
+		return 1;
+	}
+#endif
+	int result = MergeService(options).run(socket_path);
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return result;
+}
+
+int submitMerge(const string& socket_path, const vector<string>& args, int priority) {
+#ifdef _WIN32
+	WSADATA wsa_data;
+	WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#else
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	ServiceSocket service = connectTo(socket_path);
+	if (service == INVALID_SERVICE_SOCKET) {
+		printf("[error] no merge service on %s: %s (start one with pkg-merge -serve)\n", socket_path.c_str(), lastIoError().c_str());
+		return 1;
+	}
+
+	vector<string> request = { "MERGE", std::to_string(priority), fs::current_path().string() };
+	request.insert(request.end(), args.begin(), args.end());
+	int exit_code = 1;
+	bool done = false;
+	if (sendLine(service, request)) {
+		LineReader reader(service);
+		string line;
+		while (!done && reader.next(line)) {
+			vector<string> fields = splitFields(line);
+			if (fields[0] == "out" && fields.size() >= 2) {
+				fputs(fields[1].c_str(), stdout);
+				fflush(stdout);
+			} else if (fields[0] == "queued" && fields.size() >= 4) {
+				if (fields[3] == "joined") {
+					printf("[info] the same merge is already job %s, following it\n", fields[1].c_str());
+				} else {
+					printf("[info] queued as job %s, %s ahead\n", fields[1].c_str(), fields[2].c_str());
+				}
+			} else if (fields[0] == "done" && fields.size() >= 2) {
+				exit_code = atoi(fields[1].c_str());
+				done = true;
+			}
+		}
+	}
+	if (!done) {
+		printf("\n[error] lost the connection to the merge service\n");
+	}
+	closeSocket(service);
+	return exit_code;
+}
@@ -0,0 +1,24 @@
+// service.h : -serve, a long-running merge service fed through a local socket, and the --submit client
+//
+
+#pragma once
+
+#include "merger.h"
+#include <string>
+#include <vector>
+
+// Where -serve listens and --submit connects when no socket is named: $XDG_RUNTIME_DIR/pkg-merge.sock,
+// /tmp/pkg-merge-<uid>.sock without it, %TEMP%\pkg-merge.sock on Windows
+std::string defaultServiceSocket();
+
+// Runs the merge service on the Unix domain socket `socket_path` until Ctrl+C. Requests are queued by
+// priority and run on --jobs persistent workers sharing one pool of copy buffers; each merge holds a slot
+// on the disks of its source and target (--hdd-jobs / --ssd-jobs), and a request for a merge that is
+// already queued or running follows that one instead of starting a second. --max-rate, --io-priority and
+// --queue-depth are set on the service and apply to every merge. Returns the exit code.
+int runService(const std::string& socket_path, const MergeOptions& options);
+
+// Hands a merge to the service: `args` are the usual source, target, mode and options, relative paths
+// are taken from the current directory. Prints what the merge reports while it runs and returns its
+// exit code, 1 if the service can't be reached.
+int submitMerge(const std::string& socket_path, const std::vector<std::string>& args, int priority);
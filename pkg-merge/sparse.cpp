@@ -0,0 +1,139 @@
+// sparse.cpp : zero-block detection and the hole-preserving copy loop behind --sparse
+//
+
+#include "stdafx.h"
+#include "sparse.h"
+#include "throttle.h"
+#include <string.h>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define ZERO_SCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+// Source of zeros for the hasher and for writing zeros where punching isn't possible
+static const char ZERO_BLOCK[64 * 1024] = {};
+
+bool isZeroBlock(const char* data, size_t length) {
+	size_t i = 0;
+#ifdef ZERO_SCAN_SSE2
+	// 64 bytes per step, leaving as soon as one of them isn't zero: data blocks usually fail right away
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 64 <= length; i += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(data + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(data + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(data + i + 48));
+		__m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF) {
+			return false;
+		}
+	}
+#endif
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		if (word != 0) return false;
+	}
+	for (; i < length; i++) {
+		if (data[i] != 0) return false;
+	}
+	return true;
+}
+
+// Helper function to leave `length` output bytes at `offset` unwritten. Below the size the output had
+// before, there may be old bytes, so the range is punched (or, where that isn't possible, zeroed).
+static bool skipOutput(FileHandle dst, uint64_t offset, uint64_t length, const SparseCopy& sparse) {
+	if (offset >= sparse.existing_size) {
+		return true;
+	}
+	length = std::min(length, sparse.existing_size - offset);
+	if (punchHole(dst, offset, length)) {
+		return true;
+	}
+	for (uint64_t done = 0; done < length;) {
+		size_t chunk = (size_t)std::min<uint64_t>(length - done, sizeof(ZERO_BLOCK));
+		if (writeAt(dst, ZERO_BLOCK, chunk, offset + done) != (int64_t)chunk) {
+			return false;
+		}
+		done += chunk;
+	}
+	return true;
+}
+
+bool copySparse(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset, uint64_t length,
+	char* buffer, size_t buffer_size, SparseCopy& sparse, const CopyProgress& progress, const CopyTap& tap) {
+	uint64_t copied = 0;
+	while (copied < length) {
+		uint64_t data_start, data_end;
+		nextDataRange(src, src_offset + copied, src_offset + length, data_start, data_end);
+
+		// A source hole costs neither a read nor a write
+		uint64_t hole = data_start - (src_offset + copied);
+		if (hole > 0) {
+			if (!skipOutput(dst, dst_offset + copied, hole, sparse)) {
+				return false;
+			}
+			if (tap) {
+				for (uint64_t fed = 0; fed < hole;) {
+					size_t chunk = (size_t)std::min<uint64_t>(hole - fed, sizeof(ZERO_BLOCK));
+					tap(ZERO_BLOCK, chunk);
+					fed += chunk;
+				}
+			}
+			sparse.hole_bytes += hole;
+			copied += hole;
+			progress(copied);
+			continue;
+		}
+
+		uint64_t region_end = data_end - src_offset;
+		while (copied < region_end) {
+			size_t chunk = (size_t)std::min<uint64_t>(region_end - copied, buffer_size);
+			int64_t got = readAt(src, buffer, chunk, src_offset + copied);
+			if (got <= 0) {
+				return false;
+			}
+			// Only data that is actually read counts against --max-rate, holes are free
+			throttleIo((uint64_t)got);
+			if (tap) {
+				tap(buffer, (size_t)got);
+			}
+
+			// Walk the chunk in output-aligned blocks; runs of data are written in one call, runs of
+			// whole zero blocks are skipped
+			uint64_t out = dst_offset + copied;
+			size_t run_start = 0;
+			bool run_zero = false;
+			size_t pos = 0;
+			while (pos <= (size_t)got) {
+				size_t block = 0;
+				bool zero = false;
+				if (pos < (size_t)got) {
+					block = std::min<size_t>((size_t)got - pos, SPARSE_BLOCK_SIZE - (size_t)((out + pos) % SPARSE_BLOCK_SIZE));
+					zero = block == SPARSE_BLOCK_SIZE && isZeroBlock(buffer + pos, block);
+				}
+				if (pos == (size_t)got || zero != run_zero) {
+					size_t run = pos - run_start;
+					if (run > 0 && run_zero) {
+						if (!skipOutput(dst, out + run_start, run, sparse)) {
+							return false;
+						}
+						sparse.zero_bytes += run;
+					} else if (run > 0 && writeAt(dst, buffer + run_start, run, out + run_start) != (int64_t)run) {
+						return false;
+					}
+					run_start = pos;
+					run_zero = zero;
+				}
+				if (pos == (size_t)got) break;
+				pos += block;
+			}
+
+			copied += (uint64_t)got;
+			progress(copied);
+		}
+	}
+	return true;
+}
@@ -0,0 +1,28 @@
+// sparse.h : --sparse copying that leaves holes in the output where the pieces only hold zeros
+//
+
+#pragma once
+
+#include "copyengine.h"
+
+// Zero detection works on output blocks of this size, aligned to the output offset, so every skipped
+// block can really become a hole
+const size_t SPARSE_BLOCK_SIZE = 4096;
+
+// State of one sparse output, shared by the copies of all its segments
+struct SparseCopy {
+	uint64_t			existing_size;	// Output bytes that were already there; skipped ranges below it are punched
+	uint64_t			hole_bytes;		// Source holes, neither read nor written
+	uint64_t			zero_bytes;		// Read, found to be all zeros and not written
+	SparseCopy(uint64_t existing_size) : existing_size(existing_size), hole_bytes(0), zero_bytes(0) {}
+	uint64_t skipped() const { return hole_bytes + zero_bytes; }
+};
+
+// True when all `length` bytes at `data` are zero. SSE2 where the compiler targets it (always on x64).
+bool isZeroBlock(const char* data, size_t length);
+
+// Copies like the buffered engine, but skips the source's holes without reading them and doesn't write
+// output blocks that would be all zeros. The output has to be sized to its final length afterwards
+// (resizeFile), in case it ends in a hole. `tap` still sees every byte, zeros included.
+bool copySparse(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset, uint64_t length,
+	char* buffer, size_t buffer_size, SparseCopy& sparse, const CopyProgress& progress, const CopyTap& tap = nullptr);
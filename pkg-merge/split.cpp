@@ -0,0 +1,178 @@
+// split.cpp : piece layout and the thread pool that writes the pieces of -split
+//
+
+#include "stdafx.h"
+#include "split.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <stdlib.h>
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+
+// Work is handed out in slices of at most this many bytes, so a split into two pieces still keeps every worker busy
+const uint64_t SPLIT_SLICE_SIZE = 256ULL * 1024 * 1024;
+
+struct SplitSlice {
+	size_t		piece;
+	uint64_t	start;		// Offset inside the piece
+	uint64_t	length;
+};
+
+bool parsePieceSize(const string& text, uint64_t& piece_size) {
+	string lower = text;
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	if (lower == "fat32") {
+		piece_size = FAT32_PIECE_SIZE;
+		return true;
+	}
+
+	char* end = NULL;
+	double value = strtod(text.c_str(), &end);
+	if (end == text.c_str() || value <= 0) {
+		return false;
+	}
+	double unit = 1;
+	switch (*end) {
+	case 'k': case 'K': unit = 1024.0; end++; break;
+	case 'm': case 'M': unit = 1024.0 * 1024; end++; break;
+	case 'g': case 'G': unit = 1024.0 * 1024 * 1024; end++; break;
+	default: break;
+	}
+	string rest = end;
+	if (rest != "" && rest != "B" && rest != "b") {
+		return false;
+	}
+	piece_size = (uint64_t)(value * unit);
+	return piece_size > 0;
+}
+
+string splitTitle(const fs::path& merged_file) {
+	string stem = merged_file.stem().string();
+	const string suffix = "-merged";
+	if (stem.length() > suffix.length() && stem.compare(stem.length() - suffix.length(), suffix.length(), suffix) == 0) {
+		return stem.substr(0, stem.length() - suffix.length());
+	}
+	return stem;
+}
+
+vector<MergeSegment> planSplit(const string& title, uint64_t merged_size, uint64_t piece_size, bool sc_tail,
+	const fs::path& target_dir) {
+	vector<MergeSegment> pieces;
+	uint64_t count = (merged_size + piece_size - 1) / piece_size;
+	for (uint64_t index = 0; index < count; index++) {
+		uint64_t offset = index * piece_size;
+		// Same rule as the merge: a lone piece is the root, never an _sc tail
+		bool sc = sc_tail && count > 1 && index == count - 1;
+		string suffix = sc ? "sc" : std::to_string(index);
+		string label = sc ? "_sc part (final)" : index == 0 ? "root" : "part " + suffix;
+		pieces.push_back({ target_dir / (title + "_" + suffix + ".pkg"), label, std::min(piece_size, merged_size - offset), offset });
+	}
+	return pieces;
+}
+
+// Helper function to remove the pieces of a failed split, a partial set would merge into a broken PKG
+static void removePieces(const vector<MergeSegment>& pieces, vector<FileHandle>& outputs) {
+	for (size_t i = 0; i < pieces.size(); i++) {
+		if (outputs[i] != INVALID_FILE) {
+			closeFile(outputs[i]);
+			outputs[i] = INVALID_FILE;
+			std::error_code error;
+			fs::remove(pieces[i].file, error);
+		}
+	}
+}
+
+bool splitMerged(const fs::path& merged_file, const vector<MergeSegment>& pieces, CopyEngine engine,
+	size_t buffer_size, unsigned threads, const CopyProgress& progress, string& error) {
+	// Every piece is sized up front, so the slices can land in any order
+	vector<FileHandle> outputs(pieces.size(), INVALID_FILE);
+	for (size_t i = 0; i < pieces.size(); i++) {
+		outputs[i] = openForWrite(pieces[i].file, true);
+		if (outputs[i] == INVALID_FILE || !preallocateFile(outputs[i], pieces[i].size)) {
+			error = "could not create '" + pieces[i].file.string() + "': " + lastIoError();
+			removePieces(pieces, outputs);
+			return false;
+		}
+	}
+
+	vector<SplitSlice> slices;
+	for (size_t i = 0; i < pieces.size(); i++) {
+		for (uint64_t start = 0; start < pieces[i].size; start += SPLIT_SLICE_SIZE) {
+			slices.push_back({ i, start, std::min(SPLIT_SLICE_SIZE, pieces[i].size - start) });
+		}
+	}
+	threads = std::max(1u, std::min<unsigned>(threads, (unsigned)slices.size()));
+
+	std::atomic<size_t> next_slice(0);
+	std::atomic<uint64_t> total_copied(0);
+	std::atomic<bool> failed(false);
+	std::mutex progress_lock;
+
+	auto worker = [&]() {
+		char* buffer = new char[buffer_size];
+		// Each worker reads the merged PKG through its own handle, always at an explicit offset
+		FileHandle source = openForRead(merged_file);
+		if (source == INVALID_FILE) {
+			string reason = lastIoError();
+			std::lock_guard<std::mutex> guard(progress_lock);
+			if (!failed) {
+				error = "could not open '" + merged_file.string() + "': " + reason;
+			}
+			failed = true;
+		}
+		size_t index;
+		while (!failed && (index = next_slice++) < slices.size()) {
+			const SplitSlice& slice = slices[index];
+			const MergeSegment& piece = pieces[slice.piece];
+
+			uint64_t reported = 0;
+			bool ok = copyRange(engine, source, piece.offset + slice.start, outputs[slice.piece], slice.start, slice.length,
+				buffer, buffer_size, [&](uint64_t copied) {
+					uint64_t total = total_copied += copied - reported;
+					reported = copied;
+					std::lock_guard<std::mutex> guard(progress_lock);
+					progress(total);
+				});
+
+			if (!ok) {
+				string reason = lastIoError();
+				std::lock_guard<std::mutex> guard(progress_lock);
+				if (!failed) {
+					error = "writing " + piece.file.filename().string() + " failed at offset " + std::to_string(slice.start + reported) + ": " + reason;
+				}
+				failed = true;
+			}
+		}
+		if (source != INVALID_FILE) {
+			closeFile(source);
+		}
+		delete[] buffer;
+	};
+
+	vector<std::thread> pool;
+	for (unsigned i = 0; i < threads; i++) {
+		pool.emplace_back(worker);
+	}
+	for (auto & thread : pool) {
+		thread.join();
+	}
+
+	for (size_t i = 0; !failed && i < pieces.size(); i++) {
+		if (!syncFile(outputs[i])) {
+			error = "could not flush '" + pieces[i].file.string() + "': " + lastIoError();
+			failed = true;
+		}
+	}
+	if (failed) {
+		removePieces(pieces, outputs);
+		return false;
+	}
+	for (auto & output : outputs) {
+		closeFile(output);
+	}
+	return true;
+}
@@ -0,0 +1,31 @@
+// split.h : -split, the reverse of a merge: cuts a merged PKG back into numbered pieces
+//
+
+#pragma once
+
+#include "copyengine.h"
+#include <string>
+#include <vector>
+
+// Piece size for "fat32": the largest multiple of 64 KB below FAT32's 4 GB file size limit
+const uint64_t FAT32_PIECE_SIZE = 0xFFFF0000ULL;
+
+// Parses "4G", "1500M", "fat32" or plain bytes into a piece size. Returns false on garbage or 0.
+bool parsePieceSize(const std::string& text, uint64_t& piece_size);
+
+// The title a merged PKG was written under: "Title-merged.pkg" is "Title", anything else its stem
+std::string splitTitle(const std::filesystem::path& merged_file);
+
+// Lays out the pieces of a `merged_size` byte PKG in `target_dir` under the names the scan groups back
+// together: `title_0.pkg` (the root, it keeps the PKG header), `title_1.pkg`, ... of `piece_size` bytes
+// each, the last one shorter. With `sc_tail` the last piece is `title_sc.pkg` instead.
+std::vector<MergeSegment> planSplit(const std::string& title, uint64_t merged_size, uint64_t piece_size, bool sc_tail,
+	const std::filesystem::path& target_dir);
+
+// Writes every piece of `pieces` (from planSplit) with `threads` workers. The pieces are preallocated,
+// then filled in slices through copyRange with positional reads from `merged_file`, so they are cloned
+// or copied in the kernel wherever the filesystem allows. `progress` receives the total bytes written
+// across all workers, one call at a time. Pieces written so far are removed on failure, and `error` says
+// what broke.
+bool splitMerged(const std::filesystem::path& merged_file, const std::vector<MergeSegment>& pieces, CopyEngine engine,
+	size_t buffer_size, unsigned threads, const CopyProgress& progress, std::string& error);
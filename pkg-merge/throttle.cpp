@@ -0,0 +1,114 @@
+// throttle.cpp : token bucket rate limit and I/O priority
+//
+
+#include "stdafx.h"
+#include "throttle.h"
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+using std::string;
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<uint64_t> rate_limit(0);
+static std::mutex bucket_lock;
+static double bucket_tokens = 0;		// May go negative: that debt is what the caller sleeps off
+static Clock::time_point bucket_refilled;
+
+void setMaxRate(uint64_t bytes_per_second) {
+	std::lock_guard<std::mutex> guard(bucket_lock);
+	rate_limit = bytes_per_second;
+	bucket_tokens = bytes_per_second / 4.0;
+	bucket_refilled = Clock::now();
+}
+
+uint64_t maxRate() {
+	return rate_limit.load(std::memory_order_relaxed);
+}
+
+void throttleIo(uint64_t bytes) {
+	uint64_t limit = rate_limit.load(std::memory_order_relaxed);
+	if (limit == 0 || bytes == 0) {
+		return;
+	}
+	double wait;
+	{
+		std::lock_guard<std::mutex> guard(bucket_lock);
+		auto now = Clock::now();
+		double refill = std::chrono::duration<double>(now - bucket_refilled).count() * (double)limit;
+		bucket_tokens = std::min((double)limit / 4.0, bucket_tokens + refill);
+		bucket_refilled = now;
+		bucket_tokens -= (double)bytes;
+		wait = bucket_tokens < 0 ? -bucket_tokens / (double)limit : 0;
+	}
+	// Every thread sleeps off the debt it saw, so concurrent copies queue up behind each other
+	if (wait > 0) {
+		std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+	}
+}
+
+CopyProgress throttledProgress(const CopyProgress& progress) {
+	if (maxRate() == 0) {
+		return progress;
+	}
+	uint64_t paid = 0;
+	return [progress, paid](uint64_t copied) mutable {
+		throttleIo(copied - paid);
+		paid = copied;
+		progress(copied);
+	};
+}
+
+bool setIoPriority(IoPriority priority) {
+	if (priority == IoPriority::Normal) {
+		return true;
+	}
+#ifdef _WIN32
+	// Background mode lowers I/O and memory priority together; there is no separate idle class
+	return SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN) != 0;
+#elif defined(__linux__) && defined(SYS_ioprio_set)
+	// Values from linux/ioprio.h, which older kernels' headers don't ship
+	const int IOPRIO_WHO_PROCESS = 1;
+	const int IOPRIO_CLASS_SHIFT = 13;
+	const int IOPRIO_CLASS_BE = 2;
+	const int IOPRIO_CLASS_IDLE = 3;
+	int value = priority == IoPriority::Idle ? IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT : (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7;
+	return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) == 0;
+#else
+	return false;
+#endif
+}
+
+bool parseRate(const string& text, uint64_t& bytes_per_second) {
+	char* end = NULL;
+	double value = strtod(text.c_str(), &end);
+	if (end == text.c_str() || value <= 0) {
+		return false;
+	}
+	double unit = 1;
+	switch (*end) {
+	case 'k': case 'K': unit = 1024.0; end++; break;
+	case 'm': case 'M': unit = 1024.0 * 1024; end++; break;
+	case 'g': case 'G': unit = 1024.0 * 1024 * 1024; end++; break;
+	default: break;
+	}
+	// "50MB", "50M/s" and "50MB/s" all mean the same
+	string rest = end;
+	if (rest != "" && rest != "B" && rest != "b" && rest != "/s" && rest != "B/s" && rest != "b/s") {
+		return false;
+	}
+	bytes_per_second = (uint64_t)(value * unit);
+	return bytes_per_second > 0;
+}
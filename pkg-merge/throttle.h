@@ -0,0 +1,31 @@
+// throttle.h : --max-rate token bucket shared by every copy path, and --io-priority
+//
+
+#pragma once
+
+#include "copyengine.h"
+
+enum class IoPriority {
+	Normal,
+	Low,			// Lowest best-effort level: still served, but after everything else
+	Idle			// Only served while the disk has nothing else to do
+};
+
+// Caps the bytes copied per second across all threads, groups and engines. 0 removes the cap.
+void setMaxRate(uint64_t bytes_per_second);
+uint64_t maxRate();
+
+// Takes `bytes` from the shared bucket and sleeps until they are paid for. The bucket holds a quarter
+// second's worth, so short bursts pass at full speed and the average stays at the limit. Free without a limit.
+void throttleIo(uint64_t bytes);
+
+// Wraps a progress callback so every chunk it reports is paid for before the next one starts. Returns
+// `progress` itself when there's no limit.
+CopyProgress throttledProgress(const CopyProgress& progress);
+
+// Lowers the I/O priority of this process (ioprio_set on Linux, background mode on Windows). Has to run
+// before any worker thread starts so they inherit it. Returns false if the system refused.
+bool setIoPriority(IoPriority priority);
+
+// Parses "50M", "1.5G", "800k" or plain bytes into bytes per second. Returns false on garbage.
+bool parseRate(const std::string& text, uint64_t& bytes_per_second);
@@ -0,0 +1,282 @@
+// uringengine.cpp : pipelined io_uring copy engine talking to the kernel through the raw syscalls
+//
+
+#include "stdafx.h"
+#include "uringengine.h"
+
+static unsigned queue_depth = 4;
+
+void setIoUringQueueDepth(unsigned depth) {
+	queue_depth = depth;
+}
+
+unsigned ioUringQueueDepth() {
+	return queue_depth;
+}
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+
+static int uringSetup(unsigned entries, io_uring_params* params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool isIoUringSupported() {
+	static int supported = -1;
+	if (supported < 0) {
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		int fd = uringSetup(1, &params);
+		supported = fd >= 0 ? 1 : 0;
+		if (fd >= 0) close(fd);
+	}
+	return supported == 1;
+}
+
+// One ring with its buffer pool, owned by a single thread
+struct UringRing {
+	int					fd;
+	unsigned			depth;
+	size_t				buffer_size;
+	char*				buffers;		// depth * buffer_size bytes, page aligned
+	bool				registered;		// Buffers pinned with IORING_REGISTER_BUFFERS
+
+	void*				sq_ring;
+	size_t				sq_ring_size;
+	void*				cq_ring;
+	size_t				cq_ring_size;
+	io_uring_sqe*		sqes;
+	size_t				sqes_size;
+
+	unsigned*			sq_tail;
+	unsigned*			sq_mask;
+	unsigned*			sq_array;
+	unsigned*			cq_head;
+	unsigned*			cq_tail;
+	unsigned*			cq_mask;
+	io_uring_cqe*		cqes;
+	unsigned			queued;			// SQEs filled in but not yet passed to io_uring_enter
+
+	UringRing() : fd(-1), depth(0), buffer_size(0), buffers(nullptr), registered(false), sq_ring(MAP_FAILED), sq_ring_size(0),
+		cq_ring(MAP_FAILED), cq_ring_size(0), sqes((io_uring_sqe*)MAP_FAILED), sqes_size(0), queued(0) {}
+	~UringRing() { release(); }
+
+	bool create(unsigned ring_depth, size_t ring_buffer_size);
+	void release();
+	void queue(uint8_t opcode, int file, unsigned slot, size_t skip, unsigned length, uint64_t offset);
+};
+
+bool UringRing::create(unsigned ring_depth, size_t ring_buffer_size) {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	fd = uringSetup(ring_depth, &params);
+	if (fd < 0) return false;
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap) {
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+	}
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED) return false;
+	if (single_mmap) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED) return false;
+	}
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	sqes = (io_uring_sqe*)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) return false;
+
+	sq_tail = (unsigned*)((char*)sq_ring + params.sq_off.tail);
+	sq_mask = (unsigned*)((char*)sq_ring + params.sq_off.ring_mask);
+	sq_array = (unsigned*)((char*)sq_ring + params.sq_off.array);
+	cq_head = (unsigned*)((char*)cq_ring + params.cq_off.head);
+	cq_tail = (unsigned*)((char*)cq_ring + params.cq_off.tail);
+	cq_mask = (unsigned*)((char*)cq_ring + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe*)((char*)cq_ring + params.cq_off.cqes);
+
+	depth = ring_depth;
+	buffer_size = ring_buffer_size;
+	long page = sysconf(_SC_PAGESIZE);
+	if (posix_memalign((void**)&buffers, (size_t)page, depth * buffer_size) != 0) {
+		buffers = nullptr;
+		return false;
+	}
+
+	// Fixed buffers skip the per-I/O page pinning; RLIMIT_MEMLOCK may refuse them on older kernels,
+	// in which case plain READ/WRITE on the same memory still works
+	std::vector<iovec> iovs(depth);
+	for (unsigned i = 0; i < depth; i++) {
+		iovs[i].iov_base = buffers + i * buffer_size;
+		iovs[i].iov_len = buffer_size;
+	}
+	registered = uringRegister(fd, IORING_REGISTER_BUFFERS, iovs.data(), depth) == 0;
+	return true;
+}
+
+void UringRing::release() {
+	if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+	if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+	if (fd >= 0) close(fd);
+	free(buffers);
+	fd = -1;
+	depth = 0;
+	buffer_size = 0;
+	buffers = nullptr;
+	registered = false;
+	sq_ring = cq_ring = MAP_FAILED;
+	sqes = (io_uring_sqe*)MAP_FAILED;
+	queued = 0;
+}
+
+void UringRing::queue(uint8_t opcode, int file, unsigned slot, size_t skip, unsigned length, uint64_t offset) {
+	unsigned tail = *sq_tail;
+	unsigned index = tail & *sq_mask;
+	io_uring_sqe* sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	bool read = opcode == IORING_OP_READ_FIXED;
+	if (!registered) {
+		opcode = read ? IORING_OP_READ : IORING_OP_WRITE;
+	}
+	sqe->opcode = opcode;
+	sqe->fd = file;
+	sqe->off = offset;
+	sqe->addr = (uint64_t)(uintptr_t)(buffers + slot * buffer_size + skip);
+	sqe->len = length;
+	sqe->buf_index = (uint16_t)slot;
+	sqe->user_data = slot;
+
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	queued++;
+}
+
+// State of one buffer of the ring while it walks through read -> write -> next read
+struct UringSlot {
+	uint64_t	position;	// Offset of the chunk inside the range
+	unsigned	length;
+	unsigned	done;		// Bytes of the current read or write completed so far
+	bool		writing;
+};
+
+EngineResult copyWithIoUring(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset,
+	uint64_t length, size_t chunk_size, uint64_t& copied, const CopyProgress& progress) {
+	// Buffers get registered once, so keep the ring around for every copy this thread does
+	thread_local UringRing ring;
+	if (ring.fd < 0 || ring.depth != queue_depth || ring.buffer_size != chunk_size) {
+		ring.release();
+		if (!ring.create(queue_depth, chunk_size)) {
+			ring.release();
+			return EngineResult::Unsupported;
+		}
+	}
+
+	std::vector<UringSlot> slots(ring.depth);
+	uint64_t next = copied;		// Next chunk to hand to an idle slot
+	// Writes complete in any order. `copied` only moves over the front that is fully written, so a
+	// checkpoint never covers a chunk still in flight; chunks done ahead of it wait here.
+	std::map<uint64_t, unsigned> written_ahead;
+	unsigned in_flight = 0;
+	bool failed = false;
+
+	auto startRead = [&](unsigned slot) {
+		slots[slot].position = next;
+		slots[slot].length = (unsigned)std::min<uint64_t>(length - next, chunk_size);
+		slots[slot].done = 0;
+		slots[slot].writing = false;
+		next += slots[slot].length;
+		ring.queue(IORING_OP_READ_FIXED, src, slot, 0, slots[slot].length, src_offset + slots[slot].position);
+		in_flight++;
+	};
+
+	for (unsigned slot = 0; slot < ring.depth && next < length; slot++) {
+		startRead(slot);
+	}
+
+	while (in_flight > 0) {
+		int entered = uringEnter(ring.fd, ring.queued, 1, IORING_ENTER_GETEVENTS);
+		if (entered < 0) {
+			if (errno == EINTR) continue;
+			// The ring itself is broken; nothing more will complete
+			ring.release();
+			return EngineResult::Failed;
+		}
+		ring.queued -= std::min<unsigned>(ring.queued, (unsigned)entered);
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+			unsigned slot = (unsigned)cqe->user_data;
+			int result = cqe->res;
+			UringSlot& state = slots[slot];
+			in_flight--;
+
+			if (result == -EINTR || result == -EAGAIN) {
+				result = 0;		// Resubmit the same request below
+			} else if (result <= 0) {
+				// I/O error, or the source shrank under us
+				errno = result < 0 ? -result : EIO;
+				failed = true;
+			}
+			if (failed) continue;
+
+			state.done += (unsigned)result;
+			if (state.done < state.length) {
+				// Short transfer, go again for the rest of this chunk
+				uint8_t opcode = state.writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+				FileHandle file = state.writing ? dst : src;
+				uint64_t base = state.writing ? dst_offset : src_offset;
+				ring.queue(opcode, file, slot, state.done, state.length - state.done, base + state.position + state.done);
+				in_flight++;
+			} else if (!state.writing) {
+				state.writing = true;
+				state.done = 0;
+				ring.queue(IORING_OP_WRITE_FIXED, dst, slot, 0, state.length, dst_offset + state.position);
+				in_flight++;
+			} else {
+				written_ahead[state.position] = state.length;
+				uint64_t before = copied;
+				for (auto it = written_ahead.begin(); it != written_ahead.end() && it->first == copied; it = written_ahead.erase(it)) {
+					copied += it->second;
+				}
+				if (copied != before) {
+					progress(copied);
+				}
+				if (next < length) {
+					startRead(slot);
+				}
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return failed ? EngineResult::Failed : EngineResult::Done;
+}
+
+#endif
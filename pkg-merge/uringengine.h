@@ -0,0 +1,21 @@
+// uringengine.h : pipelined io_uring copy engine (Linux only)
+//
+
+#pragma once
+
+#include "copyengine.h"
+
+// Number of buffers in the ring, i.e. how many reads and writes can be in flight at once
+void setIoUringQueueDepth(unsigned depth);
+unsigned ioUringQueueDepth();
+
+#ifdef __linux__
+
+bool isIoUringSupported();
+
+// Keeps up to the queue depth of `chunk_size` reads and writes in flight over a ring of page-aligned
+// buffers registered with the kernel. The ring is set up once per thread and reused for later copies.
+EngineResult copyWithIoUring(FileHandle src, uint64_t src_offset, FileHandle dst, uint64_t dst_offset,
+	uint64_t length, size_t chunk_size, uint64_t& copied, const CopyProgress& progress);
+
+#endif
@@ -0,0 +1,215 @@
+// verify.cpp : digest table parsing and the worker pool that hashes the regions of a PKG
+//
+
+#include "stdafx.h"
+#include "verify.h"
+#include "pkgheader.h"
+#include "checksum.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+
+using std::string;
+using std::vector;
+
+// Bytes hashed per step; mapped pieces are hashed in place, others are read into a buffer of this size
+const size_t VERIFY_CHUNK_SIZE = 4 * 1024 * 1024;
+// More entries than any real package has; a larger count means the table is garbage
+const uint32_t MAX_PKG_ENTRIES = 65536;
+
+size_t VerifyReport::failures() const {
+	return (size_t)std::count_if(checks.begin(), checks.end(), [](const DigestCheck& check) {
+		return check.result != DigestResult::Match;
+	});
+}
+
+unsigned defaultVerifyThreads() {
+	unsigned cores = std::thread::hardware_concurrency();
+	return cores == 0 ? 4 : cores;
+}
+
+// Helper function to turn a stored digest into the hex form Sha256::hex() produces
+static string digestHex(const uint8_t* digest) {
+	static const char DIGITS[] = "0123456789abcdef";
+	string hex;
+	for (size_t i = 0; i < 32; i++) {
+		hex += DIGITS[digest[i] >> 4];
+		hex += DIGITS[digest[i] & 0x0F];
+	}
+	return hex;
+}
+
+// Helper function to tell an all-zero digest field (nothing stored) from a real one
+static bool isDigestStored(const uint8_t* digest) {
+	for (size_t i = 0; i < 32; i++) {
+		if (digest[i] != 0) return true;
+	}
+	return false;
+}
+
+static void addCheck(VerifyReport& report, const string& name, uint64_t offset, uint64_t size, const uint8_t* digest) {
+	if (!isDigestStored(digest)) {
+		return;
+	}
+	DigestCheck check;
+	check.name = name;
+	check.offset = offset;
+	check.size = size;
+	check.expected = digestHex(digest);
+	report.checks.push_back(check);
+}
+
+// Helper function to read `length` bytes at `offset` of the PKG in one piece
+static bool readExact(const ConcatReader& reader, vector<unsigned char>& data, uint64_t offset, size_t length) {
+	data.resize(length);
+	return offset + length <= reader.size() && reader.pread(data.data(), length, offset) == (int64_t)length;
+}
+
+PkgVerifier::PkgVerifier(const PkgPartSet& part_set) : reader(part_set) {}
+
+bool PkgVerifier::open(string& error) {
+	result = VerifyReport();
+	if (!reader.open()) {
+		error = "could not open the pieces: " + lastIoError();
+		return false;
+	}
+	return collectChecks(error);
+}
+
+uint64_t PkgVerifier::plannedBytes() const {
+	uint64_t total = 0;
+	for (auto & check : result.checks) {
+		total += check.size;
+	}
+	return total;
+}
+
+// Lists the regions to hash: header digests first, then every entry the digests entry covers
+bool PkgVerifier::collectChecks(string& error) {
+	VerifyReport& report = result;
+	vector<unsigned char> raw;
+	PkgHeader header;
+	if (!readExact(reader, raw, 0, PKG_DIGEST_HEADER_SIZE) || !parsePkgHeader(raw.data(), raw.size(), header, error)) {
+		if (error.empty()) error = "PKG is too small to hold a header";
+		return false;
+	}
+
+	addCheck(report, "body", header.body_offset, header.body_size, header.body_digest);
+	if (header.pfs_image_size > 0) {
+		addCheck(report, "PFS image", header.pfs_image_offset, header.pfs_image_size, header.pfs_image_digest);
+		addCheck(report, "PFS signed area", header.pfs_image_offset, std::min<uint64_t>(header.pfs_signed_size, header.pfs_image_size),
+			header.pfs_signed_digest);
+	}
+
+	if (header.entry_count > MAX_PKG_ENTRIES) {
+		error = "entry table claims " + std::to_string(header.entry_count) + " entries, the header is damaged";
+		return false;
+	}
+	if (!readExact(reader, raw, header.entry_table_offset, (size_t)header.entry_count * PKG_ENTRY_SIZE)) {
+		error = "entry table at " + std::to_string(header.entry_table_offset) + " is past the end of the PKG";
+		return false;
+	}
+	vector<PkgEntry> entries = parsePkgEntries(raw.data(), header.entry_count);
+
+	auto digests = std::find_if(entries.begin(), entries.end(), [](const PkgEntry& entry) { return entry.id == PKG_ENTRY_DIGESTS; });
+	if (digests == entries.end()) {
+		return true;
+	}
+	vector<unsigned char> table;
+	if (!readExact(reader, table, digests->offset, std::min<size_t>(digests->size, entries.size() * 32))) {
+		error = "digests entry at " + std::to_string(digests->offset) + " is past the end of the PKG";
+		return false;
+	}
+	auto names = std::find_if(entries.begin(), entries.end(), [](const PkgEntry& entry) { return entry.id == PKG_ENTRY_NAMES; });
+	vector<unsigned char> name_data;
+	if (names != entries.end() && !readExact(reader, name_data, names->offset, names->size)) {
+		name_data.clear();
+	}
+
+	for (size_t i = 0; i < entries.size() && (i + 1) * 32 <= table.size(); i++) {
+		const PkgEntry& entry = entries[i];
+		// The digests entry can't contain its own digest
+		if (entry.id == PKG_ENTRY_DIGESTS) continue;
+		if (!isDigestStored(table.data() + i * 32)) continue;
+		if (entry.encrypted()) {
+			report.encrypted++;
+			continue;
+		}
+		string name;
+		if (entry.name_offset > 0 && entry.name_offset < name_data.size()) {
+			const char* start = (const char*)name_data.data() + entry.name_offset;
+			name.assign(start, strnlen(start, name_data.size() - entry.name_offset));
+		} else if (pkgEntryName(entry.id) != nullptr) {
+			name = pkgEntryName(entry.id);
+		} else {
+			char id[32];
+			snprintf(id, sizeof(id), "entry 0x%04x", entry.id);
+			name = id;
+		}
+		addCheck(report, name, entry.offset, entry.size, table.data() + i * 32);
+	}
+	return true;
+}
+
+void PkgVerifier::run(unsigned threads, const CopyProgress& progress) {
+	auto started = std::chrono::steady_clock::now();
+	VerifyReport& report = result;
+	reader.adviseSequential();
+
+	// Largest first, so the PFS image that takes longest starts right away and the entries fill the other cores
+	vector<size_t> order(report.checks.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) { return report.checks[lhs].size > report.checks[rhs].size; });
+	report.threads = std::max(1u, std::min<unsigned>(threads, (unsigned)order.size()));
+
+	std::atomic<size_t> next_check(0);
+	std::atomic<uint64_t> total_hashed(0);
+	std::mutex progress_lock;
+
+	auto worker = [&]() {
+		vector<char> buffer;
+		size_t index;
+		while ((index = next_check++) < order.size()) {
+			DigestCheck& check = report.checks[order[index]];
+			if (check.offset + check.size > reader.size()) {
+				continue;		// Left Unreadable: the region ends past the PKG
+			}
+			Sha256 sha;
+			bool ok = true;
+			for (uint64_t hashed = 0; ok && hashed < check.size;) {
+				size_t chunk = (size_t)std::min<uint64_t>(check.size - hashed, VERIFY_CHUNK_SIZE);
+				const char* data = reader.mapped(check.offset + hashed, chunk);
+				if (data == nullptr) {
+					buffer.resize(VERIFY_CHUNK_SIZE);
+					ok = reader.pread(buffer.data(), chunk, check.offset + hashed) == (int64_t)chunk;
+					data = buffer.data();
+				}
+				if (!ok) break;
+				sha.update(data, chunk);
+				hashed += chunk;
+				uint64_t total = total_hashed += chunk;
+				std::lock_guard<std::mutex> guard(progress_lock);
+				progress(total);
+			}
+			if (ok) {
+				check.actual = sha.hex();
+				check.result = check.actual == check.expected ? DigestResult::Match : DigestResult::Mismatch;
+			}
+		}
+	};
+
+	vector<std::thread> pool;
+	for (unsigned i = 1; i < report.threads; i++) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for (auto & thread : pool) {
+		thread.join();
+	}
+
+	report.bytes = total_hashed;
+	report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
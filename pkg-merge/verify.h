@@ -0,0 +1,66 @@
+// verify.h : --verify, checks a PKG against the SHA-256 digests it stores for its entries, body and PFS image
+//
+
+#pragma once
+
+#include "pkgparts.h"
+#include "concatreader.h"
+#include <string>
+#include <vector>
+
+enum class DigestResult { Match, Mismatch, Unreadable };
+
+// One region of the PKG with the digest the package stores for it
+struct DigestCheck {
+	std::string		name;			// "param.sfo", "entry 0x1234", "body", "PFS image"
+	uint64_t		offset;			// Position in the merged PKG
+	uint64_t		size;
+	std::string		expected;		// Hex SHA-256 from the package
+	std::string		actual;			// Hex SHA-256 of the bytes, empty if they couldn't be read
+	DigestResult	result;
+	DigestCheck() : offset(0), size(0), result(DigestResult::Unreadable) {}
+};
+
+struct VerifyReport {
+	std::vector<DigestCheck>	checks;
+	size_t						encrypted;		// Entries skipped: their digest covers the decrypted data
+	uint64_t					bytes;			// Hashed in all
+	double						seconds;
+	unsigned					threads;
+	VerifyReport() : encrypted(0), bytes(0), seconds(0), threads(0) {}
+	size_t failures() const;
+};
+
+// Hashing is CPU bound, so the default is one worker per core
+unsigned defaultVerifyThreads();
+
+// Checks the PKG a part set makes up (a merged file is a set with only a root) against the SHA-256 digests
+// it stores: the unencrypted entries listed in the digests entry, the body, and the PFS image and its
+// signed prefix.
+class PkgVerifier {
+public:
+	explicit PkgVerifier(const PkgPartSet& part_set);
+
+	PkgVerifier(const PkgVerifier&) = delete;
+	PkgVerifier& operator=(const PkgVerifier&) = delete;
+
+	// Maps the pieces and reads the header and entry table to list the regions to hash. Returns false
+	// with `error` set if they can't be read.
+	bool open(std::string& error);
+
+	// Sum of the region sizes, what run() will hash
+	uint64_t plannedBytes() const;
+
+	// Hashes the regions with `threads` workers at once, largest first, straight from the mapped pieces
+	// with sequential read-ahead. `progress` receives the bytes hashed so far across all workers, one call
+	// at a time. Digests that don't match end up in report().
+	void run(unsigned threads, const CopyProgress& progress);
+
+	const VerifyReport& report() const { return result; }
+
+private:
+	bool collectChecks(std::string& error);
+
+	ConcatReader		reader;
+	VerifyReport		result;
+};
@@ -0,0 +1,325 @@
+// watch.cpp : --watch, merging the pieces of a split PKG while they are still downloading
+//
+
+#include "stdafx.h"
+#include "watch.h"
+#include "pkgheader.h"
+#include "directio.h"
+#include "progress.h"
+#include <map>
+#include <set>
+#include <memory>
+#include <chrono>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+
+// A file that was already there when the watch started counts as finished once it hasn't changed for this long
+const int WATCH_SETTLE_SECONDS = 10;
+const int WATCH_POLL_MS = 1000;
+
+// Helper function for the age of a file's last modification, in seconds
+static long long secondsSinceModified(const fs::path& file) {
+	std::error_code error;
+	auto mtime = fs::last_write_time(file, error);
+	if (error) return 0;
+	return std::chrono::duration_cast<std::chrono::seconds>(fs::file_time_type::clock::now() - mtime).count();
+}
+
+DirectoryWatcher::DirectoryWatcher(const fs::path& dir) : dir(dir), notify_fd(-1) {
+}
+
+DirectoryWatcher::~DirectoryWatcher() {
+#ifdef __linux__
+	if (notify_fd >= 0) {
+		close(notify_fd);
+	}
+#endif
+}
+
+bool DirectoryWatcher::start() {
+#ifdef __linux__
+	notify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (notify_fd >= 0 && inotify_add_watch(notify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) >= 0) {
+		return true;
+	}
+	if (notify_fd >= 0) {
+		close(notify_fd);
+		notify_fd = -1;
+	}
+#endif
+	// Polling; whatever is there now has been seen already and is judged by its age instead
+	std::error_code error;
+	for (auto & file : fs::directory_iterator(dir, error)) {
+		std::error_code size_error;
+		uint64_t size = file.file_size(size_error);
+		snapshots[file.path().filename().string()] = { size, (long long)file.last_write_time(size_error).time_since_epoch().count(), true };
+	}
+	return !error;
+}
+
+vector<string> DirectoryWatcher::wait(int timeout_ms) {
+	vector<string> finished;
+#ifdef __linux__
+	if (notify_fd >= 0) {
+		pollfd descriptor = { notify_fd, POLLIN, 0 };
+		if (poll(&descriptor, 1, timeout_ms) <= 0) {
+			return finished;
+		}
+		alignas(inotify_event) char events[16384];
+		ssize_t length;
+		while ((length = read(notify_fd, events, sizeof(events))) > 0) {
+			for (char* event = events; event < events + length;) {
+				const inotify_event* info = (const inotify_event*)event;
+				if (info->len > 0) {
+					finished.push_back(info->name);
+				}
+				event += sizeof(inotify_event) + info->len;
+			}
+		}
+		return finished;
+	}
+#endif
+	std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+	std::error_code error;
+	for (auto & file : fs::directory_iterator(dir, error)) {
+		string name = file.path().filename().string();
+		std::error_code stat_error;
+		Snapshot now = { file.file_size(stat_error), (long long)file.last_write_time(stat_error).time_since_epoch().count(), false };
+		if (stat_error) continue;
+		auto it = snapshots.find(name);
+		if (it != snapshots.end() && it->second.size == now.size && it->second.mtime == now.mtime) {
+			if (!it->second.reported) {
+				it->second.reported = true;
+				finished.push_back(name);
+			}
+			continue;
+		}
+		snapshots[name] = now;
+	}
+	return finished;
+}
+
+// State of the watched merge: what has arrived, and how far the output has got
+struct WatchState {
+	string					title_id;		// Set once the root has arrived
+	fs::path				root;
+	PkgHeader				header;
+	std::map<int, fs::path>	pieces;			// Finished pieces waiting for their turn, by number
+	std::map<string, std::map<int, fs::path>> early_pieces;	// Pieces that finished before any root, by title
+	fs::path				sc_part;
+	std::set<string>		merged_names;
+	int						next_part;
+	uint64_t				merged;
+	WatchState() : next_part(1), merged(0) {}
+};
+
+// Helper function to append one finished piece to the output. The copy loop only moves the meter's counter;
+// the root is counted quietly, the other pieces are drawn by its reporter.
+static bool appendPiece(const fs::path& source, const string& label, FileHandle merged, WatchState& state, CopyEngine engine,
+	char* buffer, size_t buffer_size, ProgressMeter& meter, const OutputSink& output) {
+	std::error_code error;
+	uint64_t size = fs::file_size(source, error);
+	if (error || size == 0) {
+		printTo(output, "[error] could not read the size of '%s'\n", source.filename().string().c_str());
+		return false;
+	}
+	if (state.merged + size > state.header.package_size) {
+		printTo(output, "[error] %s would take the output past the %llu bytes the PKG header declares\n", label.c_str(),
+			(unsigned long long)state.header.package_size);
+		return false;
+	}
+	FileHandle input = openForRead(source);
+	if (input == INVALID_FILE) {
+		printTo(output, "[error] could not open '%s': %s\n", source.string().c_str(), lastIoError().c_str());
+		return false;
+	}
+
+	CopyEngine used = engine;
+	meter.beginPart(label, state.merged == 0);
+	bool ok = copyRange(engine, input, 0, merged, state.merged, size, buffer, buffer_size, [&](uint64_t copied) {
+		meter.update(state.merged + copied);
+	}, &used, nullptr);
+	closeFile(input);
+	const PartTiming& timing = meter.endPart(engineName(used));
+	if (!ok) {
+		printTo(output, "\n[error] %s engine failed on '%s': %s\n", engineName(used), source.string().c_str(), lastIoError().c_str());
+		return false;
+	}
+	printTo(output, "done (%s, %.2f s, %.1f MB/s)\n", timing.method.c_str(), timing.seconds, timing.megabytesPerSecond());
+	state.merged += size;
+	state.merged_names.insert(source.filename().string());
+	return true;
+}
+
+string watchAndMerge(const fs::path& source_dir, const fs::path& target_dir, CopyEngine engine, const OutputSink& output,
+	MetricsRecorder* metrics) {
+	auto watch_started = std::chrono::steady_clock::now();
+	DirectoryWatcher watcher(source_dir);
+	if (!watcher.start()) {
+		printTo(output, "[error] could not watch '%s': %s\n", source_dir.string().c_str(), lastIoError().c_str());
+		return "";
+	}
+
+	// Files that are already there may still be downloading; they count once they've been left alone a while
+	std::map<string, fs::path> unsettled;
+	std::error_code error;
+	for (auto & file : fs::directory_iterator(source_dir, error)) {
+		unsettled[file.path().filename().string()] = file.path();
+	}
+
+	printTo(output, "[info] watching %s for PKG pieces (Ctrl+C to stop)...\n", source_dir.string().c_str());
+
+	WatchState state;
+	fs::path partial_file;
+	FileHandle merged = INVALID_FILE;
+	std::unique_ptr<ProgressMeter> meter;		// Once the root has told the package size
+	char* buffer = nullptr;
+	size_t buffer_size = 0;
+	bool ok = true;
+	string waiting_shown;
+
+	while (ok) {
+		vector<string> finished = watcher.wait(WATCH_POLL_MS);
+		for (auto it = unsettled.begin(); it != unsettled.end();) {
+			if (secondsSinceModified(it->second) >= WATCH_SETTLE_SECONDS) {
+				finished.push_back(it->first);
+				it = unsettled.erase(it);
+			} else {
+				++it;
+			}
+		}
+
+		for (auto & name : finished) {
+			unsettled.erase(name);
+			fs::path file = source_dir / name;
+			string title_id;
+			int part;
+			bool sc;
+			if (fs::path(name).extension() != ".pkg" || name.find("-merged") != string::npos || !parsePieceName(name, title_id, part, sc)) {
+				continue;
+			}
+			if (state.merged_names.count(name) != 0) {
+				printTo(output, "[error] '%s' was written again after it was merged; merge the folder again without --watch\n", name.c_str());
+				ok = false;
+				break;
+			}
+
+			if (sc) {
+				// As with -single, the _sc tail belongs to the package whatever its name, and names the output
+				state.sc_part = file;
+				printTo(output, "[success] _sc PKG file %s finished, it goes last\n", name.c_str());
+				continue;
+			}
+
+			if (state.title_id.empty()) {
+				string error_text;
+				if (readPkgHeader(file, state.header, error_text)) {
+					if (state.header.package_size == 0) {
+						printTo(output, "[error] the PKG header of '%s' doesn't declare a package size, which --watch needs\n", name.c_str());
+						ok = false;
+						break;
+					}
+					state.title_id = title_id;
+					state.root = file;
+					state.pieces = state.early_pieces[title_id];
+					state.early_pieces.clear();
+					printTo(output, "[success] found root PKG file for %s (%s, %llu bytes in all)\n", title_id.c_str(), state.header.content_id.c_str(),
+						(unsigned long long)state.header.package_size);
+					continue;
+				}
+				state.early_pieces[title_id][part] = file;
+				continue;
+			}
+			if (title_id == state.title_id && file != state.root) {
+				state.pieces[part] = file;
+			}
+		}
+		if (!ok || state.title_id.empty()) continue;
+
+		if (merged == INVALID_FILE) {
+			partial_file = target_dir / (state.title_id + "-merged.pkg.partial");
+			merged = openForWrite(partial_file, true);
+			if (merged == INVALID_FILE) {
+				printTo(output, "[error] could not create '%s': %s\n", partial_file.string().c_str(), lastIoError().c_str());
+				ok = false;
+				break;
+			}
+			buffer_size = mergeBufferSize(fs::file_size(state.root));
+			buffer = allocateAligned(buffer_size);
+			meter.reset(new ProgressMeter(state.header.package_size, 0, [&output](const string& line) { emit(output, "\r" + line); }, true));
+			printTo(output, "\t[work] copying root package file to %s...", partial_file.filename().string().c_str());
+			ok = appendPiece(state.root, "root", merged, state, engine, buffer, buffer_size, *meter, output);
+		}
+
+		// Everything that's next in line goes in now; later pieces wait for the gap to fill
+		for (auto it = state.pieces.find(state.next_part); ok && it != state.pieces.end(); it = state.pieces.find(state.next_part)) {
+			ok = appendPiece(it->second, "part " + std::to_string(state.next_part), merged, state, engine, buffer, buffer_size, *meter, output);
+			state.pieces.erase(it);
+			state.next_part++;
+		}
+
+		std::error_code size_error;
+		uint64_t sc_size = state.sc_part.empty() ? 0 : fs::file_size(state.sc_part, size_error);
+		if (ok && sc_size > 0 && state.merged + sc_size == state.header.package_size && state.merged_names.count(state.sc_part.filename().string()) == 0) {
+			ok = appendPiece(state.sc_part, "_sc part (final)", merged, state, engine, buffer, buffer_size, *meter, output);
+		}
+
+		if (ok && state.merged == state.header.package_size) {
+			break;
+		}
+		if (ok) {
+			string waiting = "[info] " + std::to_string(state.merged) + " of " + std::to_string(state.header.package_size) +
+				" bytes merged, waiting for piece _" + std::to_string(state.next_part);
+			if (!state.pieces.empty()) {
+				waiting += " (" + std::to_string(state.pieces.size()) + " later pieces held back)";
+			}
+			if (waiting != waiting_shown) {
+				printTo(output, "%s\n", waiting.c_str());
+				waiting_shown = waiting;
+			}
+		}
+	}
+
+	closeFile(merged);
+	freeAligned(buffer);
+	if (metrics != nullptr) {
+		for (size_t i = 0; meter != nullptr && i < meter->parts().size(); i++) {
+			const PartTiming& part = meter->parts()[i];
+			metrics->record("part", state.title_id, part.label, part.method, part.bytes, part.seconds);
+		}
+		metrics->record("watch", state.title_id, "", ok ? "ok" : "failed", state.merged, secondsSince(watch_started));
+	}
+	meter.reset();
+	if (!ok) {
+		if (!partial_file.empty()) {
+			printTo(output, "[error] watch merge failed, keeping the partial output %s\n", partial_file.string().c_str());
+		}
+		return "";
+	}
+
+	// The name is only known for sure now: an _sc tail names the output after itself
+	string output_name = state.title_id;
+	if (!state.sc_part.empty()) {
+		string sc_title;
+		int part;
+		bool sc;
+		parsePieceName(state.sc_part.filename().string(), sc_title, part, sc);
+		output_name = sc_title;
+	}
+	fs::path merged_file = target_dir / (output_name + "-merged.pkg");
+	fs::rename(partial_file, merged_file, error);
+	if (error) {
+		printTo(output, "[error] could not rename %s to %s: %s\n", partial_file.string().c_str(), merged_file.string().c_str(), error.message().c_str());
+		return "";
+	}
+	return merged_file.string();
+}
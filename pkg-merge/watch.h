@@ -0,0 +1,47 @@
+// watch.h : --watch, merging the pieces of a split PKG while they are still downloading
+//
+
+#pragma once
+
+#include "copyengine.h"
+#include "console.h"
+#include "metrics.h"
+#include <map>
+#include <string>
+#include <vector>
+
+// Reports files in one directory that have been completely written. On Linux that's inotify's
+// IN_CLOSE_WRITE / IN_MOVED_TO; elsewhere the directory is polled and a file counts as written once its
+// size and modification time stop changing between two polls.
+class DirectoryWatcher {
+public:
+	explicit DirectoryWatcher(const std::filesystem::path& dir);
+	~DirectoryWatcher();
+
+	DirectoryWatcher(const DirectoryWatcher&) = delete;
+	DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+	bool start();
+
+	// Waits up to `timeout_ms` and returns the names of the files finished in the meantime (possibly none)
+	std::vector<std::string> wait(int timeout_ms);
+
+private:
+	struct Snapshot {
+		uint64_t	size;
+		long long	mtime;
+		bool		reported;
+	};
+
+	std::filesystem::path					dir;
+	int										notify_fd;		// inotify instance, -1 when polling
+	std::map<std::string, Snapshot>			snapshots;		// Polling state
+};
+
+// Merges one split PKG (-single grouping) from `source_dir` while its pieces arrive. The root is copied
+// as soon as it's complete, then _1, _2, .. are appended in order as each one finishes, pieces that finish
+// early are held back until their turn, and the _sc tail goes last. The PKG header's package size says
+// when the set is complete. Messages go to `output`, and with `metrics` every piece and the whole watch are
+// timed for --metrics-json. Returns the created file, or an empty string if the merge failed.
+std::string watchAndMerge(const std::filesystem::path& source_dir, const std::filesystem::path& target_dir, CopyEngine engine,
+	const OutputSink& output, MetricsRecorder* metrics);